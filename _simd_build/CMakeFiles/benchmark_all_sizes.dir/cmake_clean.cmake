@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/benchmark_all_sizes.dir/root/repo/test/benchmark_all_sizes.cc.o"
+  "CMakeFiles/benchmark_all_sizes.dir/root/repo/test/benchmark_all_sizes.cc.o.d"
+  "benchmark_all_sizes"
+  "benchmark_all_sizes.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/benchmark_all_sizes.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
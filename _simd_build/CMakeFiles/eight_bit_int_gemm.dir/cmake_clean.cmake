@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/eight_bit_int_gemm.dir/root/repo/eight_bit_int_gemm/eight_bit_int_gemm.cc.o"
+  "CMakeFiles/eight_bit_int_gemm.dir/root/repo/eight_bit_int_gemm/eight_bit_int_gemm.cc.o.d"
+  "libeight_bit_int_gemm.pdb"
+  "libeight_bit_int_gemm.so"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/eight_bit_int_gemm.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
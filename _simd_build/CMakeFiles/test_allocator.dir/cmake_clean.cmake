@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_allocator.dir/root/repo/test/test_allocator.cc.o"
+  "CMakeFiles/test_allocator.dir/root/repo/test/test_allocator.cc.o.d"
+  "test_allocator"
+  "test_allocator.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/test_allocator.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_blocking_counter.dir/root/repo/test/test_blocking_counter.cc.o"
+  "CMakeFiles/test_blocking_counter.dir/root/repo/test/test_blocking_counter.cc.o.d"
+  "test_blocking_counter"
+  "test_blocking_counter.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/test_blocking_counter.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_fixedpoint.dir/root/repo/test/test_fixedpoint.cc.o"
+  "CMakeFiles/test_fixedpoint.dir/root/repo/test/test_fixedpoint.cc.o.d"
+  "test_fixedpoint"
+  "test_fixedpoint.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/test_fixedpoint.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,21 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/test/test.cc" "CMakeFiles/test_gemmlowp.dir/root/repo/test/test.cc.o" "gcc" "CMakeFiles/test_gemmlowp.dir/root/repo/test/test.cc.o.d"
+  "/root/repo/test/test_data.cc" "CMakeFiles/test_gemmlowp.dir/root/repo/test/test_data.cc.o" "gcc" "CMakeFiles/test_gemmlowp.dir/root/repo/test/test_data.cc.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  "/root/repo/_simd_build/CMakeFiles/eight_bit_int_gemm.dir/DependInfo.cmake"
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
@@ -0,0 +1,13 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_gemmlowp.dir/root/repo/test/test.cc.o"
+  "CMakeFiles/test_gemmlowp.dir/root/repo/test/test.cc.o.d"
+  "CMakeFiles/test_gemmlowp.dir/root/repo/test/test_data.cc.o"
+  "CMakeFiles/test_gemmlowp.dir/root/repo/test/test_data.cc.o.d"
+  "test_gemmlowp"
+  "test_gemmlowp.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/test_gemmlowp.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
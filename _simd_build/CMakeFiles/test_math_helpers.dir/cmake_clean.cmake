@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_math_helpers.dir/root/repo/test/test_math_helpers.cc.o"
+  "CMakeFiles/test_math_helpers.dir/root/repo/test/test_math_helpers.cc.o.d"
+  "test_math_helpers"
+  "test_math_helpers.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/test_math_helpers.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
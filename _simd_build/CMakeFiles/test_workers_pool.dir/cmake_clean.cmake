@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_workers_pool.dir/root/repo/test/test_workers_pool.cc.o"
+  "CMakeFiles/test_workers_pool.dir/root/repo/test/test_workers_pool.cc.o.d"
+  "test_workers_pool"
+  "test_workers_pool.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/test_workers_pool.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,18 @@
+# CMake generated Testfile for 
+# Source directory: /root/repo/contrib
+# Build directory: /root/repo/_simd_build
+# 
+# This file includes the relevant testing commands required for 
+# testing this directory and lists subdirectories to be tested as well.
+add_test(test_math_helpers "/root/repo/_simd_build/test_math_helpers")
+set_tests_properties(test_math_helpers PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/contrib/CMakeLists.txt;95;add_test;/root/repo/contrib/CMakeLists.txt;0;")
+add_test(test_blocking_counter "/root/repo/_simd_build/test_blocking_counter")
+set_tests_properties(test_blocking_counter PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/contrib/CMakeLists.txt;95;add_test;/root/repo/contrib/CMakeLists.txt;0;")
+add_test(test_workers_pool "/root/repo/_simd_build/test_workers_pool")
+set_tests_properties(test_workers_pool PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/contrib/CMakeLists.txt;95;add_test;/root/repo/contrib/CMakeLists.txt;0;")
+add_test(test_allocator "/root/repo/_simd_build/test_allocator")
+set_tests_properties(test_allocator PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/contrib/CMakeLists.txt;95;add_test;/root/repo/contrib/CMakeLists.txt;0;")
+add_test(test_fixedpoint "/root/repo/_simd_build/test_fixedpoint")
+set_tests_properties(test_fixedpoint PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/contrib/CMakeLists.txt;95;add_test;/root/repo/contrib/CMakeLists.txt;0;")
+add_test(test_gemmlowp "/root/repo/_simd_build/test_gemmlowp")
+set_tests_properties(test_gemmlowp PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/contrib/CMakeLists.txt;95;add_test;/root/repo/contrib/CMakeLists.txt;0;")
@@ -407,6 +407,14 @@ void SetMaxNumThreads(int n) {
   context->set_max_num_threads(n);
 }
 
+void SetWorkerIdleTimeoutMilliseconds(int milliseconds) {
+  ScopedLock sl(GlobalMutexes::EightBitIntGemm());
+  GemmContext* context = GetOrCreateGlobalContext();
+  context->set_worker_idle_timeout(
+      milliseconds < 0 ? std::chrono::nanoseconds::max()
+                       : std::chrono::milliseconds(milliseconds));
+}
+
 void FreePersistentResources() {
   ScopedLock sl(GlobalMutexes::EightBitIntGemm());
   DestroyGlobalContext();
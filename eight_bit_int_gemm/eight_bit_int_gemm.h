@@ -80,6 +80,12 @@ void FreePersistentResources();
 // Default value: 0.
 void SetMaxNumThreads(int n);
 
+// Makes worker threads free their buffers and exit after being idle for
+// the given number of milliseconds; they are recreated when next needed.
+// A negative value means that they never exit.
+// Default value: -1.
+void SetWorkerIdleTimeoutMilliseconds(int milliseconds);
+
 }  // namespace eight_bit_int_gemm
 
 }  // namespace gemmlowp
@@ -105,6 +105,10 @@ class Allocator {
     committed_ = true;
   }
 
+  // Frees the storage, e.g. before a long period of not using this
+  // allocator. The next Commit() allocates it again.
+  void FreeStorage() { DeallocateStorage(); }
+
   void Decommit() {
     assert(committed_);
     committed_ = false;
@@ -170,6 +174,7 @@ class Allocator {
   void DeallocateStorage() {
     assert(!committed_);
     aligned_free(storage_);
+    storage_ = nullptr;
     storage_size_ = 0;
   }
 
@@ -0,0 +1,225 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// cpu_topology.h: which CPUs we may run on, how they are grouped into
+// physical cores and sockets, pinning threads to them, and how many threads
+// to use by default.
+//
+// This is only implemented on Linux (including Android), where it is read
+// from sysfs. Elsewhere, each CPU is reported as its own physical core on
+// a single socket, and threads can't be pinned.
+
+#ifndef GEMMLOWP_INTERNAL_CPU_TOPOLOGY_H_
+#define GEMMLOWP_INTERNAL_CPU_TOPOLOGY_H_
+
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace gemmlowp {
+
+// A logical CPU, i.e. a hardware thread, as the OS numbers them.
+struct CpuInfo {
+  int cpu;
+  // The physical core that this CPU is a hardware thread of. Only unique
+  // within a socket.
+  int core_id;
+  // The socket (physical package) of this CPU.
+  int package_id;
+};
+
+#ifdef __linux__
+
+// Reads an integer from a sysfs file, returning false on failure.
+inline bool ReadSysfsInt(const char* path, int* value) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return false;
+  }
+  const bool success = fscanf(file, "%d", value) == 1;
+  fclose(file);
+  return success;
+}
+
+// Returns the CPUs that the current process may run on, in increasing
+// order. CPUs that are offline, or excluded by the process's affinity
+// mask (e.g. by taskset or a cgroup cpuset), are left out.
+inline std::vector<CpuInfo> GetCpuTopology() {
+  std::vector<CpuInfo> cpus;
+  cpu_set_t allowed;
+  const bool has_allowed =
+      sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+  const int cpus_count = GetSystemCpuCount();
+  for (int cpu = 0; cpu < cpus_count && cpu < CPU_SETSIZE; cpu++) {
+    if (has_allowed && !CPU_ISSET(cpu, &allowed)) {
+      continue;
+    }
+    CpuInfo info;
+    info.cpu = cpu;
+    char path[128];
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+    if (!ReadSysfsInt(path, &info.core_id)) {
+      info.core_id = cpu;
+    }
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+             cpu);
+    if (!ReadSysfsInt(path, &info.package_id)) {
+      info.package_id = 0;
+    }
+    cpus.push_back(info);
+  }
+  return cpus;
+}
+
+// Returns the CPU that the current thread is running on, or -1 if unknown.
+inline int GetCurrentCpu() { return sched_getcpu(); }
+
+// Restricts the current thread to run on the given CPUs. Returns false on
+// failure, e.g. if none of these CPUs is allowed.
+inline bool SetCurrentThreadAffinity(const std::vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+#else  // not __linux__
+
+inline std::vector<CpuInfo> GetCpuTopology() {
+  std::vector<CpuInfo> cpus;
+  const int cpus_count = GetSystemCpuCount();
+  for (int cpu = 0; cpu < cpus_count; cpu++) {
+    CpuInfo info;
+    info.cpu = cpu;
+    info.core_id = cpu;
+    info.package_id = 0;
+    cpus.push_back(info);
+  }
+  return cpus;
+}
+
+inline int GetCurrentCpu() { return -1; }
+
+inline bool SetCurrentThreadAffinity(const std::vector<int>&) {
+  return false;
+}
+
+#endif
+
+// Returns the number of distinct physical cores of the given CPUs.
+inline int CountPhysicalCores(const std::vector<CpuInfo>& topology) {
+  std::vector<std::pair<int, int>> cores;
+  for (const CpuInfo& info : topology) {
+    const std::pair<int, int> core(info.package_id, info.core_id);
+    if (std::find(cores.begin(), cores.end(), core) == cores.end()) {
+      cores.push_back(core);
+    }
+  }
+  return static_cast<int>(cores.size());
+}
+
+// How many threads GetHardwareConcurrency(0) returns, and what it was
+// derived from. In containers, the number of CPUs of the host is usually far
+// more than the process may use, which is limited by its affinity mask
+// (cpuset) and by its cgroup's CPU quota. Using more threads than that
+// quota gets all of them throttled for the rest of each scheduling period.
+//
+// With SMT (hyperthreading), the hardware threads of a physical core share
+// its SIMD units, which Gemm kernels keep busy, so running workers on two
+// hardware threads of the same core gains little and slows both down. So
+// by default, only one thread per physical core is used. To use all
+// hardware threads anyway, pass logical_threads to set_max_num_threads().
+struct HardwareConcurrencyInfo {
+  // The number of CPUs of the system.
+  int system_cpus = 0;
+  // The number of CPUs that the process may run on, or 0 if unknown.
+  int affinity_cpus = 0;
+  // The number of physical cores of those CPUs, or 0 if unknown.
+  int physical_cores = 0;
+  // The CPU time that the cgroup of the process may use per unit of real
+  // time, in CPUs, e.g. 2.5, or 0 if there is no quota.
+  double cgroup_cpu_quota = 0;
+  // The resulting thread counts: the least of the CPU counts above, with
+  // the quota rounded down, and at least 1. The default one, threads, is
+  // also at most the number of physical cores, unlike logical_threads.
+  int logical_threads = 1;
+  int threads = 1;
+};
+
+inline int ThreadsForHardwareConcurrency(const HardwareConcurrencyInfo& info,
+                                         bool one_per_physical_core) {
+  int threads = info.system_cpus;
+  if (info.affinity_cpus > 0 && info.affinity_cpus < threads) {
+    threads = info.affinity_cpus;
+  }
+  if (info.cgroup_cpu_quota > 0) {
+    // Quotas are ratios of integers, so allow for rounding errors.
+    const int quota_threads = static_cast<int>(info.cgroup_cpu_quota + 1e-6);
+    if (quota_threads < threads) {
+      threads = quota_threads;
+    }
+  }
+  if (one_per_physical_core && info.physical_cores > 0 &&
+      info.physical_cores < threads) {
+    threads = info.physical_cores;
+  }
+  return threads < 1 ? 1 : threads;
+}
+
+inline HardwareConcurrencyInfo DetectHardwareConcurrency() {
+  HardwareConcurrencyInfo info;
+  info.system_cpus = GetSystemCpuCount();
+  const std::vector<CpuInfo> topology = GetCpuTopology();
+  info.physical_cores = CountPhysicalCores(topology);
+#ifdef __linux__
+  info.affinity_cpus = static_cast<int>(topology.size());
+  info.cgroup_cpu_quota = ReadCgroupCpuQuota();
+#endif
+  info.logical_threads = ThreadsForHardwareConcurrency(info, false);
+  info.threads = ThreadsForHardwareConcurrency(info, true);
+  return info;
+}
+
+// Returns what DetectHardwareConcurrency() found on its first call, as it
+// does not change while the process runs.
+inline const HardwareConcurrencyInfo& GetHardwareConcurrencyInfo() {
+  static const HardwareConcurrencyInfo info = DetectHardwareConcurrency();
+  return info;
+}
+
+// Returns max_threads, or if it is 0, the number of threads that the
+// process may actually run in parallel, see HardwareConcurrencyInfo.
+inline int GetHardwareConcurrency(int max_threads) {
+  if (max_threads == 0) {
+    return GetHardwareConcurrencyInfo().threads;
+  }
+  return max_threads;
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_CPU_TOPOLOGY_H_
@@ -21,6 +21,7 @@
 #include "../public/map.h"
 #include "../public/output_stages.h"
 #include "multi_thread_gemm.h"
+#include "multi_thread_gemv.h"
 
 namespace gemmlowp {
 
@@ -92,11 +93,9 @@ struct TransposeImpl<OutputStageScaleInt32ByFixedPointAndExponentPC<Shape>> {
   typedef OutputStageScaleInt32ByFixedPointAndExponentPC<TransposedShape>
       DstType;
   static DstType Run(const SrcType& src) {
-    DstType dst;
-    dst.result_fixedpoint_multiplier =
-        Transpose(src.result_fixedpoint_multiplier);
-    dst.result_exponent = Transpose(src.result_exponent);
-    dst.result_offset_after_shift = src.result_offset_after_shift;
+    const DstType dst{Transpose(src.result_fixedpoint_multiplier),
+                      Transpose(src.result_exponent),
+                      src.result_offset_after_shift};
     return dst;
   }
 };
@@ -107,8 +106,7 @@ struct TransposeImpl<OutputStageBiasAddition<VectorMapType>> {
   typedef TransposeType<VectorMapType> TransposedVectorMapType;
   typedef OutputStageBiasAddition<TransposedVectorMapType> DstType;
   static DstType Run(const SrcType& src) {
-    DstType dst;
-    dst.bias_vector = Transpose(src.bias_vector);
+    const DstType dst{Transpose(src.bias_vector)};
     return dst;
   }
 };
@@ -186,6 +184,12 @@ void DispatchGemmShape(GemmContextType* context,
     return;
   }
 
+  // Gemms check for cancellation between blocks as they run, but GEMVs
+  // don't have blocks, so they are only checked for here.
+  if (context->cancelled()) {
+    return;
+  }
+
   if (rows < cols) {
     auto transposed_result_map = Transpose(*result);
     return DispatchGemmShape<InputScalar, OutputScalar, BitDepthParams>(
@@ -194,12 +198,216 @@ void DispatchGemmShape(GemmContextType* context,
         TransposeTuple(output_pipeline));
   }
 
+  if (cols <= kMaxGemvCols && IsGemvRhsOffsetSupported(rhs_offset, cols)) {
+    // Matrix*vector, or skinny GEMM with only a few RHS columns: packing
+    // would only add memory traffic, so use the dedicated GEMV path.
+    return MultiThreadGemv<InputScalar, OutputScalar, BitDepthParams>(
+        context, lhs, rhs, result, lhs_offset, rhs_offset, output_pipeline);
+  }
+
   typedef DefaultKernel<BitDepthParams> Kernel;
   MultiThreadGemm<typename Kernel::Format, InputScalar, OutputScalar,
                   BitDepthParams>(context, Kernel(), lhs, rhs, result,
                                   lhs_offset, rhs_offset, output_pipeline);
 }
 
+// Single-threaded counterpart of DispatchGemmShape, used to run the Gemms
+// of a batch, each on one thread.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType>
+void DispatchSingleThreadGemmShape(
+    SingleThreadGemmContext* context,
+    const MatrixMap<const InputScalar, LhsOrder>& lhs,
+    const MatrixMap<const InputScalar, RhsOrder>& rhs,
+    MatrixMap<OutputScalar, ResultOrder>* result, const LhsOffset& lhs_offset,
+    const RhsOffset& rhs_offset, const OutputPipelineType& output_pipeline) {
+  assert(lhs.cols() == rhs.rows());
+
+  int rows = result->rows();
+  int cols = result->cols();
+  int depth = lhs.cols();
+
+  if (rows == 0 || cols == 0 || depth == 0 || context->cancelled()) {
+    return;
+  }
+
+  if (rows < cols) {
+    auto transposed_result_map = Transpose(*result);
+    return DispatchSingleThreadGemmShape<InputScalar, OutputScalar,
+                                         BitDepthParams>(
+        context, Transpose(rhs), Transpose(lhs), &transposed_result_map,
+        Transpose(rhs_offset), Transpose(lhs_offset),
+        TransposeTuple(output_pipeline));
+  }
+
+  if (cols <= kMaxGemvCols && IsGemvRhsOffsetSupported(rhs_offset, cols)) {
+    return SingleThreadGemv<InputScalar, OutputScalar, BitDepthParams>(
+        context, lhs, rhs, result, lhs_offset, rhs_offset, output_pipeline);
+  }
+
+  typedef DefaultKernel<BitDepthParams> Kernel;
+  SingleThreadGemm<typename Kernel::Format, InputScalar, OutputScalar,
+                   BitDepthParams>(context, Kernel(), lhs, rhs, result,
+                                   lhs_offset, rhs_offset, output_pipeline);
+}
+
+// One Gemm of a batch, see DispatchGemmBatch.
+template <typename InputScalar, typename OutputScalar, MapOrder LhsOrder,
+          MapOrder RhsOrder, MapOrder ResultOrder>
+struct GemmBatchEntry {
+  GemmBatchEntry(const MatrixMap<const InputScalar, LhsOrder>& _lhs,
+                 const MatrixMap<const InputScalar, RhsOrder>& _rhs,
+                 const MatrixMap<OutputScalar, ResultOrder>& _result)
+      : lhs(_lhs), rhs(_rhs), result(_result) {}
+
+  MatrixMap<const InputScalar, LhsOrder> lhs;
+  MatrixMap<const InputScalar, RhsOrder> rhs;
+  MatrixMap<OutputScalar, ResultOrder> result;
+};
+
+// The task that each thread runs in DispatchGemmBatch: it takes the next
+// Gemm of the batch that no thread has taken yet, runs it single-threaded,
+// and so on until there are none left. So a thread that gets larger Gemms
+// simply takes fewer of them.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename OutputPipelineType>
+struct GemmBatchTask : Task {
+  typedef GemmBatchEntry<InputScalar, OutputScalar, LhsOrder, RhsOrder,
+                         ResultOrder>
+      EntryType;
+
+  GemmBatchTask(SingleThreadGemmContext* _context, const EntryType* _entries,
+                int _count, std::atomic<int>* _next_entry, int _lhs_offset,
+                int _rhs_offset, const OutputPipelineType& _output_pipeline)
+      : context(_context),
+        entries(_entries),
+        count(_count),
+        next_entry(_next_entry),
+        lhs_offset(_lhs_offset),
+        rhs_offset(_rhs_offset),
+        output_pipeline(_output_pipeline) {}
+
+  void Run() override {
+    ScopedProfilingLabel label("GemmBatchTask");
+    typedef VectorDup<const std::int32_t, VectorShape::Col> OffsetColDup;
+    typedef VectorDup<const std::int32_t, VectorShape::Row> OffsetRowDup;
+    int index;
+    while (!context->cancelled() &&
+           (index = next_entry->fetch_add(1, std::memory_order_relaxed)) <
+               count) {
+      const EntryType& entry = entries[index];
+      MatrixMap<OutputScalar, ResultOrder> result = entry.result;
+      const OffsetColDup lhs_offset_vector(lhs_offset, entry.lhs.rows());
+      const OffsetRowDup rhs_offset_vector(rhs_offset, entry.rhs.cols());
+      DispatchSingleThreadGemmShape<InputScalar, OutputScalar, BitDepthParams>(
+          context, entry.lhs, entry.rhs, &result, lhs_offset_vector,
+          rhs_offset_vector, output_pipeline);
+    }
+  }
+
+  SingleThreadGemmContext* context;
+  const EntryType* entries;
+  const int count;
+  std::atomic<int>* next_entry;
+  const int lhs_offset;
+  const int rhs_offset;
+  const OutputPipelineType& output_pipeline;
+};
+
+// Determines how many threads should be used for a batch of Gemms: one per
+// Gemm at most, and only as many as the total work is worth.
+template <typename EntryType>
+int HowManyGemmBatchThreads(int max_num_threads,
+                            const GemmCostModel& cost_model,
+                            const EntryType* entries, int count) {
+  if (max_num_threads == 1) {
+    return 1;
+  }
+  const int max_count = GetHardwareConcurrency(max_num_threads);
+  std::uint64_t cubic_size = 0;
+  for (int i = 0; i < count; i++) {
+    cubic_size += std::uint64_t(entries[i].result.rows()) *
+                  std::uint64_t(entries[i].result.cols()) *
+                  std::uint64_t(entries[i].lhs.cols());
+  }
+  const std::uint64_t thread_count =
+      std::min<std::uint64_t>(std::min(max_count, count),
+                              MaxThreadsForWork(cost_model, cubic_size));
+  return std::max<int>(thread_count, 1);
+}
+
+// Runs a batch of independent Gemms, sharing the same offsets and output
+// pipeline. Gemms small enough to be single-threaded would leave the other
+// threads idle if run one after the other, so instead, whole Gemms are
+// spread across threads, each running its Gemms single-threaded with its
+// own context (see MultiThreadGemmContextBase::batch_thread_context).
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename OutputPipelineType, typename GemmContextType>
+void DispatchGemmBatch(GemmContextType* context,
+                       const GemmBatchEntry<InputScalar, OutputScalar, LhsOrder,
+                                            RhsOrder, ResultOrder>* entries,
+                       int count, int lhs_offset, int rhs_offset,
+                       const OutputPipelineType& output_pipeline) {
+  ScopedProfilingLabel label("gemmlowp::DispatchGemmBatch");
+  if (count == 0) {
+    return;
+  }
+  typedef GemmBatchTask<InputScalar, OutputScalar, BitDepthParams, LhsOrder,
+                        RhsOrder, ResultOrder, OutputPipelineType>
+      TaskType;
+  std::atomic<int> next_entry(0);
+  const int thread_count =
+      HowManyGemmBatchThreads(context->max_num_threads(),
+                              context->gemm_cost_model(), entries, count);
+  if (thread_count == 1) {
+    TaskType(context, entries, count, &next_entry, lhs_offset, rhs_offset,
+             output_pipeline)
+        .Run();
+    return;
+  }
+  std::vector<TaskType> tasks;
+  tasks.reserve(thread_count);
+  for (int i = 0; i < thread_count; i++) {
+    tasks.emplace_back(context->batch_thread_context(i), entries, count,
+                       &next_entry, lhs_offset, rhs_offset, output_pipeline);
+  }
+  context->workers_pool()->Execute(thread_count, tasks.data());
+}
+
+// Counterpart of DispatchGemmShape for a LHS that has already been packed
+// into a PackedLhsMatrix. There is no transposition here, since the packed
+// LHS can only be used as a LHS. The PackedLhsMatrix must have been packed
+// for the format of the default kernel for the given BitDepthParams.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          typename KernelFormat, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType,
+          typename GemmContextType>
+void DispatchGemmWithPackedLhs(
+    GemmContextType* context, const PackedLhsMatrix<KernelFormat>& packed_lhs,
+    const MatrixMap<const InputScalar, RhsOrder>& rhs,
+    MatrixMap<OutputScalar, ResultOrder>* result, const LhsOffset& lhs_offset,
+    const RhsOffset& rhs_offset, const OutputPipelineType& output_pipeline) {
+  typedef DefaultKernel<BitDepthParams> Kernel;
+  static_assert(std::is_same<KernelFormat, typename Kernel::Format>::value,
+                "PackedLhsMatrix was not packed for the default kernel format "
+                "of these BitDepthParams");
+
+  assert(packed_lhs.depth() == rhs.rows());
+  assert(packed_lhs.rows() == result->rows());
+
+  if (result->cols() == 0 || context->cancelled()) {
+    return;
+  }
+
+  MultiThreadGemmWithPackedLhs<KernelFormat, InputScalar, OutputScalar,
+                               BitDepthParams>(
+      context, Kernel(), packed_lhs, rhs, result, lhs_offset, rhs_offset,
+      output_pipeline);
+}
+
 }  // end namespace gemmlowp
 
 #endif  // GEMMLOWP_INTERNAL_DISPATCH_GEMM_SHAPE_H_
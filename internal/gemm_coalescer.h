@@ -0,0 +1,240 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// gemm_coalescer.h: coalescing concurrent Gemms that share the same LHS.
+//
+// A GEMV, or a Gemm with only a few RHS columns, is bound by memory
+// bandwidth: each LHS entry is loaded for only a few multiply-adds (see
+// multi_thread_gemv.h). When many threads each multiply the same weights
+// LHS by their own few columns, as inference servers do with concurrent
+// requests, GemmCoalescer gathers their columns into one wide RHS and runs
+// a single Gemm, which loads the LHS once for all of them and is
+// compute-bound instead.
+
+#ifndef GEMMLOWP_INTERNAL_GEMM_COALESCER_H_
+#define GEMMLOWP_INTERNAL_GEMM_COALESCER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "dispatch_gemm_shape.h"
+
+namespace gemmlowp {
+
+// The quantization parameters of one Gemm submitted to a GemmCoalescer.
+// Its result is that of a Gemm with this RHS offset, whose output pipeline
+// is an OutputStageScaleInt32ByFixedPointAndExponent with these parameters
+// followed by an OutputStageSaturatingCastToUint8.
+struct CoalescedGemmParams {
+  std::int32_t rhs_offset;
+  std::int32_t result_fixedpoint_multiplier;
+  std::int32_t result_exponent;
+  std::int32_t result_offset_after_shift;
+};
+
+// Runs the Gemms that threads submit concurrently with the same LHS as one
+// Gemm. The first Gemm submitted while no batch is being gathered starts a
+// batch, which is run once the given time window has passed since then, or
+// as soon as at least max_cols RHS columns have been gathered, whichever
+// comes first. The thread that started a batch runs it, on the context,
+// while the others wait. Example:
+//
+//   GemmCoalescer<DefaultL8R8BitDepthParams, MapOrder::RowMajor,
+//                 GemmContext>
+//       coalescer(&context, weights, weights_offset,
+//                 std::chrono::microseconds(200), 64);
+//   // In each thread serving requests:
+//   coalescer.Gemm(input, &output, params);
+//
+// The context must not be used otherwise while the coalescer is in use, and
+// the LHS must stay valid as long as the coalescer. Each batch runs after
+// the previous one has completed, while the next one is being gathered.
+template <typename BitDepthParams, MapOrder LhsOrder, typename GemmContextType>
+class GemmCoalescer {
+ public:
+  typedef MatrixMap<const std::uint8_t, LhsOrder> LhsMap;
+  typedef MatrixMap<const std::uint8_t, MapOrder::ColMajor> RhsMap;
+  typedef MatrixMap<std::uint8_t, MapOrder::ColMajor> ResultMap;
+
+  GemmCoalescer(GemmContextType* context, const LhsMap& lhs, int lhs_offset,
+                std::chrono::nanoseconds window, int max_cols)
+      : context_(context),
+        lhs_(lhs),
+        lhs_offset_(lhs_offset),
+        window_(window),
+        max_cols_(max_cols) {}
+
+  // Computes the product of the LHS by rhs into result, with the given
+  // parameters, in the same Gemm as those that other threads submit
+  // meanwhile. Returns once result has been written.
+  void Gemm(const RhsMap& rhs, ResultMap* result,
+            const CoalescedGemmParams& params) {
+    assert(rhs.rows() == lhs_.cols());
+    assert(result->rows() == lhs_.rows());
+    assert(result->cols() == rhs.cols());
+    Request request = {rhs, *result, params, false};
+    std::unique_lock<std::mutex> lock(mutex_);
+    pending_.push_back(&request);
+    pending_cols_ += rhs.cols();
+    request_count_++;
+    if (gathering_) {
+      if (pending_cols_ >= max_cols_) {
+        leader_cond_.notify_all();
+      }
+      done_cond_.wait(lock, [&request]() { return request.done; });
+      return;
+    }
+
+    // Gather a batch, and wait for the previous one to have completed.
+    gathering_ = true;
+    const auto deadline = std::chrono::steady_clock::now() + window_;
+    leader_cond_.wait_until(
+        lock, deadline, [this]() { return pending_cols_ >= max_cols_; });
+    leader_cond_.wait(lock, [this]() { return !running_; });
+    running_ = true;
+    gathering_ = false;
+    batch_.swap(pending_);
+    pending_.clear();
+    pending_cols_ = 0;
+    lock.unlock();
+
+    RunBatch();
+
+    lock.lock();
+    running_ = false;
+    gemm_count_++;
+    for (Request* r : batch_) {
+      r->done = true;
+    }
+    done_cond_.notify_all();
+    leader_cond_.notify_all();
+  }
+
+  // The number of Gemms that have been run, and the number of calls to
+  // Gemm() that they covered.
+  int gemm_count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return gemm_count_;
+  }
+
+  int request_count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return request_count_;
+  }
+
+ private:
+  struct Request {
+    RhsMap rhs;
+    ResultMap result;
+    CoalescedGemmParams params;
+    bool done;
+  };
+
+  // Concatenates the RHS of the Gemms of batch_, along with their
+  // parameters for each column, runs them as one Gemm, and copies their
+  // columns of the result back.
+  void RunBatch() {
+    ScopedProfilingLabel label("GemmCoalescer::RunBatch");
+    const int rows = lhs_.rows();
+    const int depth = lhs_.cols();
+    int cols = 0;
+    for (const Request* request : batch_) {
+      cols += request->rhs.cols();
+    }
+    rhs_buffer_.resize(depth * cols);
+    result_buffer_.resize(rows * cols);
+    rhs_offsets_.resize(cols);
+    multipliers_.resize(cols);
+    exponents_.resize(cols);
+    offsets_after_shift_.resize(cols);
+
+    int col = 0;
+    for (const Request* request : batch_) {
+      for (int c = 0; c < request->rhs.cols(); c++, col++) {
+        std::memcpy(&rhs_buffer_[col * depth], request->rhs.data(0, c),
+                    depth);
+        rhs_offsets_[col] = request->params.rhs_offset;
+        multipliers_[col] = request->params.result_fixedpoint_multiplier;
+        exponents_[col] = request->params.result_exponent;
+        offsets_after_shift_[col] = request->params.result_offset_after_shift;
+      }
+    }
+
+    // The offsets after shift are added by a separate stage, as the scaling
+    // stage only takes a single one.
+    typedef VectorMap<const std::int32_t, VectorShape::Row> ColsVector;
+    const ColsVector multipliers(multipliers_.data(), cols);
+    const ColsVector exponents(exponents_.data(), cols);
+    const ColsVector offsets_after_shift(offsets_after_shift_.data(), cols);
+    const OutputStageScaleInt32ByFixedPointAndExponentPC<VectorShape::Row>
+        scale_stage{multipliers, exponents, 0};
+    const OutputStageBiasAddition<ColsVector> offset_stage{
+        offsets_after_shift};
+    const auto output_pipeline = std::make_tuple(
+        scale_stage, offset_stage, OutputStageSaturatingCastToUint8());
+
+    const RhsMap rhs(rhs_buffer_.data(), depth, cols);
+    ResultMap result(result_buffer_.data(), rows, cols);
+    DispatchGemmShape<std::uint8_t, std::uint8_t, BitDepthParams>(
+        context_, lhs_, rhs, &result,
+        VectorDup<const std::int32_t, VectorShape::Col>(lhs_offset_, rows),
+        ColsVector(rhs_offsets_.data(), cols), output_pipeline);
+
+    col = 0;
+    for (Request* request : batch_) {
+      for (int c = 0; c < request->result.cols(); c++, col++) {
+        std::memcpy(request->result.data(0, c), result.data(0, col), rows);
+      }
+    }
+  }
+
+  GemmContextType* const context_;
+  const LhsMap lhs_;
+  const int lhs_offset_;
+  const std::chrono::nanoseconds window_;
+  const int max_cols_;
+
+  mutable std::mutex mutex_;
+  // Signaled to the thread gathering a batch, when enough columns have been
+  // gathered or when the previous batch has completed.
+  std::condition_variable leader_cond_;
+  // Signaled to the threads waiting for their Gemm, when a batch completes.
+  std::condition_variable done_cond_;
+
+  // The Gemms of the batch being gathered, and their number of columns.
+  std::vector<Request*> pending_;
+  int pending_cols_ = 0;
+  bool gathering_ = false;
+  // The Gemms of the batch being run, if running_.
+  std::vector<Request*> batch_;
+  bool running_ = false;
+  int gemm_count_ = 0;
+  int request_count_ = 0;
+
+  // Only used by RunBatch, so that their storage is reused from one batch
+  // to the next.
+  std::vector<std::uint8_t> rhs_buffer_;
+  std::vector<std::uint8_t> result_buffer_;
+  std::vector<std::int32_t> rhs_offsets_;
+  std::vector<std::int32_t> multipliers_;
+  std::vector<std::int32_t> exponents_;
+  std::vector<std::int32_t> offsets_after_shift_;
+};
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_GEMM_COALESCER_H_
@@ -0,0 +1,200 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// gemm_cost_model.h: the GemmCostModel that decides how many threads Gemms
+// use (see multi_thread_gemm.h), and its calibration.
+//
+// The fixed thresholds used by default are a compromise across hosts: too
+// high for many-core servers, where threads are cheap to wake relative to
+// the work of a Gemm, and too low for small devices, where they aren't.
+// Calibration instead measures both on the host.
+
+#ifndef GEMMLOWP_INTERNAL_GEMM_COST_MODEL_H_
+#define GEMMLOWP_INTERNAL_GEMM_COST_MODEL_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "cpu_topology.h"
+#include "kernel_default.h"
+#include "single_thread_gemm.h"
+#include "task.h"
+
+namespace gemmlowp {
+
+// The minimum amount of work, in multiply-adds (rows*cols*depth), for a
+// thread to be worth waking up. Empirically determined value, used unless
+// a GemmCostModel has been calibrated for the host.
+const std::uint64_t kMinCubicSizePerThread = 64 * 1024;
+
+// A model of the cost of multi-threaded Gemms on the host, used to decide
+// how many threads a given amount of work is worth: each thread computes
+// its share of the multiply-adds at a given rate, and each thread beyond
+// the first adds a fixed overhead, that of handing it work and waiting for
+// it. See CalibrateGemmCostModel below.
+struct GemmCostModel {
+  // The overhead of each thread beyond the first, in seconds.
+  double thread_overhead_seconds = 0;
+  // The rate at which one thread computes multiply-adds, per second.
+  double multiply_adds_per_second = 0;
+
+  // Whether this model has been calibrated. Otherwise, thread counts are
+  // chosen by the fixed kMinCubicSizePerThread threshold.
+  bool calibrated() const {
+    return thread_overhead_seconds > 0 && multiply_adds_per_second > 0;
+  }
+};
+
+// Returns the number of threads that minimizes the estimated time of the
+// given amount of work (in multiply-adds), not taking into account how many
+// threads there are.
+inline std::uint64_t MaxThreadsForWork(const GemmCostModel& cost_model,
+                                       std::uint64_t cubic_size) {
+  if (!cost_model.calibrated()) {
+    return cubic_size / kMinCubicSizePerThread;
+  }
+  // With n threads, the estimated time is
+  //   cubic_size / (n * multiply_adds_per_second)
+  //     + (n - 1) * thread_overhead_seconds,
+  // which is minimal for n = sqrt(cubic_size / (multiply_adds_per_second *
+  // thread_overhead_seconds)).
+  return static_cast<std::uint64_t>(
+      std::sqrt(cubic_size / (cost_model.multiply_adds_per_second *
+                              cost_model.thread_overhead_seconds)));
+}
+
+// Serializes a calibrated cost model, so that applications can persist it
+// rather than calibrate again on each run on the same host.
+inline std::string SerializeGemmCostModel(const GemmCostModel& cost_model) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "gemmlowp_cost_model_v1 %.9g %.9g",
+           cost_model.thread_overhead_seconds,
+           cost_model.multiply_adds_per_second);
+  return buf;
+}
+
+// Parses a string returned by SerializeGemmCostModel. Returns false, leaving
+// cost_model unchanged, if it is not a valid calibrated cost model.
+inline bool ParseGemmCostModel(const std::string& str,
+                               GemmCostModel* cost_model) {
+  GemmCostModel parsed;
+  char trailing;
+  if (sscanf(str.c_str(), "gemmlowp_cost_model_v1 %lf %lf %c",
+             &parsed.thread_overhead_seconds, &parsed.multiply_adds_per_second,
+             &trailing) != 2 ||
+      !parsed.calibrated()) {
+    return false;
+  }
+  *cost_model = parsed;
+  return true;
+}
+
+// Size of the square Gemm measuring the single-thread throughput: large
+// enough for its time to be dominated by the kernel, small enough for the
+// calibration to only take some tens of milliseconds.
+const int kCostModelGemmSize = 256;
+
+// Number of runs of each measurement, of which the best or the median is
+// kept, to filter out preemptions.
+const int kCostModelGemmRuns = 5;
+const int kCostModelDispatchRuns = 101;
+
+struct CostModelEmptyTask : Task {
+  void Run() override {}
+};
+
+// Measures a GemmCostModel on the host, using the threads of the context's
+// WorkersPool. The thread overhead is measured with all the threads that
+// the context may use, as waking up more threads takes longer.
+template <typename GemmContextType>
+GemmCostModel MeasureGemmCostModel(GemmContextType* context) {
+  ScopedProfilingLabel label("MeasureGemmCostModel");
+  GemmCostModel cost_model;
+
+  // Single-thread throughput, taking the best of a few runs.
+  typedef DefaultL8R8BitDepthParams BitDepthParams;
+  typedef DefaultKernel<BitDepthParams> Kernel;
+  typedef VectorDup<const std::int32_t, VectorShape::Col> OffsetColDup;
+  typedef VectorDup<const std::int32_t, VectorShape::Row> OffsetRowDup;
+  const int size = kCostModelGemmSize;
+  std::vector<std::uint8_t> lhs_data(size * size, 1);
+  std::vector<std::uint8_t> rhs_data(size * size, 1);
+  std::vector<std::int32_t> result_data(size * size);
+  const MatrixMap<const std::uint8_t, MapOrder::RowMajor> lhs(lhs_data.data(),
+                                                              size, size);
+  const MatrixMap<const std::uint8_t, MapOrder::ColMajor> rhs(rhs_data.data(),
+                                                              size, size);
+  MatrixMap<std::int32_t, MapOrder::ColMajor> result(result_data.data(), size,
+                                                     size);
+  const OffsetColDup lhs_offset(0, size);
+  const OffsetRowDup rhs_offset(0, size);
+  double best_gemm_time = 0;
+  for (int run = 0; run < kCostModelGemmRuns; run++) {
+    const double start_time = real_time_in_seconds();
+    SingleThreadGemm<typename Kernel::Format, std::uint8_t, std::int32_t,
+                     BitDepthParams>(context, Kernel(), lhs, rhs, &result,
+                                     lhs_offset, rhs_offset, std::make_tuple());
+    const double time = real_time_in_seconds() - start_time;
+    if (run == 0 || time < best_gemm_time) {
+      best_gemm_time = time;
+    }
+  }
+  cost_model.multiply_adds_per_second =
+      static_cast<double>(size) * size * size / best_gemm_time;
+
+  // Thread overhead, from the median time of executing empty tasks. The
+  // first run also serves to start the worker threads.
+  const int thread_count =
+      std::max(2, GetHardwareConcurrency(context->max_num_threads()));
+  std::vector<CostModelEmptyTask> tasks(thread_count);
+  std::vector<double> dispatch_times(kCostModelDispatchRuns);
+  context->workers_pool()->Execute(thread_count, tasks.data());
+  for (int run = 0; run < kCostModelDispatchRuns; run++) {
+    const double start_time = real_time_in_seconds();
+    context->workers_pool()->Execute(thread_count, tasks.data());
+    dispatch_times[run] = real_time_in_seconds() - start_time;
+  }
+  std::nth_element(dispatch_times.begin(),
+                   dispatch_times.begin() + kCostModelDispatchRuns / 2,
+                   dispatch_times.end());
+  cost_model.thread_overhead_seconds =
+      dispatch_times[kCostModelDispatchRuns / 2] / (thread_count - 1);
+  // Timer resolution might make an empty dispatch appear free.
+  cost_model.thread_overhead_seconds =
+      std::max(cost_model.thread_overhead_seconds, 1e-9);
+  return cost_model;
+}
+
+// Calibrates the cost model of the given context, see MeasureGemmCostModel.
+// Example, persisting the calibration across runs:
+//
+//   GemmCostModel cost_model;
+//   if (!ParseGemmCostModel(ReadSavedCalibration(), &cost_model)) {
+//     CalibrateGemmCostModel(&context);
+//     SaveCalibration(SerializeGemmCostModel(context.gemm_cost_model()));
+//   } else {
+//     context.set_gemm_cost_model(cost_model);
+//   }
+template <typename GemmContextType>
+void CalibrateGemmCostModel(GemmContextType* context) {
+  context->set_gemm_cost_model(MeasureGemmCostModel(context));
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_GEMM_COST_MODEL_H_
@@ -21,23 +21,26 @@
 
 #include <atomic>  // NOLINT
 #include <chrono>  // NOLINT
+#include <condition_variable>  // NOLINT
+#include <functional>
+#include <memory>
+#include <mutex>  // NOLINT
 #include <thread>  // NOLINT
 #include <vector>
 
+#include "cpu_topology.h"
+#include "gemm_cost_model.h"
 #include "single_thread_gemm.h"
+#include "task.h"
 
 namespace gemmlowp {
 
-// This value was empirically derived on an end-to-end application benchmark.
-// That this number of cycles means that we may be sleeping substantially longer
-// than a scheduler timeslice's duration is not necessarily surprising. The
-// idea is to pick up quickly new work after having finished the previous
+// The default maximum duration of busy-waiting before passively waiting.
+// The idea is to pick up quickly new work after having finished the previous
 // workload. When it's new work within the same GEMM as the previous work, the
-// time interval that we might be busy-waiting is very small, so for that
-// purpose it would be more than enough to sleep for 1 million cycles.
-// That is all what we would observe on a GEMM benchmark. However, in a real
-// application, after having finished a GEMM, we might do unrelated work for
-// a little while, then start on a new GEMM. Think of a neural network
+// time interval that we might be busy-waiting is very small. However, in a
+// real application, after having finished a GEMM, we might do unrelated work
+// for a little while, then start on a new GEMM. Think of a neural network
 // application performing inference, where many but not all layers are
 // implemented by a GEMM. In such cases, our worker threads might be idle for
 // longer periods of time before having work again. If we let them passively
@@ -47,43 +50,168 @@ namespace gemmlowp {
 // GEMM. So we need to strike a balance that reflects typical time intervals
 // between consecutive GEMM invokations, not just intra-GEMM considerations.
 // Of course, we need to balance keeping CPUs spinning longer to resume work
-// faster, versus passively waiting to conserve power.
-const int kMaxBusyWaitNOPs = 4 * 1000 * 1000;
+// faster, versus passively waiting to conserve power, or, on shared hosts,
+// to leave the CPU to other processes. That is why this is only a ceiling:
+// see BusyWaitBudget for how idle workers adapt to the actual intervals
+// between GEMMs, WorkersPool::set_max_busy_wait_duration to change it, and
+// ScopedHotWorkers to lift it during a sequence of GEMMs.
+//
+// This is a duration rather than a count of NOP instructions, so that it
+// doesn't depend on the CPU frequency.
+const std::chrono::nanoseconds kDefaultMaxBusyWaitDuration =
+    std::chrono::milliseconds(2);
+
+// Idle workers busy-wait at least this long, up to the maximum above, as
+// it is about the cost of being woken up from passive waiting.
+const std::chrono::nanoseconds kMinBusyWaitDuration =
+    std::chrono::microseconds(50);
 
-// On X86 and ARM platforms we may use NOP instructions to know how long we
-// are busy-waiting.
+// Tells the CPU that we are busy-waiting: on x86, the PAUSE instruction
+// avoids a costly memory order violation when exiting the loop and frees
+// resources for the sibling hyperthread; on ARM, YIELD is the equivalent hint.
 
 #if defined(GEMMLOWP_ALLOW_INLINE_ASM) && !defined(GEMMLOWP_NO_BUSYWAIT) && \
     (defined(GEMMLOWP_ARM) || defined(GEMMLOWP_X86))
 
-#define GEMMLOWP_NOP "nop\n"
+inline void SpinPause() {
+#ifdef GEMMLOWP_X86
+  asm volatile("pause\n");
+#else
+  asm volatile("yield\n");
+#endif
+}
+
+#else  // May not use asm.
 
-#define GEMMLOWP_STRING_CONCAT_4(X) X X X X
-#define GEMMLOWP_NOP4 GEMMLOWP_STRING_CONCAT_4(GEMMLOWP_NOP)
-#define GEMMLOWP_NOP16 GEMMLOWP_STRING_CONCAT_4(GEMMLOWP_NOP4)
-#define GEMMLOWP_NOP64 GEMMLOWP_STRING_CONCAT_4(GEMMLOWP_NOP16)
+// If we can't use pause instructions, let's use a non-inline function call
+// as a basic thing that has some vaguely known, nonzero cost.
+GEMMLOWP_NOINLINE
+inline void SpinPause() {}
+#endif
 
-inline int DoSomeNOPs() {
-  asm volatile(GEMMLOWP_NOP64);
-  return 64;
+// Busy-waits until pred() returns true, or until the given duration has
+// elapsed. Returns whether pred() returned true. Reading the clock is much
+// more expensive than pred() and SpinPause(), so it is only read every few
+// iterations.
+template <typename Predicate>
+bool BusyWaitUntil(const Predicate& pred, std::chrono::nanoseconds duration) {
+  if (duration <= std::chrono::nanoseconds::zero()) {
+    return pred();
+  }
+  static const int kSpinsPerClockRead = 16;
+  const auto deadline = std::chrono::steady_clock::now() + duration;
+  while (true) {
+    for (int i = 0; i < kSpinsPerClockRead; i++) {
+      if (pred()) {
+        return true;
+      }
+      SpinPause();
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return pred();
+    }
+  }
 }
 
-#undef GEMMLOWP_STRING_CONCAT_4
-#undef GEMMLOWP_NOP64
-#undef GEMMLOWP_NOP16
-#undef GEMMLOWP_NOP4
-#undef GEMMLOWP_NOP
+// Lets threads passively wait for an atomic 32-bit variable to change value,
+// and wakes them up when it does.
+//
+// Where available, this is a futex on the variable itself, so that neither
+// waiting nor waking up takes any lock. Elsewhere, this is a condition
+// variable guarded by a mutex. In both cases, NotifyAll only makes a system
+// call when some thread is actually waiting, which is rarely the case, since
+// threads first busy-wait for a while before waiting passively.
+class VariableChangeNotifier {
+ public:
+  VariableChangeNotifier() : waiters_count_(0) {
+#ifndef GEMMLOWP_USE_FUTEX
+    pthread_cond_init(&cond_, nullptr);
+    pthread_mutex_init(&mutex_, nullptr);
+#endif
+  }
+
+  ~VariableChangeNotifier() {
+#ifndef GEMMLOWP_USE_FUTEX
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+#endif
+  }
 
-#else  // May not use asm NOP.
+  // Waits until *var != value, or until woken up by NotifyAll(var), or
+  // until the given timeout has elapsed; the default is no timeout.
+  // May also return spuriously.
+  template <typename T>
+  void Wait(
+      std::atomic<T>* var, T value,
+      std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()) {
+    static_assert(sizeof(std::atomic<T>) == sizeof(std::int32_t),
+                  "Can only wait for changes of 32-bit variables");
+    const bool has_timeout = timeout != std::chrono::nanoseconds::max();
+    waiters_count_.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+#ifdef GEMMLOWP_USE_FUTEX
+    if (var->load(std::memory_order_relaxed) == value) {
+      std::int32_t value_as_int32;
+      memcpy(&value_as_int32, &value, sizeof(value_as_int32));
+      timespec relative_timeout;
+      relative_timeout.tv_sec = timeout.count() / 1000000000;
+      relative_timeout.tv_nsec = timeout.count() % 1000000000;
+      FutexWait(var, value_as_int32, has_timeout ? &relative_timeout : nullptr);
+    }
+#else
+    timespec deadline;
+    if (has_timeout) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      const std::int64_t nanoseconds =
+          deadline.tv_nsec + timeout.count() % 1000000000;
+      deadline.tv_sec +=
+          timeout.count() / 1000000000 + nanoseconds / 1000000000;
+      deadline.tv_nsec = nanoseconds % 1000000000;
+    }
+    pthread_mutex_lock(&mutex_);
+    while (var->load(std::memory_order_relaxed) == value) {
+      if (!has_timeout) {
+        pthread_cond_wait(&cond_, &mutex_);
+      } else if (pthread_cond_timedwait(&cond_, &mutex_, &deadline)) {
+        break;
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+#endif
+    waiters_count_.fetch_sub(1, std::memory_order_relaxed);
+  }
 
-// If we can't use NOPs, let's use a non-inline function call as a basic
-// thing that has some vaguely known, nonzero cost.
-GEMMLOWP_NOINLINE
-inline int DoSomeNOPs() {
-  // Pretend that calling an empty function takes as long as 16 NOPs...
-  return 16;
-}
+  // Wakes up the threads waiting on var. Must be called after each change
+  // of the value of var that waiting threads may be waiting for.
+  template <typename T>
+  void NotifyAll(std::atomic<T>* var) {
+    // Pairs with the fence in Wait: either the waiting thread sees the new
+    // value of var, or we see that it is waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!waiters_count_.load(std::memory_order_relaxed)) {
+      return;
+    }
+#ifdef GEMMLOWP_USE_FUTEX
+    FutexWakeAll(var);
+#else
+    (void)var;
+    pthread_mutex_lock(&mutex_);
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+#endif
+  }
+
+ private:
+  VariableChangeNotifier(const VariableChangeNotifier&) = delete;
+
+  // The number of threads currently in Wait().
+  std::atomic<int> waiters_count_;
+
+#ifndef GEMMLOWP_USE_FUTEX
+  pthread_cond_t cond_;
+  pthread_mutex_t mutex_;
 #endif
+};
 
 // Waits until *var != initial_value.
 //
@@ -94,9 +222,10 @@ inline int DoSomeNOPs() {
 // still the value of *var when this function returns, since *var is
 // not assumed to be guarded by any lock.
 //
-// First does some busy-waiting for a fixed number of no-op cycles,
-// then falls back to passive waiting for the given condvar, guarded
-// by the given mutex.
+// First does some busy-waiting for the given duration, then falls back to
+// passive waiting with the given notifier, which must be notified of all
+// changes of *var. Passive waiting stops after passive_wait_timeout, if
+// given, in which case initial_value is returned.
 //
 // The idea of doing some initial busy-waiting is to help get
 // better and more consistent multithreading benefits for small GEMM sizes.
@@ -109,41 +238,53 @@ inline int DoSomeNOPs() {
 //
 template <typename T>
 T WaitForVariableChange(std::atomic<T>* var, T initial_value,
-                        pthread_cond_t* cond, pthread_mutex_t* mutex) {
-  // First, trivial case where the variable already changed value.
-  T new_value = var->load(std::memory_order_acquire);
-  if (new_value != initial_value) {
+                        VariableChangeNotifier* notifier,
+                        std::chrono::nanoseconds max_busy_wait_duration,
+                        std::chrono::nanoseconds passive_wait_timeout =
+                            std::chrono::nanoseconds::max()) {
+  T new_value = initial_value;
+  // First try busy-waiting; this also handles the trivial case where the
+  // variable already changed value.
+  if (BusyWaitUntil(
+          [&]() {
+            new_value = var->load(std::memory_order_acquire);
+            return new_value != initial_value;
+          },
+          max_busy_wait_duration)) {
     return new_value;
   }
-  // Then try busy-waiting.
-  int nops = 0;
-  while (nops < kMaxBusyWaitNOPs) {
-    nops += DoSomeNOPs();
-    new_value = var->load(std::memory_order_acquire);
-    if (new_value != initial_value) {
-      return new_value;
-    }
-  }
 
   // Finally, do real passive waiting.
-  pthread_mutex_lock(mutex);
-  new_value = var->load(std::memory_order_acquire);
+  if (passive_wait_timeout == std::chrono::nanoseconds::max()) {
+    while (new_value == initial_value) {
+      notifier->Wait(var, initial_value);
+      new_value = var->load(std::memory_order_acquire);
+    }
+    return new_value;
+  }
+  const auto deadline = std::chrono::steady_clock::now() + passive_wait_timeout;
   while (new_value == initial_value) {
-    pthread_cond_wait(cond, mutex);
+    const auto remaining = deadline - std::chrono::steady_clock::now();
+    if (remaining <= std::chrono::nanoseconds::zero()) {
+      break;
+    }
+    notifier->Wait(
+        var, initial_value,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
     new_value = var->load(std::memory_order_acquire);
   }
-  pthread_mutex_unlock(mutex);
   return new_value;
 }
 
 // A BlockingCounter lets one thread to wait for N events to occur.
 // This is how the master thread waits for all the worker threads
 // to have finished working.
-// The waiting is done using a naive spinlock waiting for the atomic
-// count_ to hit the value 0. This is acceptable because in our usage
-// pattern, BlockingCounter is used only to synchronize threads after
-// short-lived tasks (performing parts of the same GEMM). It is not used
-// for synchronizing longer waits (resuming work on the next GEMM).
+// The waiting is done by busy-waiting for the atomic count_ to hit the
+// value 0, as in our usage pattern, BlockingCounter is mostly used to
+// synchronize threads after short-lived tasks (performing parts of the
+// same GEMM). Longer waits eventually fall back to passive waiting, which
+// also avoids starving the threads that we are waiting for, if they happen
+// to be scheduled on the same CPU as the waiting thread.
 class BlockingCounter {
  public:
   BlockingCounter() : count_(0) {}
@@ -151,10 +292,11 @@ class BlockingCounter {
   // Sets/resets the counter; initial_count is the number of
   // decrementing events that the Wait() call will be waiting for.
   void Reset(std::size_t initial_count) {
-    std::size_t old_count_value = count_.load(std::memory_order_relaxed);
+    std::uint32_t old_count_value = count_.load(std::memory_order_relaxed);
     assert(old_count_value == 0);
     (void)old_count_value;
-    count_.store(initial_count, std::memory_order_release);
+    count_.store(static_cast<std::uint32_t>(initial_count),
+                 std::memory_order_release);
   }
 
   // Decrements the counter; if the counter hits zero, signals
@@ -162,61 +304,214 @@ class BlockingCounter {
   // Otherwise (if the decremented count is still nonzero),
   // returns false.
   bool DecrementCount() {
-    std::size_t old_count_value =
+    std::uint32_t old_count_value =
         count_.fetch_sub(1, std::memory_order_acq_rel);
     assert(old_count_value > 0);
-    std::size_t count_value = old_count_value - 1;
+    std::uint32_t count_value = old_count_value - 1;
+    if (count_value == 0) {
+      notifier_.NotifyAll(&count_);
+    }
     return count_value == 0;
   }
 
+  // Returns whether the counter has hit zero, without waiting.
+  bool Poll() const { return !count_.load(std::memory_order_acquire); }
+
   // Waits for the N other threads (N having been set by Reset())
-  // to hit the BlockingCounter.
-  void Wait() {
+  // to hit the BlockingCounter, busy-waiting for up to the given duration
+  // before waiting passively.
+  void Wait(std::chrono::nanoseconds max_busy_wait_duration =
+                kDefaultMaxBusyWaitDuration) {
     ScopedProfilingLabel label("BlockingCounter::Wait");
-    // Busy-wait until the count value is 0.
-    int nops = 0;
-    while (count_.load(std::memory_order_acquire)) {
-      nops += DoSomeNOPs();
-      if (nops > kMaxBusyWaitNOPs) {
-        nops = 0;
-        // If we are unlucky, the blocking thread (that calls DecrementCount)
-        // and the blocked thread (here, calling Wait) may be scheduled on
-        // the same CPU, so the busy-waiting of the present thread may prevent
-        // the blocking thread from resuming and unblocking.
-        // If we are even unluckier, the priorities of the present thread
-        // might be higher than that of the blocking thread, so just yielding
-        // wouldn't allow the blocking thread to resume. So we sleep for
-        // a substantial amount of time in that case. Notice that we only
-        // do so after having busy-waited for kMaxBusyWaitNOPs, which is
-        // typically several milliseconds, so sleeping 1 more millisecond
-        // isn't terrible at that point.
-        //
-        // How this is mitigated in practice:
-        // In practice, it is well known that the application should be
-        // conservative in choosing how many threads to tell gemmlowp to use,
-        // as it's hard to know how many CPU cores it will get to run on,
-        // on typical mobile devices.
-        // It seems impossible for gemmlowp to make this choice automatically,
-        // which is why gemmlowp's default is to use only 1 thread, and
-        // applications may override that if they know that they can count on
-        // using more than that.
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-      }
+    if (BusyWaitUntil(
+            [this]() { return !count_.load(std::memory_order_acquire); },
+            max_busy_wait_duration)) {
+      return;
+    }
+    std::uint32_t count_value;
+    while ((count_value = count_.load(std::memory_order_acquire))) {
+      notifier_.Wait(&count_, count_value);
     }
   }
 
  private:
-  std::atomic<std::size_t> count_;
+  std::atomic<std::uint32_t> count_;
+
+  // Notified when count_ hits zero, which is the only change that
+  // passively waiting threads need to be woken up for.
+  VariableChangeNotifier notifier_;
+};
+
+// Decides how long idle workers busy-wait for new work before waiting
+// passively, adapting to the observed intervals between consecutive
+// batches of work (e.g. between consecutive GEMMs): when workers typically
+// get new work within the maximum busy-waiting duration, as with the GEMMs
+// of consecutive layers of a neural network, they busy-wait long enough
+// to stay hot. When they typically don't, as with sparse requests on a
+// shared host, busy-waiting would mostly be wasted, so they only busy-wait
+// briefly and release the CPU quickly.
+//
+// The typical idle interval is the average of the idle intervals weighted
+// by their own durations, i.e. the expected length of the idle interval
+// that an idle worker is in. That way, the short intervals between the
+// phases of one GEMM don't hide the intervals between GEMMs. Both sums
+// decay exponentially, so that this adapts to changes of workload.
+class BusyWaitBudget {
+ public:
+  BusyWaitBudget()
+      : max_duration_(kDefaultMaxBusyWaitDuration),
+        weighted_sum_of_squares_(0),
+        weighted_sum_(0),
+        duration_(kDefaultMaxBusyWaitDuration.count()),
+        hot_windows_(0) {}
+
+  void set_max_duration(std::chrono::nanoseconds max_duration) {
+    max_duration_ = max_duration;
+    Update();
+  }
+
+  std::chrono::nanoseconds max_duration() const { return max_duration_; }
+
+  // Records an interval during which workers were idle. Must not be called
+  // concurrently, i.e. only by the master thread.
+  void RecordIdleInterval(std::chrono::nanoseconds interval) {
+    static const double kDecay = 7. / 8.;
+    // One very long interval, e.g. an application being idle for seconds,
+    // shouldn't take long to be forgotten.
+    const double clamped = static_cast<double>(
+        std::min(interval, 2 * max_duration_).count());
+    weighted_sum_of_squares_ =
+        kDecay * weighted_sum_of_squares_ + clamped * clamped;
+    weighted_sum_ = kDecay * weighted_sum_ + clamped;
+    Update();
+  }
+
+  // How long idle workers should currently busy-wait for new work.
+  // May be called concurrently with the above, by worker threads.
+  std::chrono::nanoseconds duration() const {
+    return std::chrono::nanoseconds(duration_.load(std::memory_order_relaxed));
+  }
+
+  // Starts and ends a window during which idle workers busy-wait for new
+  // work for as long as it lasts, regardless of the above duration, see
+  // ScopedHotWorkers. Windows may overlap, e.g. those of several contexts
+  // sharing a SharedWorkersPool.
+  void BeginHotWindow() {
+    hot_windows_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void EndHotWindow() {
+    const int previous = hot_windows_.fetch_sub(1, std::memory_order_relaxed);
+    assert(previous > 0);
+    (void)previous;
+  }
+
+  // Whether a hot window is ongoing. May be called concurrently with the
+  // above, by worker threads.
+  bool hot() const { return hot_windows_.load(std::memory_order_relaxed) > 0; }
+
+ private:
+  void Update() {
+    std::chrono::nanoseconds duration = max_duration_;
+    if (weighted_sum_ > 0) {
+      const std::chrono::nanoseconds typical_interval(
+          static_cast<std::int64_t>(weighted_sum_of_squares_ / weighted_sum_));
+      // Leave some margin for typical intervals to vary.
+      duration = typical_interval <= max_duration_
+                     ? std::max(2 * typical_interval, kMinBusyWaitDuration)
+                     : kMinBusyWaitDuration;
+    }
+    duration_.store(std::min(duration, max_duration_).count(),
+                    std::memory_order_relaxed);
+  }
+
+  std::chrono::nanoseconds max_duration_;
+  double weighted_sum_of_squares_;
+  double weighted_sum_;
+  std::atomic<std::int64_t> duration_;
+  std::atomic<int> hot_windows_;
 };
 
-// A workload for a worker.
-struct Task {
-  Task() : local_allocator(nullptr) {}
-  virtual ~Task() {}
-  virtual void Run() = 0;
-  Allocator* local_allocator;
+// Busy-waits for *var to change value for as long as the given budget is
+// in a hot window. Returns the new value, or initial_value if the window
+// ended first, after which the caller should wait as usual.
+template <typename T>
+T BusyWaitWhileHot(std::atomic<T>* var, T initial_value,
+                   const BusyWaitBudget& budget) {
+  T new_value = var->load(std::memory_order_acquire);
+  while (new_value == initial_value && budget.hot()) {
+    SpinPause();
+    new_value = var->load(std::memory_order_acquire);
+  }
+  return new_value;
+}
+
+// How the threads of a WorkersPool are placed on CPUs.
+enum class AffinityPolicy {
+  // Threads are not pinned, and may run on any CPU.
+  None,
+  // Each worker may run on any CPU of a given set.
+  CpuSet,
+  // Each worker is pinned to one hardware thread of a distinct physical
+  // core, so that workers don't share cores as hyperthreads.
+  PhysicalCores,
+  // Same as PhysicalCores, but only using the cores of the socket that
+  // the thread setting the policy runs on, so that all workers share the
+  // same caches and NUMA node.
+  SocketLocal
 };
 
+// Returns the sets of CPUs that workers are pinned to under the given
+// policy: the i-th worker is pinned to the (i % size)-th set. No sets means
+// no pinning. topology is the list of CPUs to choose from, as returned by
+// GetCpuTopology(), and current_cpu is the CPU of the calling thread.
+//
+// The calling thread runs one of the tasks itself, so the core that it runs
+// on is the last one that workers get pinned to.
+inline std::vector<std::vector<int>> WorkerCpuSets(
+    AffinityPolicy policy, const std::vector<int>& cpu_set,
+    const std::vector<CpuInfo>& topology, int current_cpu) {
+  std::vector<std::vector<int>> cpu_sets;
+  if (policy == AffinityPolicy::None || topology.empty()) {
+    return cpu_sets;
+  }
+  if (policy == AffinityPolicy::CpuSet) {
+    if (!cpu_set.empty()) {
+      cpu_sets.push_back(cpu_set);
+    }
+    return cpu_sets;
+  }
+  CpuInfo current = topology.front();
+  bool current_cpu_known = false;
+  for (const CpuInfo& info : topology) {
+    if (info.cpu == current_cpu) {
+      current = info;
+      current_cpu_known = true;
+    }
+  }
+  std::vector<std::pair<int, int>> cores;
+  for (const CpuInfo& info : topology) {
+    if (policy == AffinityPolicy::SocketLocal &&
+        info.package_id != current.package_id) {
+      continue;
+    }
+    const std::pair<int, int> core(info.package_id, info.core_id);
+    if (std::find(cores.begin(), cores.end(), core) != cores.end()) {
+      continue;
+    }
+    cores.push_back(core);
+    if (current_cpu_known && info.package_id == current.package_id &&
+        info.core_id == current.core_id) {
+      continue;
+    }
+    cpu_sets.push_back(std::vector<int>(1, info.cpu));
+  }
+  if (current_cpu_known) {
+    cpu_sets.push_back(std::vector<int>(1, current.cpu));
+  }
+  return cpu_sets;
+}
+
 // A worker thread.
 class Worker {
  public:
@@ -224,34 +519,78 @@ class Worker {
     ThreadStartup,  // The initial state before the thread main loop runs.
     Ready,          // Is not working, has not yet received new work to do.
     HasWork,        // Has work to do.
-    ExitAsSoonAsPossible  // Should exit at earliest convenience.
+    ExitAsSoonAsPossible,  // Should exit at earliest convenience.
+    IdleExited  // Has exited by itself after being idle for too long.
   };
 
-  explicit Worker(BlockingCounter* counter_to_decrement_when_ready)
+  // If cpus is not empty, the worker thread pins itself to these CPUs.
+  // If idle_timeout is given, the worker thread frees the storage of its
+  // allocator and exits after waiting passively for work for that long;
+  // see TryStartWork. Such a thread is detached, so that it releases its
+  // stack as soon as it exits, rather than once the worker gets destroyed.
+  // The thread decrements startup_counter, if given, instead of
+  // counter_to_decrement_when_ready once started.
+  Worker(BlockingCounter* counter_to_decrement_when_ready,
+         const BusyWaitBudget* busy_wait_budget, const std::vector<int>& cpus,
+         std::chrono::nanoseconds idle_timeout =
+             std::chrono::nanoseconds::max(),
+         BlockingCounter* startup_counter = nullptr)
       : task_(nullptr),
         state_(State::ThreadStartup),
-        counter_to_decrement_when_ready_(counter_to_decrement_when_ready) {
-    pthread_cond_init(&state_cond_, nullptr);
-    pthread_mutex_init(&state_mutex_, nullptr);
+        counter_to_decrement_when_ready_(counter_to_decrement_when_ready),
+        startup_counter_(startup_counter ? startup_counter
+                                         : counter_to_decrement_when_ready),
+        busy_wait_budget_(busy_wait_budget),
+        cpus_(cpus),
+        idle_timeout_(idle_timeout),
+        thread_exited_(false) {
     pthread_create(&thread_, nullptr, ThreadFunc, this);
+    if (detached()) {
+      pthread_detach(thread_);
+    }
   }
 
   ~Worker() {
-    ChangeState(State::ExitAsSoonAsPossible);
-    pthread_join(thread_, nullptr);
-    pthread_cond_destroy(&state_cond_);
-    pthread_mutex_destroy(&state_mutex_);
+    // The worker may be exiting by itself concurrently, see ThreadFunc.
+    State expected = State::Ready;
+    if (state_.compare_exchange_strong(expected,
+                                       State::ExitAsSoonAsPossible,
+                                       std::memory_order_acq_rel)) {
+      state_notifier_.NotifyAll(&state_);
+    }
+    if (!detached()) {
+      pthread_join(thread_, nullptr);
+      return;
+    }
+    // A detached thread can't be joined: wait for it to be done with this
+    // worker instead. That is immediate if it has exited on its idle
+    // timeout, and otherwise only takes for it to wake up and exit.
+    while (!thread_exited()) {
+      std::this_thread::yield();
+    }
+  }
+
+  // Whether the worker thread has returned. Once a detached thread has, it
+  // holds no resources anymore, see the constructor.
+  bool thread_exited() const {
+    return thread_exited_.load(std::memory_order_acquire);
   }
 
   // Changes State; may be called from either the worker thread
   // or the master thread; however, not all state transitions are legal,
   // which is guarded by assertions.
   //
+  // No lock is needed, as state changes can't race with each other:
+  // the master thread only changes the state of a Ready worker, and only
+  // the worker thread itself changes its state otherwise. The exception is
+  // a Ready worker exiting by itself after its idle timeout, which the
+  // master thread may race with, so that both leave the Ready state with
+  // a compare-and-swap instead (see TryStartWork and ~Worker).
+  //
   // The Task argument is to be used only with new_state==HasWork.
   // It specifies the Task being handed to this Worker.
   void ChangeState(State new_state, Task* task = nullptr) {
     ScopedProfilingLabel label("Worker::ChangeState");
-    pthread_mutex_lock(&state_mutex_);
     State old_state = state_.load(std::memory_order_relaxed);
     assert(old_state != new_state);
     switch (old_state) {
@@ -285,11 +624,13 @@ class Worker {
       default:
         break;
     }
-    state_.store(new_state, std::memory_order_relaxed);
-    pthread_cond_broadcast(&state_cond_);
-    pthread_mutex_unlock(&state_mutex_);
+    // Publishes task_ along with the new state.
+    state_.store(new_state, std::memory_order_release);
+    state_notifier_.NotifyAll(&state_);
     if (new_state == State::Ready) {
-      counter_to_decrement_when_ready_->DecrementCount();
+      (old_state == State::ThreadStartup ? startup_counter_
+                                         : counter_to_decrement_when_ready_)
+          ->DecrementCount();
     }
   }
 
@@ -297,6 +638,13 @@ class Worker {
   void ThreadFunc() {
     ScopedProfilingLabel label("Worker::ThreadFunc");
 
+    // Pinning is done before anything else, and in particular before the
+    // first allocation by local_allocator_, so that the memory used by this
+    // worker is first touched, hence placed, on its own NUMA node.
+    if (!cpus_.empty()) {
+      SetCurrentThreadAffinity(cpus_);
+    }
+
     ChangeState(State::Ready);
 
     // Thread main loop
@@ -304,8 +652,13 @@ class Worker {
       // Get a state to act on
       // In the 'Ready' state, we have nothing to do but to wait until
       // we switch to another state.
-      State state_to_act_upon = WaitForVariableChange(
-          &state_, State::Ready, &state_cond_, &state_mutex_);
+      State state_to_act_upon =
+          BusyWaitWhileHot(&state_, State::Ready, *busy_wait_budget_);
+      if (state_to_act_upon == State::Ready) {
+        state_to_act_upon = WaitForVariableChange(
+            &state_, State::Ready, &state_notifier_,
+            busy_wait_budget_->duration(), idle_timeout_);
+      }
 
       // We now have a state to act on, so act.
       switch (state_to_act_upon) {
@@ -315,19 +668,62 @@ class Worker {
           break;
         case State::ExitAsSoonAsPossible:
           return;
+        case State::Ready: {
+          // Idle for idle_timeout_: exit, unless the master thread has
+          // just handed us work, which the compare-and-swap tells.
+          State expected = State::Ready;
+          if (state_.compare_exchange_strong(expected, State::IdleExited,
+                                             std::memory_order_acq_rel)) {
+            local_allocator_.FreeStorage();
+            return;
+          }
+          break;
+        }
         default:
           abort();
       }
     }
   }
 
+  // Whether the worker thread is detached, see the constructor.
+  bool detached() const {
+    return idle_timeout_ != std::chrono::nanoseconds::max();
+  }
+
   static void* ThreadFunc(void* arg) {
-    static_cast<Worker*>(arg)->ThreadFunc();
+    Worker* worker = static_cast<Worker*>(arg);
+    worker->ThreadFunc();
+    // The last access to the worker, which may be destroyed from then on.
+    worker->thread_exited_.store(true, std::memory_order_release);
     return nullptr;
   }
 
   // Called by the master thead to give this worker work to do.
-  void StartWork(Task* task) { ChangeState(State::HasWork, task); }
+  void StartWork(Task* task) {
+    const bool started = TryStartWork(task);
+    assert(started);
+    (void)started;
+  }
+
+  // Variant of StartWork for workers with an idle timeout. Returns false if
+  // the worker has exited after being idle for too long, in which case it
+  // can only be destroyed, and the task is not run.
+  bool TryStartWork(Task* task) {
+    ScopedProfilingLabel label("Worker::TryStartWork");
+    assert(!task_);
+    task->local_allocator = &local_allocator_;
+    task_ = task;
+    // Publishes task_ along with the new state.
+    State expected = State::Ready;
+    if (!state_.compare_exchange_strong(expected, State::HasWork,
+                                        std::memory_order_acq_rel)) {
+      assert(expected == State::IdleExited);
+      task_ = nullptr;
+      return false;
+    }
+    state_notifier_.NotifyAll(&state_);
+    return true;
+  }
 
  private:
   // The underlying thread.
@@ -336,23 +732,467 @@ class Worker {
   // The task to be worked on.
   Task* task_;
 
-  // The condition variable and mutex guarding state changes.
-  pthread_cond_t state_cond_;
-  pthread_mutex_t state_mutex_;
-
   // The state enum tells if we're currently working, waiting for work, etc.
-  // Its concurrent accesses by the worker and main threads are guarded by
-  // state_mutex_, and can thus use memory_order_relaxed. This still needs
-  // to be a std::atomic because we use WaitForVariableChange.
+  // It is read by the worker thread with memory_order_acquire, so that
+  // it sees the task_ handed to it along with the HasWork state.
   std::atomic<State> state_;
 
+  // Wakes up the worker thread when it waits passively for state changes.
+  VariableChangeNotifier state_notifier_;
+
   // Each thread had a local allocator so they can allocate temporary
   // buffers without blocking each other.
   Allocator local_allocator_;
 
   // pointer to the master's thread BlockingCounter object, to notify the
-  // master thread of when this worker switches to the 'Ready' state.
+  // master thread of when this worker switches to the 'Ready' state, and
+  // the one to notify the first time, once started.
   BlockingCounter* const counter_to_decrement_when_ready_;
+  BlockingCounter* const startup_counter_;
+
+  // How long to busy-wait for new work, owned by the pool.
+  const BusyWaitBudget* const busy_wait_budget_;
+
+  // The CPUs that this worker is pinned to, if any.
+  const std::vector<int> cpus_;
+
+  // How long to wait passively for work before exiting.
+  const std::chrono::nanoseconds idle_timeout_;
+
+  // Set by the worker thread once it no longer accesses this worker.
+  std::atomic<bool> thread_exited_;
+};
+
+// Bounds on the relative thread speeds tracked by WorkersPool, so that a
+// thread that was preempted for a whole execution still gets some tasks,
+// and the weight of each execution in their moving average.
+const float kMinThreadSpeed = 0.125f;
+const float kMaxThreadSpeed = 8.f;
+const float kThreadSpeedUpdateWeight = 0.25f;
+
+// A range [begin, end) of task indices, which its owner thread consumes
+// from the front, while other threads may steal from the back.
+// Both ends are packed into a single atomic word, so that both operations
+// are a single compare-and-swap. Since ranges only ever shrink until the
+// next Reset, there is no ABA problem.
+class TaskRangeQueue {
+ public:
+  TaskRangeQueue() : range_(0) {}
+
+  // Must only be called while no other thread accesses this queue.
+  void Reset(std::uint32_t begin, std::uint32_t end) {
+    range_.store(Pack(begin, end), std::memory_order_relaxed);
+  }
+
+  // Takes the first task index; returns false if the queue is empty.
+  bool PopFront(int* index) {
+    std::uint64_t range = range_.load(std::memory_order_relaxed);
+    while (Begin(range) < End(range)) {
+      if (range_.compare_exchange_weak(range,
+                                       Pack(Begin(range) + 1, End(range)),
+                                       std::memory_order_relaxed)) {
+        *index = Begin(range);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Takes the last task index; returns false if the queue is empty.
+  bool PopBack(int* index) {
+    std::uint64_t range = range_.load(std::memory_order_relaxed);
+    while (Begin(range) < End(range)) {
+      if (range_.compare_exchange_weak(range,
+                                       Pack(Begin(range), End(range) - 1),
+                                       std::memory_order_relaxed)) {
+        *index = End(range) - 1;
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  static std::uint64_t Pack(std::uint32_t begin, std::uint32_t end) {
+    return (static_cast<std::uint64_t>(end) << 32) | begin;
+  }
+  static std::uint32_t Begin(std::uint64_t range) {
+    return static_cast<std::uint32_t>(range);
+  }
+  static std::uint32_t End(std::uint64_t range) {
+    return static_cast<std::uint32_t>(range >> 32);
+  }
+
+  std::atomic<std::uint64_t> range_;
+};
+
+// The task that each thread runs in WorkersPool::ExecuteWithWorkStealing:
+// it runs the tasks of its own queue, then steals tasks from the other
+// threads' queues until all queues are empty. The tasks that it runs use
+// the allocator of the thread running them. It records how many tasks it
+// ran and for how long, from which WorkersPool estimates thread speeds.
+struct WorkStealingTask : Task {
+  WorkStealingTask()
+      : tasks(nullptr), all(nullptr), count(0), index(0), tasks_run(0) {}
+
+  void Run() override {
+    ScopedProfilingLabel label("WorkStealingTask");
+    const auto start_time = std::chrono::steady_clock::now();
+    tasks_run = 0;
+    int task_index;
+    while (queue.PopFront(&task_index) || Steal(&task_index)) {
+      Task* task = tasks[task_index];
+      task->local_allocator = local_allocator;
+      task->Run();
+      tasks_run++;
+    }
+    run_duration = std::chrono::steady_clock::now() - start_time;
+  }
+
+  bool Steal(int* task_index) {
+    for (int i = 1; i < count; i++) {
+      if (all[(index + i) % count].queue.PopBack(task_index)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  TaskRangeQueue queue;
+  Task* const* tasks;
+  WorkStealingTask* all;
+  int count;
+  int index;
+  int tasks_run;
+  std::chrono::steady_clock::duration run_duration;
+};
+
+// A task running a function, for work that isn't worth its own Task type.
+struct FunctionTask : Task {
+  void Run() override { function(); }
+
+  std::function<void()> function;
+};
+
+// The body of a TaskExecutor::ParallelFor loop.
+struct ParallelForBody {
+  virtual ~ParallelForBody() {}
+  virtual void Run(int index) = 0;
+};
+
+// The interface through which a WorkersPool can run its tasks on threads
+// that it doesn't own, e.g. those of an application's own thread pool,
+// instead of on its own workers; see WorkersPool::set_executor.
+//
+// ParallelFor(count, body) must call body->Run(index) exactly once for
+// each index in [0, count), and return once all these calls have
+// returned. They may run in any order, concurrently or not, on any
+// threads including the calling thread: no call waits for another. Gemms
+// are only as parallel as the executor makes them, though, so it should
+// run them on up to count threads. ParallelFor may be called concurrently
+// from several threads, if several WorkersPools share the executor.
+//
+// WorkersPool calls it without allocating, so that an executor that
+// doesn't allocate either keeps Gemms allocation-free.
+class TaskExecutor {
+ public:
+  virtual ~TaskExecutor() {}
+
+  virtual void ParallelFor(int count, ParallelForBody* body) = 0;
+};
+
+// The ParallelForBody with which WorkersPool runs a list of tasks through
+// a TaskExecutor, each task with its own allocator.
+struct TaskListBody : ParallelForBody {
+  void Run(int index) override {
+    Task* task = tasks[index];
+    task->local_allocator = allocators[index].get();
+    task->Run();
+  }
+
+  Task* const* tasks;
+  const std::unique_ptr<Allocator>* allocators;
+};
+
+// A reference TaskExecutor, adapting thread pools whose interface is a
+// function scheduling a closure to run on one of their threads:
+//
+//   ThreadPool app_pool;  // The application's own pool.
+//   ScheduleTaskExecutor executor(
+//       [&app_pool](std::function<void()> f) { app_pool.Schedule(f); });
+//   GemmContext context;
+//   context.set_task_executor(&executor);
+//   context.set_max_num_threads(app_pool.NumThreads() + 1);
+//
+// ParallelFor runs one of the calls on the calling thread, schedules the
+// others and waits for them. Each scheduled closure only holds a pointer,
+// which std::function stores without allocating.
+class ScheduleTaskExecutor : public TaskExecutor {
+ public:
+  typedef std::function<void(std::function<void()>)> ScheduleFunction;
+
+  explicit ScheduleTaskExecutor(const ScheduleFunction& schedule)
+      : schedule_(schedule) {}
+
+  void ParallelFor(int count, ParallelForBody* body) override {
+    if (count <= 0) {
+      return;
+    }
+    // The state of this call, shared by the scheduled calls, each of which
+    // takes the next index. They are counted down under the mutex, so that
+    // none of them still accesses this state once the wait below returns.
+    struct CallState {
+      ParallelForBody* body;
+      std::atomic<int> next_index;
+      std::mutex mutex;
+      std::condition_variable done;
+      int pending;
+    } state;
+    state.body = body;
+    state.next_index.store(0, std::memory_order_relaxed);
+    state.pending = count - 1;
+    CallState* const call = &state;
+    for (int i = 0; i < count - 1; i++) {
+      schedule_([call]() {
+        call->body->Run(
+            call->next_index.fetch_add(1, std::memory_order_relaxed));
+        std::lock_guard<std::mutex> lock(call->mutex);
+        if (--call->pending == 0) {
+          call->done.notify_all();
+        }
+      });
+    }
+    body->Run(count - 1);
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.done.wait(lock, [&state]() { return state.pending == 0; });
+  }
+
+ private:
+  ScheduleFunction schedule_;
+};
+
+// The priority of the work that a WorkersPool submits to a SharedWorkersPool.
+enum class WorkPriority {
+  // For throughput-oriented work, e.g. large batch Gemms.
+  Normal,
+  // For latency-critical work, e.g. the small Gemms of interactive
+  // requests, which takes precedence over normal work.
+  High
+};
+
+// Metrics of the workers that WorkersPool recreated after they exited on
+// their idle timeout, see WorkersPool::set_worker_idle_timeout.
+struct WorkerRespawnStats {
+  int count = 0;
+  std::chrono::nanoseconds total_latency = std::chrono::nanoseconds::zero();
+  std::chrono::nanoseconds max_latency = std::chrono::nanoseconds::zero();
+};
+
+// A pool of worker threads that can be shared by many WorkersPools, hence
+// by many GemmContexts (see WorkersPool::set_shared_pool), so that many
+// threads can run Gemms concurrently without each of them having its own
+// worker threads, which would oversubscribe the CPUs.
+//
+// Each call to Execute() submits a batch of tasks. Workers take tasks from
+// the pending batches in turn, so that concurrent batches are fairly
+// interleaved. The calling thread also runs tasks of its own batch until
+// all of them have been taken, then waits for the workers running the
+// others to finish them.
+//
+// Batches of WorkPriority::High take precedence: while any is pending,
+// workers only take tasks from high-priority batches. Tasks are never
+// interrupted, so a high-priority batch waits at most for the tasks that
+// workers are running to complete.
+class SharedWorkersPool {
+ public:
+  // Creates threads_count worker threads; 0 means one per hardware thread.
+  explicit SharedWorkersPool(int threads_count = 0)
+      : exit_(false), work_generation_(0), next_batch_(0) {
+    pthread_mutex_init(&batches_mutex_, nullptr);
+    threads_count = GetHardwareConcurrency(threads_count);
+    threads_.resize(threads_count);
+    allocators_.reset(new Allocator[threads_count]);
+    thread_args_.resize(threads_count);
+    for (int i = 0; i < threads_count; i++) {
+      thread_args_[i].pool = this;
+      thread_args_[i].allocator = &allocators_[i];
+      pthread_create(&threads_[i], nullptr, ThreadFunc, &thread_args_[i]);
+    }
+  }
+
+  ~SharedWorkersPool() {
+    exit_.store(true, std::memory_order_relaxed);
+    work_generation_.fetch_add(1, std::memory_order_release);
+    work_notifier_.NotifyAll(&work_generation_);
+    for (pthread_t thread : threads_) {
+      pthread_join(thread, nullptr);
+    }
+    assert(batches_.empty());
+    pthread_mutex_destroy(&batches_mutex_);
+  }
+
+  int threads_count() const { return threads_.size(); }
+
+  // See WorkersPool::BeginHotWindow. The workers stay hot while any of the
+  // pools using them is in a hot window.
+  void BeginHotWindow() { busy_wait_budget_.BeginHotWindow(); }
+  void EndHotWindow() { busy_wait_budget_.EndHotWindow(); }
+
+  const BusyWaitBudget& busy_wait_budget() const { return busy_wait_budget_; }
+
+  // The tasks submitted by one Start() or Execute() call. The storage
+  // belongs to the caller, and must stay valid until the tasks have run.
+  struct Batch {
+    Task* const* tasks;
+    int count;
+    // The index of the next task to be taken.
+    int next;
+    BlockingCounter* counter;
+    WorkPriority priority;
+  };
+
+  // Submits the given tasks to the workers, and returns immediately,
+  // without running any of them on the calling thread. May be called
+  // concurrently by several threads. batch and counter must stay valid,
+  // and counter must not be used by anything else, until Wait(counter)
+  // has returned.
+  void Start(Task* const* tasks, int tasks_count, BlockingCounter* counter,
+             Batch* batch, WorkPriority priority = WorkPriority::Normal) {
+    assert(tasks_count >= 1);
+    counter->Reset(tasks_count);
+    batch->tasks = tasks;
+    batch->count = tasks_count;
+    batch->next = 0;
+    batch->counter = counter;
+    batch->priority = priority;
+    pthread_mutex_lock(&batches_mutex_);
+    batches_.push_back(batch);
+    pthread_mutex_unlock(&batches_mutex_);
+    work_generation_.fetch_add(1, std::memory_order_release);
+    work_notifier_.NotifyAll(&work_generation_);
+  }
+
+  // Waits for the tasks submitted by Start() with the given counter.
+  void Wait(BlockingCounter* counter) {
+    counter->Wait(busy_wait_budget_.max_duration());
+    // Workers decrement counter while holding batches_mutex_, so this
+    // ensures that none of them still accesses it, as it may be destroyed
+    // once we return.
+    pthread_mutex_lock(&batches_mutex_);
+    pthread_mutex_unlock(&batches_mutex_);
+  }
+
+  // Runs the given tasks and returns once they have all run. May be called
+  // concurrently by several threads. Tasks run on the calling thread use
+  // caller_allocator. counter is used to wait for the tasks, and must not be
+  // used concurrently by anything else; it belongs to the caller so that it
+  // outlives any worker still decrementing it after this returns.
+  void Execute(Task* const* tasks, int tasks_count,
+               Allocator* caller_allocator, BlockingCounter* counter,
+               WorkPriority priority = WorkPriority::Normal) {
+    Batch batch;
+    Start(tasks, tasks_count, counter, &batch, priority);
+    Task* task;
+    BlockingCounter* task_counter;
+    while (TakeTask(&batch, &task, &task_counter)) {
+      task->local_allocator = caller_allocator;
+      task->Run();
+      counter->DecrementCount();
+    }
+    // Once all its tasks are taken, the batch is no longer referenced.
+    Wait(counter);
+  }
+
+ private:
+  struct ThreadArgs {
+    SharedWorkersPool* pool;
+    Allocator* allocator;
+  };
+
+  // Takes the next task of the given batch, or if batch is null, of the
+  // next pending batch of the highest priority in turn. Returns false if
+  // there is no such task.
+  bool TakeTask(Batch* batch, Task** task, BlockingCounter** counter) {
+    pthread_mutex_lock(&batches_mutex_);
+    std::size_t index = 0;
+    if (batch) {
+      index = std::find(batches_.begin(), batches_.end(), batch) -
+              batches_.begin();
+    } else if (!batches_.empty()) {
+      WorkPriority priority = WorkPriority::Normal;
+      for (const Batch* b : batches_) {
+        priority = std::max(priority, b->priority);
+      }
+      index = next_batch_ % batches_.size();
+      while (batches_[index]->priority != priority) {
+        index = (index + 1) % batches_.size();
+      }
+      batch = batches_[index];
+    }
+    const bool found = index < batches_.size();
+    if (found) {
+      *task = batch->tasks[batch->next++];
+      *counter = batch->counter;
+      if (batch->next == batch->count) {
+        batches_.erase(batches_.begin() + index);
+      } else {
+        index++;
+      }
+      next_batch_ = index;
+    }
+    pthread_mutex_unlock(&batches_mutex_);
+    return found;
+  }
+
+  void ThreadFunc(Allocator* allocator) {
+    ScopedProfilingLabel label("SharedWorkersPool::ThreadFunc");
+    std::uint32_t generation = work_generation_.load(std::memory_order_acquire);
+    while (!exit_.load(std::memory_order_relaxed)) {
+      Task* task;
+      BlockingCounter* counter;
+      if (TakeTask(nullptr, &task, &counter)) {
+        task->local_allocator = allocator;
+        task->Run();
+        pthread_mutex_lock(&batches_mutex_);
+        counter->DecrementCount();
+        pthread_mutex_unlock(&batches_mutex_);
+      } else {
+        const std::uint32_t new_generation =
+            BusyWaitWhileHot(&work_generation_, generation, busy_wait_budget_);
+        generation = new_generation != generation
+                         ? new_generation
+                         : WaitForVariableChange(&work_generation_, generation,
+                                                 &work_notifier_,
+                                                 busy_wait_budget_.duration());
+      }
+    }
+  }
+
+  static void* ThreadFunc(void* arg) {
+    ThreadArgs* args = static_cast<ThreadArgs*>(arg);
+    args->pool->ThreadFunc(args->allocator);
+    return nullptr;
+  }
+
+  SharedWorkersPool(const SharedWorkersPool&) = delete;
+
+  std::vector<pthread_t> threads_;
+  std::vector<ThreadArgs> thread_args_;
+  // Each thread has its own allocator, as in Worker.
+  std::unique_ptr<Allocator[]> allocators_;
+
+  std::atomic<bool> exit_;
+
+  // Incremented whenever a batch is submitted, to wake up idle workers.
+  std::atomic<std::uint32_t> work_generation_;
+  VariableChangeNotifier work_notifier_;
+  BusyWaitBudget busy_wait_budget_;
+
+  // The batches that still have tasks to be taken, guarded by
+  // batches_mutex_, and the index of the one to take a task from next.
+  pthread_mutex_t batches_mutex_;
+  std::vector<Batch*> batches_;
+  std::size_t next_batch_;
 };
 
 // A very simple pool of workers, that only allows the very
@@ -360,6 +1200,14 @@ class Worker {
 // a fixed number of workers can be given work, and one then
 // waits for all of them to finish.
 //
+// ExecuteWithWorkStealing extends that pattern to more tasks than threads,
+// which are balanced across threads by work stealing, so that a thread
+// that is slower, or that gets preempted, does not hold back the others.
+// On machines whose cores run at different speeds (e.g. big.LITTLE, or
+// performance and efficiency cores), threads that were faster in past
+// executions also get proportionally larger initial ranges of tasks, so
+// that less work has to be stolen.
+//
 // See MultiThreadGemmContextBase for how other WorkersPool implementations can
 // be used.
 class WorkersPool {
@@ -367,9 +1215,11 @@ class WorkersPool {
   WorkersPool() {}
 
   ~WorkersPool() {
-    for (auto w : workers_) {
-      delete w;
+    if (async_pending_) {
+      WaitAsync();
     }
+    DeleteWorkers();
+    delete async_worker_;
   }
 
   // Just executes the tasks. Does not destroy them. Similar to
@@ -377,40 +1227,89 @@ class WorkersPool {
   template <typename TaskType>
   void Execute(int tasks_count, TaskType* tasks) {
     assert(tasks_count >= 1);
+    if (shared_pool_ || executor_) {
+      shared_task_pointers_.resize(tasks_count);
+      for (int i = 0; i < tasks_count; i++) {
+        shared_task_pointers_[i] = &tasks[i];
+      }
+      ExecuteTaskPointersElsewhere(shared_task_pointers_.data(), tasks_count);
+      return;
+    }
+    RecordWorkStart();
     // One of the tasks will be run on the current thread.
     std::size_t workers_count = tasks_count - 1;
     CreateWorkers(workers_count);
     assert(workers_count <= workers_.size());
     counter_to_decrement_when_ready_.Reset(workers_count);
     for (std::size_t i = 0; i < tasks_count - 1; i++) {
-      workers_[i]->StartWork(&tasks[i]);
+      StartWorker(i, &tasks[i]);
     }
     // Execute the remaining workload immediately on the current thread.
     Task* task = &tasks[tasks_count - 1];
     task->local_allocator = &main_thread_task_allocator_;
     task->Run();
     // Wait for the workers submitted above to finish.
-    counter_to_decrement_when_ready_.Wait();
+    counter_to_decrement_when_ready_.Wait(busy_wait_budget_.max_duration());
+    RecordWorkEnd();
+  }
+
+  // Executes the tasks on threads_count threads, including the current
+  // thread. Each thread initially gets a contiguous range of tasks, and
+  // threads that run out of tasks steal from the end of other threads'
+  // ranges. Does not destroy the tasks.
+  template <typename TaskType>
+  void ExecuteWithWorkStealing(int threads_count, int tasks_count,
+                               TaskType* tasks) {
+    assert(threads_count >= 1);
+    if (tasks_count <= threads_count) {
+      Execute(tasks_count, tasks);
+      return;
+    }
+    task_pointers_.resize(tasks_count);
+    for (int i = 0; i < tasks_count; i++) {
+      task_pointers_[i] = &tasks[i];
+    }
+    ExecuteTaskPointersWithWorkStealing(threads_count);
+  }
+
+  // Variant of ExecuteWithWorkStealing for tasks of different types.
+  // Tasks are distributed in order, so the first task of the list is the
+  // first one that the first thread runs.
+  void ExecuteWithWorkStealing(int threads_count,
+                               const std::vector<Task*>& tasks) {
+    assert(threads_count >= 1);
+    assert(!tasks.empty());
+    task_pointers_ = tasks;
+    ExecuteTaskPointersWithWorkStealing(
+        std::min<int>(threads_count, tasks.size()));
   }
 
   // Legacy: executes the tasks and destroys them
   void LegacyExecuteAndDestroyTasks(const std::vector<Task*>& tasks) {
     std::size_t tasks_count = tasks.size();
     assert(tasks_count >= 1);
+    if (shared_pool_ || executor_) {
+      ExecuteTaskPointersElsewhere(tasks.data(), tasks_count);
+      std::for_each(tasks.begin(), tasks.end(),
+                    [](Task* task) { delete task; });
+      return;
+    }
+    RecordWorkStart();
     // One of the tasks will be run on the current thread.
     std::size_t workers_count = tasks_count - 1;
     CreateWorkers(workers_count);
     assert(workers_count <= workers_.size());
     counter_to_decrement_when_ready_.Reset(workers_count);
     for (int i = 0; i < tasks_count - 1; i++) {
-      workers_[i]->StartWork(tasks[i]);
+      StartWorker(i, tasks[i]);
     }
     // Execute the remaining workload immediately on the current thread.
     Task* task = tasks[tasks_count - 1];
     task->local_allocator = &main_thread_task_allocator_;
     task->Run();
     // Wait for the workers submitted above to finish.
-    counter_to_decrement_when_ready_.Wait();
+    counter_to_decrement_when_ready_.Wait(busy_wait_budget_.max_duration());
+    RecordWorkEnd();
     // Cleanup tasks (best to do this from the same thread that allocated
     // the memory).
     std::for_each(tasks.begin(), tasks.end(), [](Task* task) { delete task; });
@@ -421,23 +1320,354 @@ class WorkersPool {
     LegacyExecuteAndDestroyTasks(tasks);
   }
 
- private:
-  // Ensures that the pool has at least the given count of workers.
-  // If any new worker has to be created, this function waits for it to
-  // be ready.
-  void CreateWorkers(std::size_t workers_count) {
-    if (workers_.size() >= workers_count) {
-      return;
+  // Sets the maximum duration that threads busy-wait for, before waiting
+  // passively: the master thread when waiting for workers, and workers when
+  // waiting for new work (see BusyWaitBudget). Zero disables busy-waiting.
+  void set_max_busy_wait_duration(std::chrono::nanoseconds duration) {
+    busy_wait_budget_.set_max_duration(duration);
+  }
+
+  const BusyWaitBudget& busy_wait_budget() const { return busy_wait_budget_; }
+
+  // Keeps idle workers busy-waiting for new work, rather than eventually
+  // waiting passively, until the matching EndHotWindow(), see
+  // ScopedHotWorkers. With a shared pool, this applies to its workers.
+  // This doesn't apply to the threads of an executor. Windows may nest.
+  void BeginHotWindow() {
+    hot_windows_++;
+    if (shared_pool_) {
+      shared_pool_->BeginHotWindow();
+    } else {
+      busy_wait_budget_.BeginHotWindow();
     }
-    counter_to_decrement_when_ready_.Reset(workers_count - workers_.size());
-    while (workers_.size() < workers_count) {
-      workers_.push_back(new Worker(&counter_to_decrement_when_ready_));
+  }
+
+  void EndHotWindow() {
+    assert(hot_windows_ > 0);
+    hot_windows_--;
+    if (shared_pool_) {
+      shared_pool_->EndHotWindow();
+    } else {
+      busy_wait_budget_.EndHotWindow();
     }
-    counter_to_decrement_when_ready_.Wait();
   }
 
-  // copy construction disallowed
-  WorkersPool(const WorkersPool&) = delete;
+  // Returns the relative speeds of the threads_count threads of
+  // ExecuteWithWorkStealing, as measured in past executions: the last one
+  // is the current thread, the others are workers. Speeds average about 1,
+  // and are 1 for threads that haven't been measured yet.
+  std::vector<float> ThreadSpeeds(int threads_count) const {
+    std::vector<float> speeds(threads_count, 1.f);
+    for (int i = 0; i < threads_count - 1; i++) {
+      if (i < static_cast<int>(worker_speeds_.size())) {
+        speeds[i] = worker_speeds_[i];
+      }
+    }
+    speeds[threads_count - 1] = main_thread_speed_;
+    return speeds;
+  }
+
+  // Sets how workers are placed on CPUs, see AffinityPolicy; cpu_set is
+  // only used by AffinityPolicy::CpuSet. Workers pin themselves when they
+  // start, before allocating any memory, so existing workers are destroyed,
+  // to be recreated with the new placement when next needed.
+  void set_affinity(AffinityPolicy policy,
+                    const std::vector<int>& cpu_set = std::vector<int>()) {
+    worker_cpu_sets_ =
+        WorkerCpuSets(policy, cpu_set, GetCpuTopology(), GetCurrentCpu());
+    DeleteWorkers();
+    ResetThreadSpeeds();
+  }
+
+  // Makes workers free the storage of their allocators and exit once they
+  // have waited passively for work for the given duration, so that bursty
+  // workloads don't keep memory and threads between bursts. Exited workers
+  // are recreated when next needed, see respawn_stats(). The default, max(),
+  // means that workers never exit. Existing workers are destroyed, to be
+  // recreated with the new timeout when next needed.
+  void set_worker_idle_timeout(std::chrono::nanoseconds timeout) {
+    worker_idle_timeout_ = timeout;
+    DeleteWorkers();
+  }
+
+  std::chrono::nanoseconds worker_idle_timeout() const {
+    return worker_idle_timeout_;
+  }
+
+  // How many workers were recreated after exiting on their idle timeout,
+  // and how long recreating them took, delaying the work handed to them.
+  const WorkerRespawnStats& respawn_stats() const { return respawn_stats_; }
+
+  // Makes this pool run tasks on the given shared pool instead of on its
+  // own workers, which are destroyed; nullptr reverts to own workers. Then
+  // the busy-waiting and affinity settings of this pool don't apply.
+  // The shared pool must outlive this pool, or until this is called again.
+  void set_shared_pool(SharedWorkersPool* shared_pool) {
+    assert(!async_pending_);
+    assert(!hot_windows_);
+    assert(!executor_ || !shared_pool);
+    shared_pool_ = shared_pool;
+    DeleteWorkers();
+    ResetThreadSpeeds();
+  }
+
+  SharedWorkersPool* shared_pool() const { return shared_pool_; }
+
+  // Sets the priority of the tasks that this pool submits to its shared
+  // pool, see SharedWorkersPool. Has no effect without a shared pool.
+  void set_priority(WorkPriority priority) { priority_ = priority; }
+
+  WorkPriority priority() const { return priority_; }
+
+  // Makes this pool run tasks through the given executor, see TaskExecutor,
+  // instead of on its own workers, which are destroyed; nullptr reverts to
+  // own workers. Then the busy-waiting and affinity settings of this pool
+  // don't apply. Each of the indices of ParallelFor loops gets its own
+  // allocator. The executor must outlive this pool, or until this is
+  // called again. Work started by StartAsync() still runs on a dedicated
+  // worker, as the executor can only run work that it waits for.
+  void set_executor(TaskExecutor* executor) {
+    assert(!shared_pool_ || !executor);
+    executor_ = executor;
+    DeleteWorkers();
+    ResetThreadSpeeds();
+  }
+
+  TaskExecutor* executor() const { return executor_; }
+
+  // Starts running the given work on another thread, and returns
+  // immediately. The work may itself use this pool to execute tasks, as
+  // its master thread: the calling thread must not use this pool again
+  // until the work has completed, as reported by PollAsync() or WaitAsync().
+  // The work runs on one of the shared pool's workers if there is one,
+  // and otherwise on a dedicated worker of this pool, created on first use.
+  void StartAsync(std::function<void()> work) {
+    assert(!async_pending_);
+    async_task_.function = std::move(work);
+    async_pending_ = true;
+    if (shared_pool_) {
+      async_task_pointer_ = &async_task_;
+      shared_pool_->Start(&async_task_pointer_, 1, &async_counter_,
+                          &async_batch_, priority_);
+      return;
+    }
+    if (!async_worker_) {
+      async_counter_.Reset(1);
+      async_worker_ = new Worker(&async_counter_, &busy_wait_budget_,
+                                 std::vector<int>());
+      async_counter_.Wait(busy_wait_budget_.max_duration());
+    }
+    async_counter_.Reset(1);
+    async_worker_->StartWork(&async_task_);
+  }
+
+  // Returns whether the work started by StartAsync() has completed,
+  // without waiting.
+  bool PollAsync() {
+    assert(async_pending_);
+    if (!async_counter_.Poll()) {
+      return false;
+    }
+    WaitAsync();
+    return true;
+  }
+
+  // Waits for the work started by StartAsync() to complete.
+  void WaitAsync() {
+    assert(async_pending_);
+    if (shared_pool_) {
+      shared_pool_->Wait(&async_counter_);
+    } else {
+      async_counter_.Wait(busy_wait_budget_.max_duration());
+    }
+    async_pending_ = false;
+  }
+
+ private:
+  // Records the end of the interval during which workers were idle
+  // since the previous work.
+  void RecordWorkStart() {
+    if (has_worked_) {
+      busy_wait_budget_.RecordIdleInterval(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - work_end_time_));
+    }
+  }
+
+  void RecordWorkEnd() {
+    work_end_time_ = std::chrono::steady_clock::now();
+    has_worked_ = true;
+  }
+
+  // Executes the given tasks on the shared pool or through the executor.
+  void ExecuteTaskPointersElsewhere(Task* const* tasks, int tasks_count) {
+    if (shared_pool_) {
+      shared_pool_->Execute(tasks, tasks_count, &main_thread_task_allocator_,
+                            &counter_to_decrement_when_ready_, priority_);
+      return;
+    }
+    while (static_cast<int>(executor_allocators_.size()) < tasks_count) {
+      executor_allocators_.emplace_back(new Allocator);
+    }
+    TaskListBody body;
+    body.tasks = tasks;
+    body.allocators = executor_allocators_.data();
+    executor_->ParallelFor(tasks_count, &body);
+  }
+
+  // Executes the tasks of task_pointers_ on threads_count threads,
+  // balancing them by work stealing. The initial ranges of tasks are
+  // proportional to the thread speeds.
+  //
+  // A shared pool already balances tasks dynamically, as its workers take
+  // them one at a time, so they are handed to it directly. That also lets
+  // its workers switch to higher-priority batches between tasks.
+  void ExecuteTaskPointersWithWorkStealing(int threads_count) {
+    const int tasks_count = task_pointers_.size();
+    if (shared_pool_) {
+      ExecuteTaskPointersElsewhere(task_pointers_.data(), tasks_count);
+      return;
+    }
+    if (work_stealing_tasks_count_ < threads_count) {
+      work_stealing_tasks_.reset(new WorkStealingTask[threads_count]);
+      work_stealing_tasks_count_ = threads_count;
+    }
+    const std::vector<float> speeds = ThreadSpeeds(threads_count);
+    float total_speed = 0;
+    for (float speed : speeds) {
+      total_speed += speed;
+    }
+    float cumulative_speed = 0;
+    int end = 0;
+    for (int i = 0; i < threads_count; i++) {
+      const int begin = end;
+      cumulative_speed += speeds[i];
+      end = static_cast<int>(
+          std::round(tasks_count * cumulative_speed / total_speed));
+      end = i == threads_count - 1
+                ? tasks_count
+                : std::max(begin, std::min(tasks_count, end));
+      WorkStealingTask& task = work_stealing_tasks_[i];
+      task.queue.Reset(begin, end);
+      task.tasks = task_pointers_.data();
+      task.all = work_stealing_tasks_.get();
+      task.count = threads_count;
+      task.index = i;
+    }
+    Execute(threads_count, work_stealing_tasks_.get());
+    UpdateThreadSpeeds(threads_count);
+  }
+
+  void ResetThreadSpeeds() {
+    worker_speeds_.clear();
+    main_thread_speed_ = 1.f;
+  }
+
+  // Updates the thread speeds from the execution that just completed.
+  // Thanks to work stealing, all threads keep running tasks until about
+  // the same time, so the rates at which they ran tasks reflect their
+  // speeds, whatever their initial ranges. Each rate is taken relative to
+  // the mean rate of the execution, as tasks of different executions have
+  // different sizes, and is blended into a moving average to smooth out
+  // preemptions. Threads that ran no task, e.g. because they were woken up
+  // after all tasks were taken, tell nothing about their speed.
+  // With a shared pool or an executor, tasks don't run on the same threads
+  // from one execution to the next, so there is nothing to track.
+  void UpdateThreadSpeeds(int threads_count) {
+    if (shared_pool_ || executor_) {
+      return;
+    }
+    std::vector<float> rates(threads_count, 0.f);
+    float total_rate = 0;
+    int measured_count = 0;
+    for (int i = 0; i < threads_count; i++) {
+      const WorkStealingTask& task = work_stealing_tasks_[i];
+      const float seconds =
+          std::chrono::duration<float>(task.run_duration).count();
+      if (task.tasks_run > 0 && seconds > 0) {
+        rates[i] = task.tasks_run / seconds;
+        total_rate += rates[i];
+        measured_count++;
+      }
+    }
+    if (measured_count < 2) {
+      return;
+    }
+    const float mean_rate = total_rate / measured_count;
+    if (worker_speeds_.size() < static_cast<std::size_t>(threads_count - 1)) {
+      worker_speeds_.resize(threads_count - 1, 1.f);
+    }
+    for (int i = 0; i < threads_count; i++) {
+      if (rates[i] == 0) {
+        continue;
+      }
+      float& speed =
+          i == threads_count - 1 ? main_thread_speed_ : worker_speeds_[i];
+      const float relative_rate =
+          std::max(kMinThreadSpeed, std::min(kMaxThreadSpeed,
+                                             rates[i] / mean_rate));
+      speed += (relative_rate - speed) * kThreadSpeedUpdateWeight;
+    }
+  }
+
+  // Ensures that the pool has at least the given count of workers.
+  // If any new worker has to be created, this function waits for it to
+  // be ready.
+  void CreateWorkers(std::size_t workers_count) {
+    if (workers_.size() >= workers_count) {
+      return;
+    }
+    counter_to_decrement_when_ready_.Reset(workers_count - workers_.size());
+    while (workers_.size() < workers_count) {
+      workers_.push_back(new Worker(&counter_to_decrement_when_ready_,
+                                    &busy_wait_budget_,
+                                    WorkerCpus(workers_.size()),
+                                    worker_idle_timeout_));
+    }
+    counter_to_decrement_when_ready_.Wait(busy_wait_budget_.max_duration());
+  }
+
+  // Returns the CPUs that the given worker gets pinned to.
+  std::vector<int> WorkerCpus(std::size_t index) const {
+    return worker_cpu_sets_.empty()
+               ? std::vector<int>()
+               : worker_cpu_sets_[index % worker_cpu_sets_.size()];
+  }
+
+  // Hands the task to the given worker, first recreating it if it has
+  // exited after being idle for too long.
+  void StartWorker(std::size_t index, Task* task) {
+    while (!workers_[index]->TryStartWork(task)) {
+      RespawnWorker(index);
+    }
+  }
+
+  void RespawnWorker(std::size_t index) {
+    ScopedProfilingLabel label("WorkersPool::RespawnWorker");
+    const auto start_time = std::chrono::steady_clock::now();
+    delete workers_[index];
+    respawn_counter_.Reset(1);
+    workers_[index] =
+        new Worker(&counter_to_decrement_when_ready_, &busy_wait_budget_,
+                   WorkerCpus(index), worker_idle_timeout_, &respawn_counter_);
+    respawn_counter_.Wait(busy_wait_budget_.max_duration());
+    const auto latency =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_time);
+    respawn_stats_.count++;
+    respawn_stats_.total_latency += latency;
+    respawn_stats_.max_latency = std::max(respawn_stats_.max_latency, latency);
+  }
+
+  void DeleteWorkers() {
+    for (auto w : workers_) {
+      delete w;
+    }
+    workers_.clear();
+  }
+
+  // copy construction disallowed
+  WorkersPool(const WorkersPool&) = delete;
 
   // The workers in this pool. They are owned by the pool:
   // the pool creates workers and destroys them in its destructor.
@@ -446,6 +1676,39 @@ class WorkersPool {
   // The BlockingCounter used to wait for the workers.
   BlockingCounter counter_to_decrement_when_ready_;
 
+  // How long threads busy-wait, adapted to the intervals between the end
+  // of some work, at work_end_time_, and the start of the next.
+  BusyWaitBudget busy_wait_budget_;
+  bool has_worked_ = false;
+  std::chrono::steady_clock::time_point work_end_time_;
+  // The number of ongoing hot windows, see BeginHotWindow().
+  int hot_windows_ = 0;
+
+  // The CPU sets that workers get pinned to, see WorkerCpuSets.
+  std::vector<std::vector<int>> worker_cpu_sets_;
+
+  // See set_worker_idle_timeout(). The BlockingCounter used to wait for
+  // recreated workers to start is separate, as they are recreated while
+  // the other workers may be decrementing counter_to_decrement_when_ready_.
+  std::chrono::nanoseconds worker_idle_timeout_ =
+      std::chrono::nanoseconds::max();
+  BlockingCounter respawn_counter_;
+  WorkerRespawnStats respawn_stats_;
+
+  // The relative speeds of the workers and of the current thread, see
+  // ThreadSpeeds and UpdateThreadSpeeds.
+  std::vector<float> worker_speeds_;
+  float main_thread_speed_ = 1.f;
+
+  // The shared pool or the executor running our tasks, if any, the list of
+  // tasks handed to them, and the allocators of the tasks that the executor
+  // runs.
+  SharedWorkersPool* shared_pool_ = nullptr;
+  TaskExecutor* executor_ = nullptr;
+  WorkPriority priority_ = WorkPriority::Normal;
+  std::vector<Task*> shared_task_pointers_;
+  std::vector<std::unique_ptr<Allocator>> executor_allocators_;
+
   // For N-threaded operations, we will use only N-1 worker threads
   // while the last task will be run directly on the main thread.
   // It will then use this main_thread_task_allocator_; having a
@@ -453,12 +1716,90 @@ class WorkersPool {
   // allows to use the same code for all tasks regardless of which
   // thread they run on.
   Allocator main_thread_task_allocator_;
+
+  // The per-thread tasks and the task list used by ExecuteWithWorkStealing,
+  // kept here so that they only get allocated when they need to grow.
+  std::unique_ptr<WorkStealingTask[]> work_stealing_tasks_;
+  int work_stealing_tasks_count_ = 0;
+  std::vector<Task*> task_pointers_;
+
+  // The state of the work started by StartAsync(): its task, the worker
+  // running it when there is no shared pool, and what is used to wait for it.
+  FunctionTask async_task_;
+  Worker* async_worker_ = nullptr;
+  BlockingCounter async_counter_;
+  Task* async_task_pointer_ = nullptr;
+  SharedWorkersPool::Batch async_batch_;
+  bool async_pending_ = false;
 };
 
+// The task we use to pack a range of the columns of the RHS into a view on
+// the corresponding range of a PackedSideBlock shared by all tasks. The
+// ranges of different tasks are disjoint, and start at multiples of the
+// kernel width, so that tasks write to disjoint runs of the packed block and
+// of its sums of slices.
+template <typename PackedRhs, typename RhsMatrixMapType>
+struct PackRhsTask : Task {
+  PackRhsTask(PackedRhs* _packed_rhs, const RhsMatrixMapType& _rhs,
+              int _start_col, int _cols)
+      : packed_rhs(_packed_rhs),
+        rhs(_rhs),
+        start_col(_start_col),
+        cols(_cols) {}
+
+  void Run() override {
+    ScopedProfilingLabel label("PackRhsTask");
+    PackedRhs packed_rhs_range(
+        *packed_rhs, start_col,
+        RoundUp<PackedRhs::KernelSideFormat::kWidth>(cols));
+    PackRhs(&packed_rhs_range, rhs.block(0, start_col, rhs.rows(), cols));
+  }
+
+  PackedRhs* packed_rhs;
+  const RhsMatrixMapType rhs;
+  const int start_col;
+  const int cols;
+};
+
+// Packs the RHS, or a block of its columns, into packed_rhs, splitting the
+// packing work across up to thread_count threads. Returns once it is fully
+// packed, so that this serves as the barrier between the packing and the
+// compute phases.
+template <typename PackedRhs, typename RhsMatrixMapType,
+          typename WorkersPoolType>
+void MultiThreadPackRhs(WorkersPoolType* workers_pool, int thread_count,
+                        PackedRhs* packed_rhs, const RhsMatrixMapType& rhs) {
+  static const int kKernelWidth = PackedRhs::KernelSideFormat::kWidth;
+  // Waking up threads has some overhead, which small RHS packing tasks
+  // would not make up for.
+  static const int kMinBytesPerTask = 32 * 1024;
+  const int cols = rhs.cols();
+  const int runs = CeilQuotient(cols, kKernelWidth);
+  const std::uint64_t bytes = std::uint64_t(cols) * std::uint64_t(rhs.rows());
+  const int task_count = static_cast<int>(std::min<std::uint64_t>(
+      std::min(thread_count, runs),
+      std::max<std::uint64_t>(1, bytes / kMinBytesPerTask)));
+  if (task_count == 1) {
+    PackRhs(packed_rhs, rhs);
+    return;
+  }
+  typedef PackRhsTask<PackedRhs, RhsMatrixMapType> TaskType;
+  std::vector<TaskType> tasks;
+  tasks.reserve(task_count);
+  for (int n = 0; n < task_count; n++) {
+    const int start_col = kKernelWidth * (runs * n / task_count);
+    const int end_col =
+        std::min(cols, kKernelWidth * (runs * (n + 1) / task_count));
+    tasks.emplace_back(packed_rhs, rhs, start_col, end_col - start_col);
+  }
+  workers_pool->Execute(task_count, tasks.data());
+}
+
 // The task we use to implement a multi-threaded Gemm: a block of the
-// RHS has been packed by the master thread; each worker thread
-// then has to pack a block of the LHS and accumulate the Gemm of these
-// packed LHS and RHS blocks.
+// columns of the RHS, starting at packed_rhs_start_col, has been packed
+// across all threads; each task then computes a tile of the result within
+// that block, packing each block of its rows of the LHS only once. See
+// MultiThreadGemmByRhsBlocks.
 template <typename KernelFormat, typename InputScalar, typename OutputScalar,
           typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
           MapOrder ResultOrder, typename LhsOffset, typename RhsOffset,
@@ -469,6 +1810,7 @@ struct GemmWithPackedRhsTask : Task {
   GemmWithPackedRhsTask(GemmContextType* _context, const KernelBase& _kernel,
                         const MatrixMap<const InputScalar, LhsOrder>& _lhs,
                         const PackedRhs& _packed_rhs,
+                        int _packed_rhs_start_col,
                         MatrixMap<OutputScalar, ResultOrder>* _result,
                         const MatrixBlockBounds& _result_block,
                         const LhsOffset& _lhs_offset,
@@ -479,6 +1821,7 @@ struct GemmWithPackedRhsTask : Task {
         kernel(_kernel),
         lhs(_lhs),
         packed_rhs(_packed_rhs),
+        packed_rhs_start_col(_packed_rhs_start_col),
         result(*_result),
         result_block(_result_block),
         lhs_offset(_lhs_offset),
@@ -499,22 +1842,39 @@ struct GemmWithPackedRhsTask : Task {
 
     local_allocator->Commit();
 
-    for (int c = 0; c < cols; c += block_params.l2_cols) {
-      int cs = std::min(block_params.l2_cols, cols - c);
+    // See SingleThreadGemm about checking for cancellation.
+    for (int r = 0; r < rows && !context->cancelled();
+         r += block_params.l2_rows) {
+      int rs = std::min(block_params.l2_rows, rows - r);
 
-      for (int r = 0; r < rows; r += block_params.l2_rows) {
-        int rs = std::min(block_params.l2_rows, rows - r);
+      PackLhs(&packed_lhs, lhs.block(r, 0, rs, depth));
 
-        PackLhs(&packed_lhs, lhs.block(r, 0, rs, depth));
+      for (int c = 0; c < cols; c += block_params.l2_cols) {
+        int cs = std::min(block_params.l2_cols, cols - c);
 
-        Compute(kernel, block_params, &packed_result, packed_lhs, packed_rhs,
-                depth);
+        if (c > 0 && context->cancelled()) {
+          break;
+        }
+
+        // The packed RHS extends past this block, so we must not compute
+        // past the end of the block, or past the end of the packed RHS.
+        BlockParams compute_block_params = block_params;
+        compute_block_params.l2_cols = RoundUp<KernelFormat::kCols>(cs);
+        compute_block_params.l1_cols = compute_block_params.l2_cols;
+
+        const PackedRhs packed_rhs_block(
+            packed_rhs, result_block.start_col - packed_rhs_start_col + c,
+            compute_block_params.l2_cols);
+
+        Compute(kernel, compute_block_params, &packed_result, packed_lhs,
+                packed_rhs_block, depth);
 
         auto curr_result_block = MatrixBlockBounds(
             result_block.start_row + r, result_block.start_col + c, rs, cs);
         UnpackResult<KernelFormat>(
             &result, curr_result_block, packed_result, depth,
-            packed_lhs.sums_of_each_slice(), packed_rhs.sums_of_each_slice(),
+            packed_lhs.sums_of_each_slice(),
+            packed_rhs_block.sums_of_each_slice(),
             lhs_offset.block(curr_result_block.start_row, rs),
             rhs_offset.block(curr_result_block.start_col, cs), output_pipeline);
       }
@@ -526,7 +1886,8 @@ struct GemmWithPackedRhsTask : Task {
   const GemmContextType* context;
   const KernelBase& kernel;
   const MatrixMap<const InputScalar, LhsOrder> lhs;
-  const PackedRhs packed_rhs;
+  const PackedRhs& packed_rhs;
+  const int packed_rhs_start_col;
   MatrixMap<OutputScalar, ResultOrder> result;
   const MatrixBlockBounds result_block;
   const LhsOffset& lhs_offset;
@@ -535,16 +1896,275 @@ struct GemmWithPackedRhsTask : Task {
   const OutputPipelineType& output_pipeline;
 };
 
+// Variant of GemmWithPackedRhsTask where the LHS has already been packed
+// ahead of time into a PackedLhsMatrix, so that tasks don't have to
+// pack any LHS block.
+template <typename KernelFormat, typename OutputScalar, MapOrder ResultOrder,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType>
+struct GemmWithPackedLhsAndRhsTask : Task {
+  typedef PackedSideBlock<typename KernelFormat::Rhs> PackedRhs;
+  GemmWithPackedLhsAndRhsTask(const SingleThreadGemmContext* _context,
+                              const KernelBase& _kernel,
+                              const PackedLhsMatrix<KernelFormat>& _packed_lhs,
+                              const PackedRhs& _packed_rhs,
+                              int _packed_rhs_start_col,
+                              MatrixMap<OutputScalar, ResultOrder>* _result,
+                              const MatrixBlockBounds& _result_block,
+                              const LhsOffset& _lhs_offset,
+                              const RhsOffset& _rhs_offset,
+                              const BlockParams& _block_params,
+                              const OutputPipelineType& _output_pipeline)
+      : context(_context),
+        kernel(_kernel),
+        packed_lhs(_packed_lhs),
+        packed_rhs(_packed_rhs),
+        packed_rhs_start_col(_packed_rhs_start_col),
+        result(*_result),
+        result_block(_result_block),
+        lhs_offset(_lhs_offset),
+        rhs_offset(_rhs_offset),
+        block_params(_block_params),
+        output_pipeline(_output_pipeline) {}
+
+  void Run() override {
+    ScopedProfilingLabel label("GemmWithPackedLhsAndRhsTask");
+
+    const int rows = result_block.rows;
+    const int cols = result_block.cols;
+    const int depth = packed_lhs.depth();
+
+    PackedResult packed_result(local_allocator, block_params);
+
+    local_allocator->Commit();
+
+    for (int r = 0; r < rows && !context->cancelled();
+         r += block_params.l2_rows) {
+      int rs = std::min(block_params.l2_rows, rows - r);
+
+      const auto packed_lhs_block =
+          packed_lhs.block(result_block.start_row + r, rs);
+
+      for (int c = 0; c < cols; c += block_params.l2_cols) {
+        int cs = std::min(block_params.l2_cols, cols - c);
+
+        if (c > 0 && context->cancelled()) {
+          break;
+        }
+
+        // See SingleThreadGemmWithPackedLhs: blocks must not be computed
+        // past the end of the packed LHS, nor of the packed RHS.
+        BlockParams compute_block_params = block_params;
+        compute_block_params.l2_rows = RoundUp<KernelFormat::kRows>(rs);
+        compute_block_params.l1_rows =
+            std::min(block_params.l1_rows, compute_block_params.l2_rows);
+        compute_block_params.l2_cols = RoundUp<KernelFormat::kCols>(cs);
+        compute_block_params.l1_cols = compute_block_params.l2_cols;
+
+        const PackedRhs packed_rhs_block(
+            packed_rhs, result_block.start_col - packed_rhs_start_col + c,
+            compute_block_params.l2_cols);
+
+        Compute(kernel, compute_block_params, &packed_result,
+                packed_lhs_block, packed_rhs_block, depth);
+
+        auto curr_result_block = MatrixBlockBounds(
+            result_block.start_row + r, result_block.start_col + c, rs, cs);
+        UnpackResult<KernelFormat>(
+            &result, curr_result_block, packed_result, depth,
+            packed_lhs_block.sums_of_each_slice(),
+            packed_rhs_block.sums_of_each_slice(),
+            lhs_offset.block(curr_result_block.start_row, rs),
+            rhs_offset.block(curr_result_block.start_col, cs),
+            output_pipeline);
+      }
+    }
+
+    local_allocator->Decommit();
+  }
+
+  const SingleThreadGemmContext* context;
+  const KernelBase& kernel;
+  const PackedLhsMatrix<KernelFormat>& packed_lhs;
+  const PackedRhs& packed_rhs;
+  const int packed_rhs_start_col;
+  MatrixMap<OutputScalar, ResultOrder> result;
+  const MatrixBlockBounds result_block;
+  const LhsOffset& lhs_offset;
+  const RhsOffset& rhs_offset;
+  const BlockParams& block_params;
+  const OutputPipelineType& output_pipeline;
+};
+
+// The task we use to implement a split-depth Gemm (see
+// MultiThreadGemmSplitDepth): it computes the whole result, but only over a
+// range of the depth, into its own int32 accumulators, along with the sums
+// of each slice of its ranges of the LHS and RHS. Since all of these are
+// linear in the depth, summing them over all ranges gives what a single
+// Gemm over the whole depth would compute before unpacking.
+template <typename KernelFormat, typename InputScalar, MapOrder LhsOrder,
+          MapOrder RhsOrder>
+struct SplitDepthGemmTask : Task {
+  SplitDepthGemmTask(const KernelBase& _kernel,
+                     const MatrixMap<const InputScalar, LhsOrder>& _lhs,
+                     const MatrixMap<const InputScalar, RhsOrder>& _rhs,
+                     std::int32_t* _accum, std::int32_t* _lhs_sums,
+                     std::int32_t* _rhs_sums,
+                     const SingleThreadGemmContext& _cache_params)
+      : kernel(_kernel),
+        lhs(_lhs),
+        rhs(_rhs),
+        accum(_accum),
+        lhs_sums(_lhs_sums),
+        rhs_sums(_rhs_sums),
+        cache_params(_cache_params) {}
+
+  void Run() override {
+    ScopedProfilingLabel label("SplitDepthGemmTask");
+
+    const int rows = lhs.rows();
+    const int cols = rhs.cols();
+    const int depth = lhs.cols();
+
+    BlockParams block_params;
+    block_params.Init<KernelFormat>(rows, cols, depth, 1,
+                                    cache_params.l1_bytes_to_use(),
+                                    cache_params.l2_bytes_to_use(),
+                                    cache_params.l2_rhs_factor());
+
+    PackedSideBlock<typename KernelFormat::Lhs> packed_lhs(
+        Side::Lhs, local_allocator, block_params);
+    PackedSideBlock<typename KernelFormat::Rhs> packed_rhs(
+        Side::Rhs, local_allocator, block_params);
+    PackedResult packed_result(local_allocator, block_params);
+
+    local_allocator->Commit();
+
+    for (int r = 0; r < rows && !cache_params.cancelled();
+         r += block_params.l2_rows) {
+      int rs = std::min(block_params.l2_rows, rows - r);
+
+      PackLhs(&packed_lhs, lhs.block(r, 0, rs, depth));
+      std::copy(packed_lhs.sums_of_each_slice(),
+                packed_lhs.sums_of_each_slice() + rs, lhs_sums + r);
+
+      for (int c = 0; c < cols; c += block_params.l2_cols) {
+        int cs = std::min(block_params.l2_cols, cols - c);
+
+        if (c > 0 && cache_params.cancelled()) {
+          break;
+        }
+
+        PackRhs(&packed_rhs, rhs.block(0, c, depth, cs));
+        if (r == 0) {
+          std::copy(packed_rhs.sums_of_each_slice(),
+                    packed_rhs.sums_of_each_slice() + cs, rhs_sums + c);
+        }
+
+        Compute(kernel, block_params, &packed_result, packed_lhs, packed_rhs,
+                depth);
+
+        const auto packed_result_map = packed_result.Map();
+        for (int bc = 0; bc < cs; bc++) {
+          std::copy(packed_result_map.data(0, bc),
+                    packed_result_map.data(0, bc) + rs,
+                    accum + r + (c + bc) * rows);
+        }
+      }
+    }
+
+    local_allocator->Decommit();
+  }
+
+  const KernelBase& kernel;
+  const MatrixMap<const InputScalar, LhsOrder> lhs;
+  const MatrixMap<const InputScalar, RhsOrder> rhs;
+  std::int32_t* const accum;
+  std::int32_t* const lhs_sums;
+  std::int32_t* const rhs_sums;
+  const SingleThreadGemmContext& cache_params;
+};
+
+// The int32 accumulators of a whole result, as UnpackResult takes them in
+// place of a PackedResult.
+struct ResultAccumulators {
+  explicit ResultAccumulators(
+      const MatrixMap<const std::int32_t, MapOrder::ColMajor>& _map)
+      : map(_map) {}
+
+  MatrixMap<const std::int32_t, MapOrder::ColMajor> Map() const { return map; }
+
+  MatrixMap<const std::int32_t, MapOrder::ColMajor> map;
+};
+
 // This base class for multi-threading allows subclasses to implement their own
 // workers_pool() method.  See MultiThreadGemmContext below for an example;
 // any other implementation of workers_pool() must return an object with the
-// same public methods as WorkersPool.
+// same public methods as WorkersPool. To run Gemms on other threads than
+// those of WorkersPool, it is simpler to implement a TaskExecutor instead,
+// see WorkersPool::set_executor.
 class MultiThreadGemmContextBase : public SingleThreadGemmContext {
  public:
-  void set_max_num_threads(int n) { max_num_threads_ = n; }
+  void set_max_num_threads(int n) {
+    max_num_threads_ = n;
+    // The calibrated GEMV thread ceiling may have been capped by the
+    // previous maximum number of threads.
+    measured_gemv_threads_ = 0;
+  }
 
   int max_num_threads() const { return max_num_threads_; }
 
+  // GEMV being memory-bound, it is not worth using more threads than it
+  // takes to saturate memory bandwidth. This sets that ceiling explicitly.
+  // The default value 0 means that it is the one measured by
+  // CalibrateGemvThreads, or kDefaultMaxGemvThreads without calibration
+  // (see multi_thread_gemv.h).
+  void set_max_num_gemv_threads(int n) { max_num_gemv_threads_ = n; }
+
+  // Returns the GEMV thread ceiling, or 0 if it has not been set or
+  // calibrated.
+  int max_num_gemv_threads() const {
+    return max_num_gemv_threads_ ? max_num_gemv_threads_
+                                 : measured_gemv_threads_;
+  }
+
+  void set_measured_gemv_threads(int n) { measured_gemv_threads_ = n; }
+
+  // By default, multi-threaded Gemms alternate between packing an L2 block
+  // of columns of the RHS, across all threads, and computing it. When this
+  // is enabled, an RHS spanning several such blocks instead has each block
+  // packed while the previous one is being computed, see
+  // MultiThreadGemmPipelined. That hides the latency of packing the RHS, at
+  // the cost of a second packed block of the RHS.
+  void set_pipeline_rhs_packing(bool b) { pipeline_rhs_packing_ = b; }
+
+  bool pipeline_rhs_packing() const { return pipeline_rhs_packing_; }
+
+  // The cost model used to choose how many threads Gemms use. By default,
+  // it is not calibrated, and fixed thresholds are used instead. It can be
+  // calibrated by CalibrateGemmCostModel, or reloaded from a previous
+  // calibration with ParseGemmCostModel.
+  void set_gemm_cost_model(const GemmCostModel& cost_model) {
+    gemm_cost_model_ = cost_model;
+  }
+
+  const GemmCostModel& gemm_cost_model() const { return gemm_cost_model_; }
+
+  // Returns the context with which the given thread runs Gemms of a batch
+  // (see DispatchGemmBatch), with the same cache sizes as this context.
+  // Each thread has its own context, hence its own allocator, and they are
+  // kept from one batch to the next so that their buffers are reused.
+  SingleThreadGemmContext* batch_thread_context(int index) {
+    while (static_cast<int>(batch_thread_contexts_.size()) <= index) {
+      batch_thread_contexts_.emplace_back(new SingleThreadGemmContext);
+    }
+    SingleThreadGemmContext* context = batch_thread_contexts_[index].get();
+    context->set_l1_bytes_to_use(l1_bytes_to_use());
+    context->set_l2_bytes_to_use(l2_bytes_to_use());
+    context->set_l2_rhs_factor(l2_rhs_factor());
+    context->set_cancellation(cancellation());
+    return context;
+  }
+
  protected:
   // The maximum number of worker threads to use (including
   // the master thread).
@@ -552,7 +2172,9 @@ class MultiThreadGemmContextBase : public SingleThreadGemmContext {
   // because gemmlowp's primary target is mobile hardware, where thermal
   // constraints usually mean that it may not be realistic to use more
   // than 1 CPU core even if multiple cores are present.
-  // The special value 0 means try to detect the number of hardware threads.
+  // The special value 0 means try to detect the number of threads worth
+  // using, which may be less than the number of hardware threads, e.g. in
+  // containers or with SMT: see HardwareConcurrencyInfo.
   // Note: this assumes that all CPU cores are equivalent. That assumption
   // is defeated on big.LITTLE ARM devices, where we have no API to query
   // the number of big cores (which is typically what we would want to use,
@@ -561,12 +2183,78 @@ class MultiThreadGemmContextBase : public SingleThreadGemmContext {
   // so users who want multi-threading have to make the decision of how many
   // threads to use by themselves.
   int max_num_threads_ = 1;
+
+  // The GEMV thread ceiling, as set by set_max_num_gemv_threads() and as
+  // measured by CalibrateGemvThreads.
+  int max_num_gemv_threads_ = 0;
+  int measured_gemv_threads_ = 0;
+
+  // See set_pipeline_rhs_packing().
+  bool pipeline_rhs_packing_ = false;
+
+  // See set_gemm_cost_model().
+  GemmCostModel gemm_cost_model_;
+
+  // See batch_thread_context().
+  std::vector<std::unique_ptr<SingleThreadGemmContext>> batch_thread_contexts_;
 };
 
 class MultiThreadGemmContext : public MultiThreadGemmContextBase {
  public:
   WorkersPool* workers_pool() { return &workers_pool_; }
 
+  // See WorkersPool::set_max_busy_wait_duration. Lowering this is useful
+  // on shared hosts, where busy-waiting threads take CPU time away from
+  // other processes.
+  void set_max_busy_wait_duration(std::chrono::nanoseconds duration) {
+    workers_pool_.set_max_busy_wait_duration(duration);
+  }
+
+  // See WorkersPool::set_shared_pool. This lets many contexts, each used by
+  // one thread, share a fixed number of worker threads. Example:
+  //
+  //   SharedWorkersPool shared_pool;  // One thread per hardware thread.
+  //   // In each thread calling Gemm:
+  //   GemmContext context;
+  //   context.set_shared_workers_pool(&shared_pool);
+  //   context.set_max_num_threads(0);
+  void set_shared_workers_pool(SharedWorkersPool* shared_pool) {
+    workers_pool_.set_shared_pool(shared_pool);
+  }
+
+  // See WorkersPool::set_worker_idle_timeout. By default, worker threads
+  // live as long as the context.
+  void set_worker_idle_timeout(std::chrono::nanoseconds timeout) {
+    workers_pool_.set_worker_idle_timeout(timeout);
+  }
+
+  // See WorkersPool::set_priority. With contexts sharing a pool, this lets
+  // latency-critical Gemms get workers ahead of large background Gemms,
+  // which on a shared pool are split into more, smaller tasks so as to
+  // release workers more often (see MaxTasksPerThread).
+  void set_priority(WorkPriority priority) {
+    workers_pool_.set_priority(priority);
+  }
+
+  // See WorkersPool::set_executor. This runs Gemms on the threads of an
+  // application's own thread pool, see ScheduleTaskExecutor.
+  void set_task_executor(TaskExecutor* executor) {
+    workers_pool_.set_executor(executor);
+  }
+
+  // See WorkersPool::set_affinity. By default, threads are not pinned.
+  // On multi-socket machines, pinning keeps the packed LHS blocks of each
+  // worker on its own NUMA node, and AffinityPolicy::SocketLocal also keeps
+  // the packed RHS shared by all workers on the same node as them.
+  void set_affinity(AffinityPolicy policy,
+                    const std::vector<int>& cpu_set = std::vector<int>()) {
+    workers_pool_.set_affinity(policy, cpu_set);
+  }
+
+  // See WorkersPool::BeginHotWindow, and ScopedHotWorkers.
+  void BeginHotWindow() { workers_pool_.BeginHotWindow(); }
+  void EndHotWindow() { workers_pool_.EndHotWindow(); }
+
  private:
   // The workers pool used by MultiThreadGemm. Making
   // this part of the context allows it to be persistent,
@@ -574,10 +2262,68 @@ class MultiThreadGemmContext : public MultiThreadGemmContextBase {
   WorkersPool workers_pool_;
 };
 
+// Keeps the workers of a context hot, i.e. busy-waiting for new work, for
+// the lifetime of this object. Between Gemms, idle workers only busy-wait
+// for a while (see BusyWaitBudget) before waiting passively, after which
+// the next Gemm waits for them to be woken up. A sequence of Gemms
+// separated by short computations on the calling thread, such as the
+// layers of a neural network and the quantization of their activations,
+// may thus pay that latency at each Gemm. Example:
+//
+//   {
+//     ScopedHotWorkers hot_workers(&context);
+//     for (const Layer& layer : layers) {
+//       QuantizeActivations(layer, ...);
+//       GemmWithOutputPipeline<...>(&context, ...);
+//     }
+//   }
+//
+// The workers keep their CPUs busy throughout, so this should only span
+// such sequences, not the idle time between them.
+class ScopedHotWorkers {
+ public:
+  explicit ScopedHotWorkers(MultiThreadGemmContext* context)
+      : context_(context) {
+    context_->BeginHotWindow();
+  }
+
+  ~ScopedHotWorkers() { context_->EndHotWindow(); }
+
+ private:
+  ScopedHotWorkers(const ScopedHotWorkers&) = delete;
+  ScopedHotWorkers& operator=(const ScopedHotWorkers&) = delete;
+
+  MultiThreadGemmContext* const context_;
+};
+
+// The ranges of the depth of split-depth Gemms are at least this deep, so
+// that summing their accumulators is cheap compared to computing them.
+const int kMinSplitDepth = 512;
+
+// Determines in how many ranges of the depth a Gemm could be split, see
+// MultiThreadGemmSplitDepth. That is only worth it for deep Gemms, as each
+// range needs its own accumulators for the whole result.
+inline int HowManyDepthSplits(int max_num_threads,
+                              const GemmCostModel& cost_model, int rows,
+                              int cols, int depth) {
+  if (max_num_threads == 1) {
+    return 1;
+  }
+  const int max_count = GetHardwareConcurrency(max_num_threads);
+  const std::uint64_t cubic_size =
+      std::uint64_t(rows) * std::uint64_t(cols) * std::uint64_t(depth);
+  const std::uint64_t split_count = std::min<std::uint64_t>(
+      std::min(max_count, depth / kMinSplitDepth),
+      MaxThreadsForWork(cost_model, cubic_size));
+  return std::max<int>(split_count, 1);
+}
+
 // Determines how many threads should be used for a given Gemm
 // operation.
-template <int KernelRows>
-inline int HowManyThreads(int max_num_threads, int rows, int cols, int depth) {
+template <int KernelRows, int KernelCols>
+inline int HowManyThreads(int max_num_threads,
+                          const GemmCostModel& cost_model, int rows, int cols,
+                          int depth) {
   // Early-exit in the default case where multi-threading is disabled.
   if (max_num_threads == 1) {
     return 1;
@@ -587,33 +2333,38 @@ inline int HowManyThreads(int max_num_threads, int rows, int cols, int depth) {
   int max_count = GetHardwareConcurrency(max_num_threads);
 
   // Basic calculation: take into account max pool size, and
-  // how many rows we have to feed our kernel.
+  // how many rows and columns we have to feed our kernel.
   // The motivation for an absolute minimum number of rows per thread,
   // potentially higher than KernelRows, is that very thin thread workload
   // currently defeat assumptions of the AddMod generator, resulting
   // in substantial bias in TestWithRealData on 24 threads.
   // Ideally, the AddMod generator should be aware of global (r,c) coordinates
   // so as to be independent of the number of threads.
+  // Columns are only split across threads when there are too few rows,
+  // see ChooseTaskGrid.
   static const int AbsoluteMinRowsPerThread = 16;
   static const int MinRowsPerThread = KernelRows > AbsoluteMinRowsPerThread
                                           ? KernelRows
                                           : AbsoluteMinRowsPerThread;
-  int thread_count = std::min(max_count, CeilQuotient(rows, MinRowsPerThread));
+  static const int AbsoluteMinColsPerThread = 16;
+  static const int MinColsPerThread = KernelCols > AbsoluteMinColsPerThread
+                                          ? KernelCols
+                                          : AbsoluteMinColsPerThread;
+  int thread_count =
+      std::min(max_count, CeilQuotient(rows, MinRowsPerThread) *
+                              CeilQuotient(cols, MinColsPerThread));
 
   // At this point for small products we already have thread_count==1 so
   // we can avoid doing more work; otherwise, we still want to check
   // that the cubic size (rows*cols*depth) is big enough to keep
   // workers_ busy.
   if (thread_count > 1) {
-    // Empirically determined value.
-    static const std::uint64_t min_cubic_size_per_thread = 64 * 1024;
-
     // We can only multiply two out of three sizes without risking overflow
     const std::uint64_t cubic_size =
         std::uint64_t(rows) * std::uint64_t(cols) * std::uint64_t(depth);
 
-    thread_count =
-        std::min(thread_count, int(cubic_size / min_cubic_size_per_thread));
+    thread_count = static_cast<int>(std::min<std::uint64_t>(
+        thread_count, MaxThreadsForWork(cost_model, cubic_size)));
 
     if (thread_count < 1) {
       thread_count = 1;
@@ -624,11 +2375,287 @@ inline int HowManyThreads(int max_num_threads, int rows, int cols, int depth) {
   return thread_count;
 }
 
+// The grid of tasks that a multi-threaded Gemm is split into: each task
+// computes one of grid_rows x grid_cols tiles of the result.
+struct GemmTaskGrid {
+  int grid_rows;
+  int grid_cols;
+
+  int task_count() const { return grid_rows * grid_cols; }
+
+  // Returns the bounds of the tile computed by the given task. Tile
+  // boundaries are multiples of the kernel size, so that tiles can be
+  // handed to the kernel as ranges of packed blocks.
+  template <typename KernelFormat>
+  MatrixBlockBounds Tile(int task, int rows, int cols) const {
+    const int grid_row = task % grid_rows;
+    const int grid_col = task / grid_rows;
+    const int start_row = std::min(
+        rows, RoundUp<KernelFormat::kRows>(rows * grid_row / grid_rows));
+    const int end_row = std::min(
+        rows, RoundUp<KernelFormat::kRows>(rows * (grid_row + 1) / grid_rows));
+    const int start_col = std::min(
+        cols, RoundUp<KernelFormat::kCols>(cols * grid_col / grid_cols));
+    const int end_col = std::min(
+        cols, RoundUp<KernelFormat::kCols>(cols * (grid_col + 1) / grid_cols));
+    return MatrixBlockBounds(start_row, start_col, end_row - start_row,
+                             end_col - start_col);
+  }
+};
+
+// Returns the maximum number of tasks per thread that Gemms running on the
+// given pool are split into. On a shared pool, Gemms are split into more
+// tasks, as its workers may only switch to other batches of tasks, e.g. of
+// higher priority, between tasks.
+template <typename WorkersPoolType>
+int MaxTasksPerThread(const WorkersPoolType* workers_pool) {
+  static const int kMaxTasksPerThread = 4;
+  static const int kMaxTasksPerThreadOnSharedPool = 16;
+  return workers_pool->shared_pool() ? kMaxTasksPerThreadOnSharedPool
+                                     : kMaxTasksPerThread;
+}
+
+// Chooses the grid of tasks that a Gemm running on thread_count threads is
+// split into.
+//
+// Using more tasks than threads lets work stealing make up for threads that
+// are slower or that get preempted, so that the Gemm latency is bounded by
+// the total work rather than by the slowest thread. Each task has some
+// overhead, so tasks are kept reasonably large.
+//
+// Each task packs the LHS blocks of its rows, so that splitting columns
+// across tasks means packing the same LHS rows several times. So columns
+// are only split when there are too few rows to keep all threads busy.
+template <typename KernelFormat>
+GemmTaskGrid ChooseTaskGrid(int thread_count, int max_tasks_per_thread,
+                            int rows, int cols) {
+  static const int AbsoluteMinRowsPerTask = 16;
+  static const int MinRowsPerTask = KernelFormat::kRows > AbsoluteMinRowsPerTask
+                                        ? KernelFormat::kRows
+                                        : AbsoluteMinRowsPerTask;
+  static const int AbsoluteMinColsPerTask = 16;
+  static const int MinColsPerTask = KernelFormat::kCols > AbsoluteMinColsPerTask
+                                        ? KernelFormat::kCols
+                                        : AbsoluteMinColsPerTask;
+  GemmTaskGrid grid;
+  grid.grid_rows = std::max(1, std::min(thread_count * max_tasks_per_thread,
+                                        rows / MinRowsPerTask));
+  grid.grid_cols = std::max(1, std::min(CeilQuotient(thread_count,
+                                                     grid.grid_rows),
+                                        cols / MinColsPerTask));
+  return grid;
+}
+
+// Runs a multi-threaded Gemm one L2 block of columns of the RHS at a time,
+// so that the packed RHS that the tasks read stays within the L2 blocking
+// chosen by BlockParams: all threads first pack the block, then the tasks
+// computing the tiles of the result within that block's columns run.
+//
+// make_task(tile, packed_rhs, packed_rhs_start_col) must return the task
+// computing the given tile of the result from the given packed block of
+// the RHS, whose first column is packed_rhs_start_col.
+template <typename KernelFormat, typename TaskType, typename RhsMatrixMapType,
+          typename WorkersPoolType, typename TaskFactory>
+void MultiThreadGemmByRhsBlocks(const SingleThreadGemmContext* context,
+                                WorkersPoolType* workers_pool,
+                                Allocator* allocator, int thread_count,
+                                const BlockParams& block_params, int rows,
+                                const RhsMatrixMapType& rhs,
+                                const TaskFactory& make_task) {
+  ScopedProfilingLabel label("MultiThreadGemmByRhsBlocks");
+  typedef PackedSideBlock<typename KernelFormat::Rhs> PackedRhs;
+
+  const int cols = rhs.cols();
+  const int depth = rhs.rows();
+
+  PackedRhs packed_rhs(Side::Rhs, allocator, block_params);
+  allocator->Commit();
+
+  std::vector<TaskType> tasks;
+  for (int c = 0; c < cols && !context->cancelled();
+       c += block_params.l2_cols) {
+    const int cs = std::min(block_params.l2_cols, cols - c);
+
+    // Pack the block of the RHS, splitting the work across threads.
+    MultiThreadPackRhs(workers_pool, thread_count, &packed_rhs,
+                       rhs.block(0, c, depth, cs));
+
+    // Give work to each worker.
+    const GemmTaskGrid grid = ChooseTaskGrid<KernelFormat>(
+        thread_count, MaxTasksPerThread(workers_pool), rows, cs);
+    tasks.clear();
+    tasks.reserve(grid.task_count());
+    for (int n = 0; n < grid.task_count(); ++n) {
+      MatrixBlockBounds tile = grid.Tile<KernelFormat>(n, rows, cs);
+      tile.start_col += c;
+      tasks.emplace_back(make_task(tile, packed_rhs, c));
+    }
+    // Execute the work on the workers (and partially on this thread).
+    workers_pool->ExecuteWithWorkStealing(thread_count, grid.task_count(),
+                                          tasks.data());
+  }
+}
+
+// Variant of MultiThreadGemmByRhsBlocks double-buffering the packed RHS:
+// while the tasks computing the tiles of one block run, one more task packs
+// the next block into the other of two alternating PackedSideBlocks. That
+// task comes first in the list of tasks, so that it is started right away,
+// and the others are balanced around it by work stealing. Only the first
+// block is packed before any compute.
+//
+// make_task(tile, packed_rhs, packed_rhs_start_col) must return the task
+// computing the given tile of the result from the given packed block of
+// the RHS, whose first column is packed_rhs_start_col.
+template <typename KernelFormat, typename TaskType, typename RhsMatrixMapType,
+          typename WorkersPoolType, typename TaskFactory>
+void MultiThreadGemmPipelined(const SingleThreadGemmContext* context,
+                              WorkersPoolType* workers_pool,
+                              Allocator* allocator, int thread_count,
+                              const BlockParams& block_params, int rows,
+                              const RhsMatrixMapType& rhs,
+                              const TaskFactory& make_task) {
+  ScopedProfilingLabel label("MultiThreadGemmPipelined");
+  typedef PackedSideBlock<typename KernelFormat::Rhs> PackedRhs;
+  typedef PackRhsTask<PackedRhs, RhsMatrixMapType> PackTaskType;
+
+  const int cols = rhs.cols();
+  const int depth = rhs.rows();
+
+  PackedRhs packed_rhs_0(Side::Rhs, allocator, block_params);
+  PackedRhs packed_rhs_1(Side::Rhs, allocator, block_params);
+  PackedRhs* packed_rhs[2] = {&packed_rhs_0, &packed_rhs_1};
+  allocator->Commit();
+
+  MultiThreadPackRhs(
+      workers_pool, thread_count, packed_rhs[0],
+      rhs.block(0, 0, depth, std::min(block_params.l2_cols, cols)));
+
+  std::vector<PackTaskType> pack_tasks;
+  pack_tasks.reserve(1);
+  std::vector<TaskType> tasks;
+  std::vector<Task*> task_pointers;
+  int current = 0;
+  for (int c = 0; c < cols && !context->cancelled();
+       c += block_params.l2_cols) {
+    const int cs = std::min(block_params.l2_cols, cols - c);
+    const int next_c = c + block_params.l2_cols;
+
+    pack_tasks.clear();
+    task_pointers.clear();
+    if (next_c < cols) {
+      const int next_cs = std::min(block_params.l2_cols, cols - next_c);
+      pack_tasks.emplace_back(packed_rhs[1 - current],
+                              rhs.block(0, next_c, depth, next_cs), 0,
+                              next_cs);
+      task_pointers.push_back(&pack_tasks[0]);
+    }
+
+    const GemmTaskGrid grid = ChooseTaskGrid<KernelFormat>(
+        thread_count, MaxTasksPerThread(workers_pool), rows, cs);
+    tasks.clear();
+    tasks.reserve(grid.task_count());
+    for (int n = 0; n < grid.task_count(); ++n) {
+      MatrixBlockBounds tile = grid.Tile<KernelFormat>(n, rows, cs);
+      tile.start_col += c;
+      tasks.emplace_back(make_task(tile, *packed_rhs[current], c));
+    }
+    for (auto& task : tasks) {
+      task_pointers.push_back(&task);
+    }
+
+    workers_pool->ExecuteWithWorkStealing(thread_count, task_pointers);
+    current = 1 - current;
+  }
+}
+
+// Multi-threaded Gemm splitting the depth instead of the result, for Gemms
+// with too few rows and columns to be split across enough threads, but deep
+// enough to be worth it, such as 16x16384x16. Each thread computes raw int32
+// accumulators over a range of the depth (see SplitDepthGemmTask). They are
+// then summed, and unpacked once through the output pipeline.
+template <typename KernelFormat, typename InputScalar, typename OutputScalar,
+          typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
+          MapOrder ResultOrder, typename LhsOffset, typename RhsOffset,
+          typename OutputPipelineType, typename GemmContextType>
+void MultiThreadGemmSplitDepth(
+    GemmContextType* context, const KernelBase& kernel, int split_count,
+    const MatrixMap<const InputScalar, LhsOrder>& lhs,
+    const MatrixMap<const InputScalar, RhsOrder>& rhs,
+    MatrixMap<OutputScalar, ResultOrder>* result, const LhsOffset& lhs_offset,
+    const RhsOffset& rhs_offset, const OutputPipelineType& output_pipeline) {
+  ScopedProfilingLabel label("gemmlowp::MultiThreadGemmSplitDepth");
+
+  const int rows = result->rows();
+  const int cols = result->cols();
+  const int depth = lhs.cols();
+  assert(split_count > 1);
+
+  Allocator* allocator = context->allocator();
+  const auto accum_handle =
+      allocator->Reserve<std::int32_t>(split_count * rows * cols);
+  const auto lhs_sums_handle =
+      allocator->Reserve<std::int32_t>(split_count * rows);
+  const auto rhs_sums_handle =
+      allocator->Reserve<std::int32_t>(split_count * cols);
+  allocator->Commit();
+  std::int32_t* accum = allocator->GetPointer<std::int32_t>(accum_handle);
+  std::int32_t* lhs_sums = allocator->GetPointer<std::int32_t>(lhs_sums_handle);
+  std::int32_t* rhs_sums = allocator->GetPointer<std::int32_t>(rhs_sums_handle);
+
+  typedef SplitDepthGemmTask<KernelFormat, InputScalar, LhsOrder, RhsOrder>
+      TaskType;
+  std::vector<TaskType> tasks;
+  tasks.reserve(split_count);
+  int next_start_depth = 0;
+  for (int n = 0; n < split_count; n++) {
+    const int start_depth = next_start_depth;
+    next_start_depth = std::min(
+        depth, RoundUp<kRegisterSize>(depth * (n + 1) / split_count));
+    const int range_depth = next_start_depth - start_depth;
+    tasks.emplace_back(kernel, lhs.block(0, start_depth, rows, range_depth),
+                       rhs.block(start_depth, 0, range_depth, cols),
+                       accum + n * rows * cols, lhs_sums + n * rows,
+                       rhs_sums + n * cols, *context);
+  }
+  context->workers_pool()->Execute(split_count, tasks.data());
+
+  // The accumulators of a cancelled Gemm may be incomplete.
+  if (context->cancelled()) {
+    allocator->Decommit();
+    return;
+  }
+
+  for (int n = 1; n < split_count; n++) {
+    for (int i = 0; i < rows * cols; i++) {
+      accum[i] += accum[n * rows * cols + i];
+    }
+    for (int i = 0; i < rows; i++) {
+      lhs_sums[i] += lhs_sums[n * rows + i];
+    }
+    for (int i = 0; i < cols; i++) {
+      rhs_sums[i] += rhs_sums[n * cols + i];
+    }
+  }
+
+  const ResultAccumulators accumulators(
+      MatrixMap<const std::int32_t, MapOrder::ColMajor>(accum, rows, cols));
+  UnpackResult<KernelFormat>(result, MatrixBlockBounds(0, 0, rows, cols),
+                             accumulators, depth, lhs_sums, rhs_sums,
+                             lhs_offset.block(0, rows),
+                             rhs_offset.block(0, cols), output_pipeline);
+
+  allocator->Decommit();
+}
+
 // The main multi-threaded Gemm function.
 // To understand it, first read the code of SingleThreadGemm().
-// The parallelization scheme used here is to have this master function
-// pack a block of RHS and then start worker threads to pack a block of LHS
-// each, and accumulate the corresponding products.
+// The parallelization scheme used here is, for each L2 block of columns of
+// the RHS, to first have all threads pack disjoint ranges of its columns,
+// and then have tasks computing 2D tiles of the result within that block,
+// each packing the blocks of its rows of the LHS only once. There are more
+// tasks than threads; they are balanced across threads by work stealing.
+// See MultiThreadGemmByRhsBlocks. Alternatively, packing of the RHS may be
+// pipelined with compute, see MultiThreadGemmPipelined.
 template <typename KernelFormat, typename InputScalar, typename OutputScalar,
           typename BitDepthParams, MapOrder LhsOrder, MapOrder RhsOrder,
           MapOrder ResultOrder, typename LhsOffset, typename RhsOffset,
@@ -655,8 +2682,19 @@ void MultiThreadGemm(GemmContextType* context, const KernelBase& kernel,
   // The case of rows<cols should have been caught earlier and transposed.
   assert(rows >= cols);
 
-  const int thread_count = HowManyThreads<KernelFormat::kRows>(
-      context->max_num_threads(), rows, cols, depth);
+  const int thread_count =
+      HowManyThreads<KernelFormat::kRows, KernelFormat::kCols>(
+          context->max_num_threads(), context->gemm_cost_model(), rows, cols,
+          depth);
+  const int split_count = HowManyDepthSplits(
+      context->max_num_threads(), context->gemm_cost_model(), rows, cols,
+      depth);
+  if (split_count > thread_count) {
+    return MultiThreadGemmSplitDepth<KernelFormat, InputScalar, OutputScalar,
+                                     BitDepthParams>(
+        context, kernel, split_count, lhs, rhs, result, lhs_offset, rhs_offset,
+        output_pipeline);
+  }
   if (thread_count == 1) {
     return SingleThreadGemm<KernelFormat, InputScalar, OutputScalar,
                             BitDepthParams>(context, kernel, lhs, rhs, result,
@@ -665,52 +2703,111 @@ void MultiThreadGemm(GemmContextType* context, const KernelBase& kernel,
   }
   assert(thread_count > 1);
 
-  // Simple 1:1 mapping of tasks to physical cores, which is very important
-  // to getting good multithreaded performance, specially for not-very-large
-  // GEMMs, and especially on Android.
-  const int task_count = thread_count;
-
   Allocator* allocator = context->allocator();
   auto* workers_pool = context->workers_pool();
 
   BlockParams block_params;
   block_params.Init<KernelFormat>(
-      rows, cols, depth, task_count, context->l1_bytes_to_use(),
+      rows, cols, depth, thread_count, context->l1_bytes_to_use(),
       context->l2_bytes_to_use(), context->l2_rhs_factor());
 
-  PackedSideBlock<typename KernelFormat::Rhs> packed_rhs(Side::Rhs, allocator,
-                                                         block_params);
-  allocator->Commit();
+  typedef PackedSideBlock<typename KernelFormat::Rhs> PackedRhs;
+  typedef GemmWithPackedRhsTask<KernelFormat, InputScalar, OutputScalar,
+                                BitDepthParams, LhsOrder, RhsOrder,
+                                ResultOrder, LhsOffset, RhsOffset,
+                                OutputPipelineType, GemmContextType>
+      TaskType;
+
+  const auto make_task = [&](const MatrixBlockBounds& tile,
+                             const PackedRhs& packed_rhs_block,
+                             int packed_rhs_start_col) {
+    return TaskType(context, kernel,
+                    lhs.block(tile.start_row, 0, tile.rows, depth),
+                    packed_rhs_block, packed_rhs_start_col, result, tile,
+                    lhs_offset, rhs_offset, block_params, output_pipeline);
+  };
+  if (context->pipeline_rhs_packing() && block_params.l2_cols < cols) {
+    MultiThreadGemmPipelined<KernelFormat, TaskType>(
+        context, workers_pool, allocator, thread_count, block_params, rows,
+        rhs, make_task);
+  } else {
+    MultiThreadGemmByRhsBlocks<KernelFormat, TaskType>(
+        context, workers_pool, allocator, thread_count, block_params, rows,
+        rhs, make_task);
+  }
 
-  // We loop over large blocks of the RHS.
-  for (int c = 0; c < cols; c += block_params.l2_cols) {
-    int cs = std::min(block_params.l2_cols, cols - c);
+  allocator->Decommit();
+}
 
-    // Pack a large block of the RHS.
-    PackRhs(&packed_rhs, rhs.block(0, c, depth, cs));
+// Variant of MultiThreadGemm where the LHS has already been packed ahead
+// of time into a PackedLhsMatrix. The parallelization scheme is the same:
+// all threads pack each block of the RHS, then tasks compute tiles of the
+// result within it, reading directly from the pre-packed LHS, so that no
+// LHS packing is repeated for each block of the RHS.
+template <typename KernelFormat, typename InputScalar, typename OutputScalar,
+          typename BitDepthParams, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType,
+          typename GemmContextType>
+void MultiThreadGemmWithPackedLhs(
+    GemmContextType* context, const KernelBase& kernel,
+    const PackedLhsMatrix<KernelFormat>& packed_lhs,
+    const MatrixMap<const InputScalar, RhsOrder>& rhs,
+    MatrixMap<OutputScalar, ResultOrder>* result, const LhsOffset& lhs_offset,
+    const RhsOffset& rhs_offset, const OutputPipelineType& output_pipeline) {
+  ScopedProfilingLabel label("gemmlowp::MultiThreadGemmWithPackedLhs");
+
+  assert(packed_lhs.depth() == rhs.rows());
 
-    // Give work to each worker.
-    std::vector<Task*> tasks;
-    int next_start_row = 0;
-    for (int n = 0; n < task_count; ++n) {
-      int start_row = next_start_row;
-      next_start_row = std::min(
-          rows, RoundUp<KernelFormat::kRows>(rows * (n + 1) / task_count));
-
-      int block_rows = next_start_row - start_row;
-      auto lhs_block = lhs.block(start_row, 0, block_rows, depth);
-      typedef GemmWithPackedRhsTask<KernelFormat, InputScalar, OutputScalar,
-                                    BitDepthParams, LhsOrder, RhsOrder,
-                                    ResultOrder, LhsOffset, RhsOffset,
-                                    OutputPipelineType, GemmContextType>
-          TaskType;
-      tasks.push_back(
-          new TaskType(context, kernel, lhs_block, packed_rhs, result,
-                       MatrixBlockBounds(start_row, c, block_rows, cs),
-                       lhs_offset, rhs_offset, block_params, output_pipeline));
-    }
-    // Execute the work on the workers (and partially on this thread).
-    workers_pool->Execute(tasks);
+  int rows = result->rows();
+  int cols = result->cols();
+  int depth = packed_lhs.depth();
+
+  assert(rows == packed_lhs.rows());
+  assert(rows > 0);
+  assert(cols > 0);
+  assert(depth > 0);
+
+  const int thread_count =
+      HowManyThreads<KernelFormat::kRows, KernelFormat::kCols>(
+          context->max_num_threads(), context->gemm_cost_model(), rows, cols,
+          depth);
+  if (thread_count == 1) {
+    return SingleThreadGemmWithPackedLhs<KernelFormat, InputScalar,
+                                         OutputScalar, BitDepthParams>(
+        context, kernel, packed_lhs, rhs, result, lhs_offset, rhs_offset,
+        output_pipeline);
+  }
+  assert(thread_count > 1);
+
+  Allocator* allocator = context->allocator();
+  auto* workers_pool = context->workers_pool();
+
+  BlockParams block_params;
+  block_params.Init<KernelFormat>(
+      rows, cols, depth, thread_count, packed_lhs.l1_bytes_to_use(),
+      context->l2_bytes_to_use(), context->l2_rhs_factor());
+  assert(block_params.l1_depth == packed_lhs.l1_depth());
+
+  typedef PackedSideBlock<typename KernelFormat::Rhs> PackedRhs;
+  typedef GemmWithPackedLhsAndRhsTask<KernelFormat, OutputScalar, ResultOrder,
+                                      LhsOffset, RhsOffset, OutputPipelineType>
+      TaskType;
+
+  const auto make_task = [&](const MatrixBlockBounds& tile,
+                             const PackedRhs& packed_rhs_block,
+                             int packed_rhs_start_col) {
+    return TaskType(context, kernel, packed_lhs, packed_rhs_block,
+                    packed_rhs_start_col, result, tile, lhs_offset, rhs_offset,
+                    block_params, output_pipeline);
+  };
+  if (context->pipeline_rhs_packing() && block_params.l2_cols < cols) {
+    MultiThreadGemmPipelined<KernelFormat, TaskType>(
+        context, workers_pool, allocator, thread_count, block_params, rows,
+        rhs, make_task);
+  } else {
+    MultiThreadGemmByRhsBlocks<KernelFormat, TaskType>(
+        context, workers_pool, allocator, thread_count, block_params, rows,
+        rhs, make_task);
   }
 
   allocator->Decommit();
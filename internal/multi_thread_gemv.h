@@ -0,0 +1,280 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// multi_thread_gemv.h: Multi-threaded GEMV entry point.
+// Readers note: To understand this file, it is useful to first
+// read and understand single_thread_gemv.h.
+//
+// Unlike GEMM, GEMV is memory-bound: it performs only 2 ops per byte of
+// LHS, so that it saturates memory bandwidth with only a few cores, and
+// adding threads past that point only adds dispatch overhead. So instead
+// of reasoning in terms of rows per thread as HowManyThreads does, we cap
+// the thread count at a measured memory bandwidth ceiling.
+
+#ifndef GEMMLOWP_INTERNAL_MULTI_THREAD_GEMV_H_
+#define GEMMLOWP_INTERNAL_MULTI_THREAD_GEMV_H_
+
+#include <vector>
+
+#include "multi_thread_gemm.h"
+#include "single_thread_gemv.h"
+
+namespace gemmlowp {
+
+// Row ranges given to different threads start at multiples of this many rows,
+// so that with 8-bit LHS and result entries, threads never share a cache line
+// of a LHS column (in the column-major case) or of the result vector.
+const int kGemvRowsAlignment = kDefaultCacheLineSize;
+
+// Empirically determined value: the amount of LHS data below which the
+// cost of waking up a worker thread outweighs streaming that data.
+const std::uint64_t kGemvMinLhsBytesPerThread = 64 * 1024;
+
+// Size of the buffer streamed through by MeasureGemvBandwidthThreads. It has
+// to be much larger than last-level caches to measure memory bandwidth.
+const int kGemvBandwidthProbeBytes = 32 * 1024 * 1024;
+
+// Thread counts are only increased while they improve the measured
+// bandwidth by at least this ratio.
+const float kGemvBandwidthMinGain = 1.1f;
+
+// The ceiling on the number of threads of single-column GEMVs, unless it
+// has been set or calibrated, see CalibrateGemvThreads. A few cores
+// saturate memory bandwidth on most hosts, and threads past that point
+// only add dispatch overhead.
+const int kDefaultMaxGemvThreads = 4;
+
+// The task streaming through a range of the probe buffer, the way a GEMV
+// task would stream through its rows of the LHS.
+struct GemvBandwidthProbeTask : Task {
+  GemvBandwidthProbeTask() : data(nullptr), size(0), sum(0) {}
+
+  void Run() override {
+    ScopedProfilingLabel label("GemvBandwidthProbeTask");
+    std::uint64_t s = 0;
+    for (std::size_t i = 0; i < size; i++) {
+      s += data[i];
+    }
+    sum = s;
+  }
+
+  const std::uint64_t* data;
+  std::size_t size;
+  std::uint64_t sum;
+};
+
+// Measures how many threads it takes to saturate memory bandwidth, trying
+// thread counts up to max_count in powers of two. This streams through a
+// buffer of kGemvBandwidthProbeBytes a few times per thread count, which
+// takes some tens of milliseconds; see CalibrateGemvThreads.
+template <typename WorkersPoolType>
+int MeasureGemvBandwidthThreads(WorkersPoolType* workers_pool, int max_count) {
+  ScopedProfilingLabel label("MeasureGemvBandwidthThreads");
+  const std::size_t words = kGemvBandwidthProbeBytes / sizeof(std::uint64_t);
+  std::vector<std::uint64_t> buffer(words, 1);
+  std::vector<GemvBandwidthProbeTask> tasks(max_count);
+
+  int best_thread_count = 1;
+  double best_bandwidth = 0;
+  for (int thread_count = 1; thread_count <= max_count; thread_count *= 2) {
+    for (int n = 0; n < thread_count; n++) {
+      const std::size_t start = words * n / thread_count;
+      const std::size_t end = words * (n + 1) / thread_count;
+      tasks[n].data = buffer.data() + start;
+      tasks[n].size = end - start;
+    }
+    // Take the best of a few runs, the first of which also serves to
+    // start the worker threads.
+    double best_time = 0;
+    for (int run = 0; run < 3; run++) {
+      const double start_time = real_time_in_seconds();
+      workers_pool->Execute(thread_count, tasks.data());
+      const double time = real_time_in_seconds() - start_time;
+      if (run == 0 || time < best_time) {
+        best_time = time;
+      }
+    }
+    const double bandwidth = kGemvBandwidthProbeBytes / best_time;
+    if (bandwidth < best_bandwidth * kGemvBandwidthMinGain) {
+      break;
+    }
+    best_bandwidth = bandwidth;
+    best_thread_count = thread_count;
+  }
+  return best_thread_count;
+}
+
+// Calibrates the GEMV thread ceiling of the given context, see
+// MultiThreadGemmContextBase::max_num_gemv_threads(), by measuring it with
+// the threads of its WorkersPool. As this takes some tens of milliseconds,
+// it is up to the application to do it when that doesn't delay any Gemm,
+// e.g. at startup, like CalibrateGemmCostModel. It has to be done again
+// after changing the maximum number of threads of the context.
+template <typename GemmContextType>
+void CalibrateGemvThreads(GemmContextType* context) {
+  context->set_measured_gemv_threads(MeasureGemvBandwidthThreads(
+      context->workers_pool(),
+      GetHardwareConcurrency(context->max_num_threads())));
+}
+
+// Determines how many threads should be used for a given GEMV operation.
+template <typename GemmContextType>
+int HowManyGemvThreads(GemmContextType* context, int rows, int depth,
+                       int cols) {
+  // Early-exit in the default case where multi-threading is disabled.
+  if (context->max_num_threads() == 1) {
+    return 1;
+  }
+
+  // Determine the maximum number of threads.
+  const int max_count = GetHardwareConcurrency(context->max_num_threads());
+
+  int thread_count =
+      std::min(max_count, CeilQuotient(rows, kGemvRowsAlignment));
+
+  // Check that there is enough work to keep workers busy. Each LHS byte
+  // is used once per RHS column.
+  if (thread_count > 1) {
+    const std::uint64_t work =
+        std::uint64_t(rows) * std::uint64_t(depth) * std::uint64_t(cols);
+    thread_count = static_cast<int>(std::min<std::uint64_t>(
+        thread_count, work / kGemvMinLhsBytesPerThread));
+  }
+
+  // Do not use more threads than it takes to saturate memory bandwidth.
+  // With several RHS columns, each thread spends proportionally more time
+  // computing per byte of LHS, so proportionally more threads are needed to
+  // saturate it.
+  if (thread_count > 1) {
+    const int max_gemv_threads = context->max_num_gemv_threads()
+                                     ? context->max_num_gemv_threads()
+                                     : kDefaultMaxGemvThreads;
+    thread_count = std::min(thread_count, max_gemv_threads * cols);
+  }
+
+  return std::max(thread_count, 1);
+}
+
+// The task we use to implement a multi-threaded GEMV: each worker computes
+// a range of rows of the result.
+template <typename InputScalar, typename OutputScalar, MapOrder LhsOrder,
+          MapOrder ResultOrder, typename LhsOffset,
+          typename OutputPipelineType>
+struct GemvTask : Task {
+  GemvTask(const MatrixMap<const InputScalar, LhsOrder>& _lhs,
+           const std::int16_t* _rhs, int _rhs_stride,
+           const std::int32_t* _rhs_sums,
+           MatrixMap<OutputScalar, ResultOrder>* _result, int _start_row,
+           int _rows, const LhsOffset& _lhs_offset,
+           const OutputPipelineType& _output_pipeline)
+      : lhs(_lhs),
+        rhs(_rhs),
+        rhs_stride(_rhs_stride),
+        rhs_sums(_rhs_sums),
+        result(*_result),
+        start_row(_start_row),
+        rows(_rows),
+        lhs_offset(_lhs_offset),
+        output_pipeline(_output_pipeline) {}
+
+  void Run() override {
+    ScopedProfilingLabel label("GemvTask");
+
+    const int cols = result.cols();
+    const auto accum_handle =
+        local_allocator->Reserve<std::int32_t>(rows * cols);
+    local_allocator->Commit();
+    std::int32_t* accum =
+        local_allocator->GetPointer<std::int32_t>(accum_handle);
+
+    RunGemvKernel(lhs, rhs, rhs_stride, cols, start_row, rows, accum, rows);
+    UnpackGemvResult(&result, start_row, rows, accum, rhs_sums, lhs_offset,
+                     output_pipeline);
+
+    local_allocator->Decommit();
+  }
+
+  const MatrixMap<const InputScalar, LhsOrder> lhs;
+  const std::int16_t* rhs;
+  const int rhs_stride;
+  const std::int32_t* rhs_sums;
+  MatrixMap<OutputScalar, ResultOrder> result;
+  const int start_row;
+  const int rows;
+  const LhsOffset& lhs_offset;
+  const OutputPipelineType& output_pipeline;
+};
+
+// The main multi-threaded GEMV function. The master thread prepares the
+// offset RHS, then the rows are split across threads.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType,
+          typename GemmContextType>
+void MultiThreadGemv(GemmContextType* context,
+                     const MatrixMap<const InputScalar, LhsOrder>& lhs,
+                     const MatrixMap<const InputScalar, RhsOrder>& rhs,
+                     MatrixMap<OutputScalar, ResultOrder>* result,
+                     const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
+                     const OutputPipelineType& output_pipeline) {
+  ScopedProfilingLabel label("gemmlowp::MultiThreadGemv");
+
+  assert(lhs.cols() == rhs.rows());
+  assert(rhs.cols() == result->cols());
+  assert(result->cols() >= 1 && result->cols() <= kMaxGemvCols);
+
+  const int rows = result->rows();
+  const int cols = result->cols();
+  const int depth = lhs.cols();
+
+  const int thread_count = HowManyGemvThreads(context, rows, depth, cols);
+  if (thread_count == 1) {
+    return SingleThreadGemv<InputScalar, OutputScalar, BitDepthParams>(
+        context, lhs, rhs, result, lhs_offset, rhs_offset, output_pipeline);
+  }
+  assert(thread_count > 1);
+
+  Allocator* allocator = context->allocator();
+  auto* workers_pool = context->workers_pool();
+
+  const int rhs_stride = GemvRhsStride(depth);
+  const auto rhs_handle = allocator->Reserve<std::int16_t>(cols * rhs_stride);
+  const auto rhs_sums_handle = allocator->Reserve<std::int32_t>(cols);
+  allocator->Commit();
+  std::int16_t* rhs_buf = allocator->GetPointer<std::int16_t>(rhs_handle);
+  std::int32_t* rhs_sums = allocator->GetPointer<std::int32_t>(rhs_sums_handle);
+  PrepareGemvRhs(rhs, rhs_offset, rhs_buf, rhs_sums);
+
+  typedef GemvTask<InputScalar, OutputScalar, LhsOrder, ResultOrder,
+                   LhsOffset, OutputPipelineType>
+      TaskType;
+  std::vector<TaskType> tasks;
+  tasks.reserve(thread_count);
+  int next_start_row = 0;
+  for (int n = 0; n < thread_count; ++n) {
+    const int start_row = next_start_row;
+    next_start_row = std::min(
+        rows, RoundUp<kGemvRowsAlignment>(rows * (n + 1) / thread_count));
+    tasks.emplace_back(lhs, rhs_buf, rhs_stride, rhs_sums, result, start_row,
+                       next_start_row - start_row, lhs_offset,
+                       output_pipeline);
+  }
+  workers_pool->Execute(thread_count, tasks.data());
+
+  allocator->Decommit();
+}
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_MULTI_THREAD_GEMV_H_
@@ -20,6 +20,7 @@
 #define GEMMLOWP_INTERNAL_OUTPUT_H_
 
 #include <cmath>
+#include <cstring>
 #include <tuple>
 #include <type_traits>
 #include <typeinfo>
@@ -191,29 +192,53 @@ struct OutputStageEvalImpl<
 
   OutputStageEvalImpl(const OutputStage& s) : output_stage(s) {}
 
+  // The exponent varies from one row or column to the next, while the SIMD
+  // wrappers only shift all the lanes of a register by the same amount.
+  // So when all the lanes of each register are in the same row or column,
+  // which is the case of scalar registers, and of SIMD registers within a
+  // column of a column-major block, each register is scaled by the
+  // parameters of its row or column, broadcast with Dup. Otherwise, e.g.
+  // per-row parameters on SIMD registers, each scalar is scaled separately.
+  static constexpr bool kRegistersWithinLine =
+      InputType::kRegisterLanes == 1 ||
+      (Shape == VectorShape::Row && Rows % InputType::kRegisterLanes == 0);
+
   OutputType Eval(InputType input, int row, int col) const {
     OutputType output;
-    const int pos = Shape == VectorShape::Row ? col : row;
     using RegisterType = typename InputType::RegisterType;
-    const RegisterType result_offset_after_shift =
-        Dup<RegisterType>(output_stage.result_offset_after_shift);
-    auto left_shift =
-        LoadForBroadcasting<InputType>(output_stage.result_exponent, pos);
-    auto right_shift =
-        LoadForBroadcasting<InputType>(output_stage.result_exponent, pos);
-    const auto result_fixedpoint_multiplier = LoadForBroadcasting<InputType>(
-        output_stage.result_fixedpoint_multiplier, pos);
-    for (int i = 0; i < decltype(left_shift)::kRegisterCount; i++) {
-      left_shift.buf.reg[i] = Max(left_shift.buf.reg[i], 0);
-      right_shift.buf.reg[i] = Max(-right_shift.buf.reg[i], 0);
+    if (kRegistersWithinLine) {
+      const RegisterType result_offset_after_shift =
+          Dup<RegisterType>(output_stage.result_offset_after_shift);
+      for (int i = 0; i < InputType::kRegisterCount; i++) {
+        const int scalar_index = i * InputType::kRegisterLanes;
+        const int pos = Shape == VectorShape::Row ? col + scalar_index / Rows
+                                                  : row + scalar_index % Rows;
+        const std::int32_t exponent = output_stage.result_exponent(pos);
+        const RegisterType mulhigh_val = SaturatingRoundingDoublingHighMul(
+            ShiftLeft(input.buf.reg[i], std::max(0, exponent)),
+            Dup<RegisterType>(output_stage.result_fixedpoint_multiplier(pos)));
+        output.buf.reg[i] =
+            Add(RoundingDivideByPOT(mulhigh_val, std::max(0, -exponent)),
+                result_offset_after_shift);
+      }
+      return output;
     }
-    const auto mulhigh_val = BroadcastSaturatingRoundingDoublingHighMul(
-        BroadcastShiftLeft(input, left_shift), result_fixedpoint_multiplier);
-    const auto rdpot_val =
-        BroadcastRoundingDivideByPOT(mulhigh_val, right_shift);
-    for (int i = 0; i < InputType::kRegisterCount; i++) {
-      output.buf.reg[i] = Add(rdpot_val.buf.reg[i], result_offset_after_shift);
+    std::int32_t data[InputType::kScalarCount];
+    static_assert(sizeof(data) == sizeof(input.buf.reg), "");
+    std::memcpy(data, input.buf.reg, sizeof(data));
+    for (int c = 0; c < Cols; c++) {
+      for (int r = 0; r < Rows; r++) {
+        const int pos = Shape == VectorShape::Row ? col + c : row + r;
+        const std::int32_t exponent = output_stage.result_exponent(pos);
+        std::int32_t& x = data[r + c * Rows];
+        x = SaturatingRoundingDoublingHighMul(
+            ShiftLeft(x, std::max(0, exponent)),
+            output_stage.result_fixedpoint_multiplier(pos));
+        x = RoundingDivideByPOT(x, std::max(0, -exponent)) +
+            output_stage.result_offset_after_shift;
+      }
     }
+    std::memcpy(output.buf.reg, data, sizeof(data));
     return output;
   }
 
@@ -50,20 +50,40 @@ class PackedSideBlock {
 
   PackedSideBlock(Side side, Allocator* allocator,
                   const BlockParams& block_params)
-      : allocator_(allocator), pos_(0) {
+      : allocator_(allocator), start_width_(0), pos_(0) {
     GetSideBlockParams(side, &params_, block_params);
+    width_ = params_.l2_width;
     data_handle_ =
         allocator_->Reserve<std::uint8_t>(params_.l2_width * params_.l2_depth);
     sums_of_each_slice_handle_ =
         allocator_->Reserve<std::int32_t>(params_.l2_width);
   }
 
+  // Constructs a view on the range [start_width, start_width + width) of the
+  // width of another PackedSideBlock, sharing its buffers. Positions and
+  // sums of slices are relative to the start of the range, so that the view
+  // may be packed into or handed to Compute() as a block of its own.
+  // The view has its own current position: that way, multiple threads may
+  // work on different ranges of the same PackedSideBlock concurrently.
+  PackedSideBlock(const PackedSideBlock& block, int start_width, int width)
+      : params_(block.params_),
+        allocator_(block.allocator_),
+        data_handle_(block.data_handle_),
+        sums_of_each_slice_handle_(block.sums_of_each_slice_handle_),
+        start_width_(block.start_width_ + start_width),
+        width_(width),
+        pos_(0) {
+    assert(start_width % KernelSideFormat::kWidth == 0);
+    assert(start_width >= 0 && start_width + width <= block.width_);
+  }
+
   ~PackedSideBlock() {}
 
   void seek_run(int start_width, int start_depth) const {
     int kernel_run_depth =
         std::min<int>(params_.l1_depth, params_.l2_depth - start_depth);
-    pos_ = params_.l2_width * start_depth + start_width * kernel_run_depth;
+    pos_ = params_.l2_width * start_depth +
+           (start_width_ + start_width) * kernel_run_depth;
   }
 
   void seek_next_cell() const { pos_ += KernelSideFormat::Cell::kSize; }
@@ -85,16 +105,22 @@ class PackedSideBlock {
   }
 
   std::int32_t* sums_of_each_slice() {
-    return allocator_->GetPointer<std::int32_t>(sums_of_each_slice_handle_);
+    return allocator_->GetPointer<std::int32_t>(sums_of_each_slice_handle_) +
+           start_width_;
   }
 
   const std::int32_t* sums_of_each_slice() const {
     return allocator_->GetPointer<const std::int32_t>(
-        sums_of_each_slice_handle_);
+               sums_of_each_slice_handle_) +
+           start_width_;
   }
 
   const SideBlockParams& params() const { return params_; }
 
+  // The width of this block, which is params().l2_width unless this is
+  // a view on a range of another block.
+  int width() const { return width_; }
+
  private:
   // The block size parameters that this PackedSizeBlock follows.
   // The L2 parameters determine its overall size, while the L1 parameters,
@@ -113,6 +139,10 @@ class PackedSideBlock {
   // associated with this block. Owned.
   Allocator::Handle sums_of_each_slice_handle_;
 
+  // The range of the width of the underlying buffers that this block covers.
+  int start_width_;
+  int width_;
+
   // pos_ is the current position in the buffer, which we access
   // sequentially, like a file.
   // The idea is that we pack data in the same order as it is
@@ -321,7 +351,7 @@ class PackSideBlockImpl {
   // The public entry point to pack a block.
   void PackL2() {
     memset(packed_side_block_->sums_of_each_slice(), 0,
-           sizeof(std::int32_t) * packed_side_block_->params().l2_width);
+           sizeof(std::int32_t) * packed_side_block_->width());
     for (int d = 0; d < src_map_.depth();
          d += packed_side_block_->params().l1_depth) {
       int ds = std::min<int>(packed_side_block_->params().l1_depth,
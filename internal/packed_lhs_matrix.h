@@ -0,0 +1,115 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// packed_lhs_matrix.h: a whole LHS matrix packed once ahead of time,
+// so that it can be reused across many Gemm calls.
+//
+// This is intended for the common inference use case where the LHS is a
+// constant weights matrix: packing it (and computing its sums of slices)
+// on every Gemm call is wasted work. A PackedLhsMatrix pays that cost once.
+
+#ifndef GEMMLOWP_INTERNAL_PACKED_LHS_MATRIX_H_
+#define GEMMLOWP_INTERNAL_PACKED_LHS_MATRIX_H_
+
+#include "../public/map.h"
+#include "allocator.h"
+#include "block_params.h"
+#include "pack.h"
+
+namespace gemmlowp {
+
+// A PackedLhsMatrix owns the packed form of an entire LHS matrix, for
+// the given kernel format. It is laid out as a single PackedSideBlock
+// whose width is the whole (rounded-up) number of rows and whose depth is
+// the whole depth, so that any row range of it can be handed to Compute()
+// through a view on that range, see block().
+//
+// The only block parameter that influences the packed layout besides the
+// overall size is l1_depth, which is itself only a function of the depth,
+// of the kernel format and of the L1 cache size. We record the L1 cache size
+// that was used here, so that Gemm calls consuming this matrix can use the
+// same, see l1_bytes_to_use().
+template <typename tKernelFormat>
+class PackedLhsMatrix {
+ public:
+  typedef tKernelFormat KernelFormat;
+  typedef PackedSideBlock<typename KernelFormat::Lhs> PackedLhsBlock;
+
+  template <typename InputScalar, MapOrder LhsOrder>
+  explicit PackedLhsMatrix(const MatrixMap<const InputScalar, LhsOrder>& lhs,
+                           int l1_bytes_to_use = kDefaultL1CacheSize)
+      : rows_(lhs.rows()),
+        depth_(lhs.cols()),
+        l1_bytes_to_use_(l1_bytes_to_use),
+        block_params_(MakeBlockParams(rows_, depth_, l1_bytes_to_use)),
+        packed_block_(Side::Lhs, &allocator_, block_params_) {
+    ScopedProfilingLabel label("PackedLhsMatrix");
+    assert(rows_ > 0);
+    assert(depth_ > 0);
+    allocator_.Commit();
+    PackLhs(&packed_block_, lhs);
+  }
+
+  ~PackedLhsMatrix() { allocator_.Decommit(); }
+
+  int rows() const { return rows_; }
+  int depth() const { return depth_; }
+  int l1_bytes_to_use() const { return l1_bytes_to_use_; }
+  int l1_depth() const { return block_params_.l1_depth; }
+
+  const PackedLhsBlock& packed_block() const { return packed_block_; }
+
+  // Returns a view on the rows [start_row, start_row + rows) of the packed
+  // LHS, rounded up to the kernel width, to be handed to Compute() and
+  // UnpackResult() as a block of its own. Each view has its own current
+  // position: that way, multiple threads may work on different blocks of
+  // the same PackedLhsMatrix concurrently.
+  PackedLhsBlock block(int start_row, int rows) const {
+    return PackedLhsBlock(packed_block_, start_row,
+                          RoundUp<KernelFormat::kRows>(rows));
+  }
+
+ private:
+  static BlockParams MakeBlockParams(int rows, int depth, int l1_bytes_to_use) {
+    BlockParams block_params;
+    block_params.l2_rows = RoundUp<KernelFormat::kRows>(rows);
+    block_params.l2_cols = KernelFormat::kCols;
+    block_params.l2_depth = RoundUp<kRegisterSize>(depth);
+    BlockParams::FindL1BlockSizes<KernelFormat>(
+        block_params.l2_rows, block_params.l2_cols, block_params.l2_depth,
+        l1_bytes_to_use, &block_params.l1_rows, &block_params.l1_cols,
+        &block_params.l1_depth);
+    return block_params;
+  }
+
+  // copy construction disallowed
+  PackedLhsMatrix(const PackedLhsMatrix&) = delete;
+  PackedLhsMatrix& operator=(const PackedLhsMatrix&) = delete;
+
+  const int rows_;
+  const int depth_;
+  const int l1_bytes_to_use_;
+  const BlockParams block_params_;
+
+  // The allocator backing packed_block_. Unlike the allocators found in
+  // GemmContexts, it stays committed for the whole lifetime of this object.
+  // It must be declared before packed_block_, which refers to it.
+  Allocator allocator_;
+
+  PackedLhsBlock packed_block_;
+};
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_PACKED_LHS_MATRIX_H_
@@ -30,6 +30,12 @@
 #include <sys/time.h>
 #endif
 
+#ifdef __linux__
+#include <cstdio>
+#include <cstring>
+#include <string>
+#endif
+
 #if defined ANDROID || defined __ANDROID__
 #include <malloc.h>
 #include <android/api-level.h>
@@ -46,6 +52,16 @@
 #endif
 #endif
 
+// On Linux, including Android, threads can wait for changes of a memory
+// location with futexes, without taking any lock.
+#if defined(__linux__) && !defined(GEMMLOWP_NO_FUTEX)
+#define GEMMLOWP_USE_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <climits>
+#include <cstdint>
+#endif
+
 // Needed by chrome native builds
 #ifndef _SC_NPROCESSORS_CONF
 #define _SC_NPROCESSORS_CONF _SC_NPROCESSORS_ONLN
@@ -60,13 +76,10 @@ inline void *aligned_alloc(size_t alignment, size_t size) {
 
 inline void aligned_free(void *memptr) { _aligned_free(memptr); }
 
-inline int GetHardwareConcurrency(int max_threads) {
-  if (max_threads == 0) {
-    SYSTEM_INFO sysinfo;
-    GetSystemInfo(&sysinfo);
-    return sysinfo.dwNumberOfProcessors;
-  }
-  return max_threads;
+inline int GetSystemCpuCount() {
+  SYSTEM_INFO sysinfo;
+  GetSystemInfo(&sysinfo);
+  return sysinfo.dwNumberOfProcessors;
 }
 
 inline double real_time_in_seconds() {
@@ -89,17 +102,142 @@ inline void *aligned_alloc(size_t alignment, size_t size) {
 #endif
 }
 
-inline int GetHardwareConcurrency(int max_threads) {
-  if (max_threads == 0) {
-    static const int hardware_threads_count =
-        static_cast<int>(sysconf(_SC_NPROCESSORS_CONF));
-    return hardware_threads_count;
+#ifdef __linux__
+
+// Parses the contents of a cgroup v2 cpu.max file, "$QUOTA $PERIOD" or
+// "max $PERIOD", into a quota in CPUs, or 0 if there is none.
+inline double ParseCgroupV2CpuMax(const char *text) {
+  char quota[32];
+  long long period;
+  if (sscanf(text, "%31s %lld", quota, &period) != 2 || period <= 0 ||
+      !strcmp(quota, "max")) {
+    return 0;
+  }
+  const long long quota_us = atoll(quota);
+  return quota_us > 0 ? static_cast<double>(quota_us) / period : 0;
+}
+
+// Same for the cpu.cfs_quota_us and cpu.cfs_period_us files of cgroup v1,
+// where a quota of -1 means none.
+inline double ParseCgroupV1CpuQuota(const char *quota_text,
+                                    const char *period_text) {
+  long long quota_us;
+  long long period_us;
+  if (sscanf(quota_text, "%lld", &quota_us) != 1 ||
+      sscanf(period_text, "%lld", &period_us) != 1 || quota_us <= 0 ||
+      period_us <= 0) {
+    return 0;
+  }
+  return static_cast<double>(quota_us) / period_us;
+}
+
+// Reads the first line of a file, returning false on failure.
+inline bool ReadFirstLine(const std::string &path, char *line, int size) {
+  FILE *file = fopen(path.c_str(), "r");
+  if (!file) {
+    return false;
+  }
+  const bool success = fgets(line, size, file) != nullptr;
+  fclose(file);
+  return success;
+}
+
+// Returns the smaller of two quotas, where 0 means none.
+inline double MinCpuQuota(double a, double b) {
+  return a <= 0 ? b : b <= 0 ? a : a < b ? a : b;
+}
+
+// Returns the quota of a cgroup v2 cgroup, given its path in
+// /proc/self/cgroup. Parent cgroups also limit their children, so the
+// smallest quota from the cgroup up to the root applies. The cgroup v2
+// hierarchy is mounted at /sys/fs/cgroup, or at /sys/fs/cgroup/unified on
+// hosts that also mount cgroup v1 hierarchies.
+inline double ReadCgroupV2CpuQuota(const std::string &cgroup_path) {
+  double quota = 0;
+  for (const char *mount : {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"}) {
+    std::string path = cgroup_path;
+    while (true) {
+      char line[128];
+      if (ReadFirstLine(mount + path + "/cpu.max", line, sizeof(line))) {
+        quota = MinCpuQuota(quota, ParseCgroupV2CpuMax(line));
+      }
+      const std::size_t slash = path.find_last_of('/');
+      if (slash == std::string::npos || path.size() <= 1) {
+        break;
+      }
+      path.resize(slash == 0 ? 1 : slash);
+    }
+  }
+  return quota;
+}
+
+// Returns the quota of a cgroup v1 cgroup of the cpu controller. Inside a
+// container, /proc/self/cgroup may show the path on the host while only the
+// container's cgroup is mounted, so the root of the mount is tried too.
+inline double ReadCgroupV1CpuQuota(const std::string &cgroup_path) {
+  for (const char *mount :
+       {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"}) {
+    for (const std::string &dir :
+         {std::string(mount) + cgroup_path, std::string(mount)}) {
+      char quota[64];
+      char period[64];
+      if (ReadFirstLine(dir + "/cpu.cfs_quota_us", quota, sizeof(quota)) &&
+          ReadFirstLine(dir + "/cpu.cfs_period_us", period, sizeof(period))) {
+        return ParseCgroupV1CpuQuota(quota, period);
+      }
+    }
+  }
+  return 0;
+}
+
+// Returns the CPU quota of the cgroups of the current process, in CPUs, or
+// 0 if there is none or it can't be read.
+inline double ReadCgroupCpuQuota() {
+  FILE *file = fopen("/proc/self/cgroup", "r");
+  if (!file) {
+    return 0;
+  }
+  double quota = 0;
+  char line[1024];
+  while (fgets(line, sizeof(line), file)) {
+    // Lines are "hierarchy-ID:controller-list:cgroup-path", the controller
+    // list being empty for cgroup v2.
+    char *controllers = strchr(line, ':');
+    char *path = controllers ? strchr(controllers + 1, ':') : nullptr;
+    if (!path) {
+      continue;
+    }
+    *path++ = '\0';
+    controllers++;
+    path[strcspn(path, "\n")] = '\0';
+    if (!*controllers) {
+      quota = MinCpuQuota(quota, ReadCgroupV2CpuQuota(path));
+      continue;
+    }
+    // The controller list is comma-separated, e.g. "cpu,cpuacct".
+    for (char *controller = controllers; controller;) {
+      char *comma = strchr(controller, ',');
+      if (comma) {
+        *comma = '\0';
+      }
+      if (!strcmp(controller, "cpu")) {
+        quota = MinCpuQuota(quota, ReadCgroupV1CpuQuota(path));
+      }
+      controller = comma ? comma + 1 : nullptr;
+    }
   }
-  return max_threads;
+  fclose(file);
+  return quota;
 }
 
+#endif  // __linux__
+
 inline void aligned_free(void *memptr) { free(memptr); }
 
+inline int GetSystemCpuCount() {
+  return static_cast<int>(sysconf(_SC_NPROCESSORS_CONF));
+}
+
 inline double real_time_in_seconds() {
 #ifdef __APPLE__
   timeval t;
@@ -112,6 +250,21 @@ inline double real_time_in_seconds() {
 #endif
 }
 
+#endif
+
+#ifdef GEMMLOWP_USE_FUTEX
+// Blocks until woken by FutexWakeAll(addr), unless *addr != value on entry,
+// or until the given relative timeout, if any, has elapsed.
+// May also return spuriously.
+inline void FutexWait(const void *addr, std::int32_t value,
+                      const timespec *timeout = nullptr) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout, nullptr, 0);
+}
+
+// Wakes all threads blocked in FutexWait(addr, ...).
+inline void FutexWakeAll(const void *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
 #endif
 }  // namespace gemmlowp
 #endif  // GEMMLOWP_INTERNAL_PLATFORM_H_
@@ -19,13 +19,16 @@
 #ifndef GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMM_H_
 #define GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMM_H_
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
 
 #include "../public/map.h"
 #include "allocator.h"
 #include "compute.h"
 #include "kernel.h"
 #include "pack.h"
+#include "packed_lhs_matrix.h"
 #include "unpack.h"
 
 #ifdef GEMMLOWP_PROFILING_SIZES
@@ -38,6 +41,55 @@
 
 namespace gemmlowp {
 
+// A token through which Gemms can be abandoned while they run, either
+// explicitly by Cancel() or once a deadline has passed. Gemms check it
+// before each L2 block of the result they compute, so they return within
+// about the time it takes to compute one block on each thread. A cancelled
+// Gemm leaves the rest of its result unspecified: some blocks may have been
+// computed, others not.
+//
+// Cancel() and set_deadline() may be called from any thread, including
+// while Gemms are checking the token. Once cancelled, a token stays so until
+// Reset(), which must not be called while a Gemm is using it.
+class GemmCancellation {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  GemmCancellation() : cancelled_(false), deadline_(kNoDeadline) {}
+
+  void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+
+  void set_deadline(Clock::time_point deadline) {
+    deadline_.store(deadline.time_since_epoch().count(),
+                    std::memory_order_relaxed);
+  }
+
+  void Reset() {
+    cancelled_.store(false, std::memory_order_relaxed);
+    deadline_.store(kNoDeadline, std::memory_order_relaxed);
+  }
+
+  bool IsCancelled() const {
+    if (cancelled_.load(std::memory_order_relaxed)) {
+      return true;
+    }
+    const Clock::rep deadline = deadline_.load(std::memory_order_relaxed);
+    if (deadline != kNoDeadline &&
+        Clock::now().time_since_epoch().count() >= deadline) {
+      // Latch the cancellation so that later checks don't read the clock.
+      cancelled_.store(true, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  static constexpr Clock::rep kNoDeadline = -1;
+
+  mutable std::atomic<bool> cancelled_;
+  std::atomic<Clock::rep> deadline_;
+};
+
 class SingleThreadGemmContext {
  public:
   Allocator* allocator() { return &allocator_; }
@@ -50,6 +102,19 @@ class SingleThreadGemmContext {
   int l2_bytes_to_use() const { return l2_bytes_to_use_; }
   float l2_rhs_factor() const { return l2_rhs_factor_; }
 
+  // Lets Gemms run with this context be cancelled, see GemmCancellation.
+  // The token must outlive these Gemms. The default nullptr means that they
+  // can't be cancelled.
+  void set_cancellation(GemmCancellation* cancellation) {
+    cancellation_ = cancellation;
+  }
+
+  GemmCancellation* cancellation() const { return cancellation_; }
+
+  bool cancelled() const {
+    return cancellation_ && cancellation_->IsCancelled();
+  }
+
  protected:
   Allocator allocator_;
 
@@ -57,6 +122,9 @@ class SingleThreadGemmContext {
   int l1_bytes_to_use_ = kDefaultL1CacheSize;
   int l2_bytes_to_use_ = kDefaultL2CacheSize;
   float l2_rhs_factor_ = kDefaultL2RhsFactor;
+
+  // See set_cancellation().
+  GemmCancellation* cancellation_ = nullptr;
 };
 
 template <typename KernelFormat, typename InputScalar, typename OutputScalar,
@@ -127,7 +195,8 @@ void SingleThreadGemm(SingleThreadGemmContext* context,
     PackRhs(&packed_rhs, rhs);
   }
 
-  for (int r = 0; r < rows; r += block_params.l2_rows) {
+  for (int r = 0; r < rows && !context->cancelled();
+       r += block_params.l2_rows) {
     int rs = std::min(block_params.l2_rows, rows - r);
 
     PackLhs(&packed_lhs, lhs.block(r, 0, rs, depth));
@@ -135,6 +204,11 @@ void SingleThreadGemm(SingleThreadGemmContext* context,
     for (int c = 0; c < cols; c += block_params.l2_cols) {
       int cs = std::min(block_params.l2_cols, cols - c);
 
+      // Break rather than return, so as to still Decommit() below.
+      if (c > 0 && context->cancelled()) {
+        break;
+      }
+
       if (!pack_rhs_once) {
         PackRhs(&packed_rhs, rhs.block(0, c, depth, cs));
       }
@@ -152,6 +226,89 @@ void SingleThreadGemm(SingleThreadGemmContext* context,
   allocator->Decommit();
 }
 
+// Variant of SingleThreadGemm where the LHS has already been packed ahead
+// of time into a PackedLhsMatrix (see packed_lhs_matrix.h). Since the LHS
+// never needs to be packed here, the loop order is reversed compared to
+// SingleThreadGemm: we loop over large blocks of the RHS, packing each
+// of them exactly once, and then over the rows.
+//
+// Unlike SingleThreadGemm, this does not require rows >= cols, since a
+// pre-packed LHS can't be transposed into a RHS.
+template <typename KernelFormat, typename InputScalar, typename OutputScalar,
+          typename BitDepthParams, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType>
+void SingleThreadGemmWithPackedLhs(
+    SingleThreadGemmContext* context, const KernelBase& kernel,
+    const PackedLhsMatrix<KernelFormat>& packed_lhs,
+    const MatrixMap<const InputScalar, RhsOrder>& rhs,
+    MatrixMap<OutputScalar, ResultOrder>* result, const LhsOffset& lhs_offset,
+    const RhsOffset& rhs_offset, const OutputPipelineType& output_pipeline) {
+  ScopedProfilingLabel label("gemmlowp::SingleThreadGemmWithPackedLhs");
+
+  assert(packed_lhs.depth() == rhs.rows());
+
+  int rows = result->rows();
+  int cols = result->cols();
+  int depth = packed_lhs.depth();
+
+  assert(rows == packed_lhs.rows());
+  assert(rows > 0);
+  assert(cols > 0);
+  assert(depth > 0);
+
+  Allocator* allocator = context->allocator();
+
+  // Use the L1 cache size that the LHS was packed for, as it determines
+  // the packed LHS layout.
+  BlockParams block_params;
+  block_params.Init<KernelFormat>(
+      rows, cols, depth, 1, packed_lhs.l1_bytes_to_use(),
+      context->l2_bytes_to_use(), context->l2_rhs_factor());
+  assert(block_params.l1_depth == packed_lhs.l1_depth());
+
+  PackedSideBlock<typename KernelFormat::Rhs> packed_rhs(Side::Rhs, allocator,
+                                                         block_params);
+
+  PackedResult packed_result(allocator, block_params);
+
+  allocator->Commit();
+
+  for (int c = 0; c < cols && !context->cancelled();
+       c += block_params.l2_cols) {
+    int cs = std::min(block_params.l2_cols, cols - c);
+
+    PackRhs(&packed_rhs, rhs.block(0, c, depth, cs));
+
+    for (int r = 0; r < rows; r += block_params.l2_rows) {
+      int rs = std::min(block_params.l2_rows, rows - r);
+
+      if (r > 0 && context->cancelled()) {
+        break;
+      }
+
+      // The packed LHS ends at the last row rounded up to the kernel
+      // width, so the last block must not be computed past that.
+      BlockParams compute_block_params = block_params;
+      compute_block_params.l2_rows = RoundUp<KernelFormat::kRows>(rs);
+      compute_block_params.l1_rows =
+          std::min(block_params.l1_rows, compute_block_params.l2_rows);
+
+      const auto packed_lhs_block = packed_lhs.block(r, rs);
+
+      Compute(kernel, compute_block_params, &packed_result, packed_lhs_block,
+              packed_rhs, depth);
+
+      UnpackResult<KernelFormat>(
+          result, MatrixBlockBounds(r, c, rs, cs), packed_result, depth,
+          packed_lhs_block.sums_of_each_slice(),
+          packed_rhs.sums_of_each_slice(), lhs_offset.block(r, rs),
+          rhs_offset.block(c, cs), output_pipeline);
+    }
+  }
+
+  allocator->Decommit();
+}
+
 }  // namespace gemmlowp
 
 #endif  // GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMM_H_
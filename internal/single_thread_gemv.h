@@ -0,0 +1,262 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// single_thread_gemv.h: Single-threaded matrix*vector product (GEMV),
+// and its generalization to skinny GEMMs where the RHS has only a few
+// columns, as in micro-batched inference.
+//
+// GEMV is memory-bound and each LHS entry is used only once, so the packing
+// stage of GEMM only doubles the memory traffic (see todo/fast-gemv.txt).
+// This GEMV path reads the LHS in place, exactly once, with separate kernels
+// for row-major and column-major LHS, and applies offsets on the fly.
+// When the RHS has up to kMaxGemvCols columns, the kernels compute all of
+// them while reading the LHS once, so that throughput scales with the number
+// of columns instead of being bound by LHS memory traffic.
+//
+// The RHS offset is folded into a temporary int16 copy of the RHS,
+// rhs'(d, c) = rhs(d, c) + rhs_offset(c), so that the kernels only compute
+// plain dot products of LHS rows with it:
+//
+//   result(r, c)
+//     = sum_d (lhs(r, d) + lhs_offset(r)) * rhs'(d, c)
+//     = sum_d lhs(r, d) * rhs'(d, c) + lhs_offset(r) * sum_d rhs'(d, c)
+
+#ifndef GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMV_H_
+#define GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMV_H_
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+#include "../public/map.h"
+#include "allocator.h"
+#include "output.h"
+#include "single_thread_gemm.h"
+
+namespace gemmlowp {
+
+// The maximum number of RHS columns handled by the GEMV path. Past that,
+// the RHS is wide enough for packing to pay off.
+const int kMaxGemvCols = 8;
+
+// Each column of the RHS is padded with zeros up to a multiple of this size,
+// so that kernels may process it in full SIMD registers without tail
+// handling on the RHS side.
+const int kGemvRhsPadding = 32;
+
+// Returns whether the GEMV path can handle the given RHS offsets, i.e.
+// whether adding them to any 8-bit RHS value fits in an int16.
+template <typename RhsOffset>
+bool IsGemvRhsOffsetSupported(const RhsOffset& rhs_offset, int cols) {
+  for (int c = 0; c < cols; c++) {
+    const std::int32_t o = rhs_offset(c);
+    if (o < std::numeric_limits<std::int16_t>::min() -
+                std::numeric_limits<std::int8_t>::min() ||
+        o > std::numeric_limits<std::int16_t>::max() -
+                std::numeric_limits<std::uint8_t>::max()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Computes dst[c * dst_stride + i] =
+//     sum_d lhs(start_row + i, d) * rhs[c * rhs_stride + d]
+// for i in [0, rows) and c in [0, Cols).
+// This is the plain C++ reference implementation, which is also the fallback
+// for platforms that have no optimized GemvKernel specialization.
+template <typename InputScalar, MapOrder LhsOrder, int Cols>
+struct ReferenceGemvKernel {
+  static void Run(const MatrixMap<const InputScalar, LhsOrder>& lhs,
+                  const std::int16_t* rhs, int rhs_stride, int start_row,
+                  int rows, std::int32_t* dst, int dst_stride) {
+    const int depth = lhs.cols();
+    for (int c = 0; c < Cols; c++) {
+      for (int r = 0; r < rows; r++) {
+        std::int32_t accum = 0;
+        for (int d = 0; d < depth; d++) {
+          accum += static_cast<std::int32_t>(lhs(start_row + r, d)) *
+                   rhs[c * rhs_stride + d];
+        }
+        dst[c * dst_stride + r] = accum;
+      }
+    }
+  }
+};
+
+// The GEMV kernel actually used, with the same contract as
+// ReferenceGemvKernel. Platform-specific specializations are provided in
+// single_thread_gemv_*.h.
+template <typename InputScalar, MapOrder LhsOrder, int Cols>
+struct GemvKernel : ReferenceGemvKernel<InputScalar, LhsOrder, Cols> {};
+
+// Runs the GemvKernel for a number of columns only known at runtime.
+template <typename InputScalar, MapOrder LhsOrder>
+void RunGemvKernel(const MatrixMap<const InputScalar, LhsOrder>& lhs,
+                   const std::int16_t* rhs, int rhs_stride, int cols,
+                   int start_row, int rows, std::int32_t* dst,
+                   int dst_stride) {
+  static_assert(kMaxGemvCols == 8, "update the switch below");
+  switch (cols) {
+#define GEMMLOWP_GEMV_KERNEL_CASE(N)                                    \
+  case N:                                                               \
+    GemvKernel<InputScalar, LhsOrder, N>::Run(lhs, rhs, rhs_stride,     \
+                                              start_row, rows, dst,     \
+                                              dst_stride);              \
+    break;
+    GEMMLOWP_GEMV_KERNEL_CASE(1)
+    GEMMLOWP_GEMV_KERNEL_CASE(2)
+    GEMMLOWP_GEMV_KERNEL_CASE(3)
+    GEMMLOWP_GEMV_KERNEL_CASE(4)
+    GEMMLOWP_GEMV_KERNEL_CASE(5)
+    GEMMLOWP_GEMV_KERNEL_CASE(6)
+    GEMMLOWP_GEMV_KERNEL_CASE(7)
+    GEMMLOWP_GEMV_KERNEL_CASE(8)
+#undef GEMMLOWP_GEMV_KERNEL_CASE
+    default:
+      assert(false);
+  }
+}
+
+// Returns the stride between columns of the RHS as prepared by
+// PrepareGemvRhs.
+inline int GemvRhsStride(int depth) {
+  return RoundUp<kGemvRhsPadding>(depth);
+}
+
+// Copies the RHS into rhs_buf as column-major int16 values with the RHS
+// offset added, each column zero-padded to GemvRhsStride(depth) entries.
+// Stores the sum of the offset RHS values of each column into rhs_sums.
+template <typename InputScalar, MapOrder RhsOrder, typename RhsOffset>
+void PrepareGemvRhs(const MatrixMap<const InputScalar, RhsOrder>& rhs,
+                    const RhsOffset& rhs_offset, std::int16_t* rhs_buf,
+                    std::int32_t* rhs_sums) {
+  ScopedProfilingLabel label("prepare GEMV RHS");
+  const int depth = rhs.rows();
+  const int cols = rhs.cols();
+  const int rhs_stride = GemvRhsStride(depth);
+  assert(IsGemvRhsOffsetSupported(rhs_offset, cols));
+  for (int c = 0; c < cols; c++) {
+    std::int16_t* rhs_col = rhs_buf + c * rhs_stride;
+    const std::int32_t offset = rhs_offset(c);
+    std::int32_t sum = 0;
+    for (int d = 0; d < depth; d++) {
+      const std::int16_t val = static_cast<std::int32_t>(rhs(d, c)) + offset;
+      rhs_col[d] = val;
+      sum += val;
+    }
+    memset(rhs_col + depth, 0, (rhs_stride - depth) * sizeof(std::int16_t));
+    rhs_sums[c] = sum;
+  }
+}
+
+// Applies the LHS offset and the output pipeline to a range of rows of GEMV
+// accumulators, stored column-major with a stride of rows, and stores the
+// final values into the result.
+template <typename ResultBlockType, typename LhsOffset,
+          typename OutputPipelineType>
+void UnpackGemvResult(ResultBlockType* dst, int start_row, int rows,
+                      std::int32_t* accum, const std::int32_t* rhs_sums,
+                      const LhsOffset& lhs_offset,
+                      const OutputPipelineType& output_pipeline) {
+  ScopedProfilingLabel label("unpack GEMV result");
+  const int cols = dst->cols();
+  for (int c = 0; c < cols; c++) {
+    for (int r = 0; r < rows; r++) {
+      accum[c * rows + r] += lhs_offset(start_row + r) * rhs_sums[c];
+    }
+  }
+  const MatrixMap<const std::int32_t, MapOrder::ColMajor> src(accum, rows,
+                                                               cols);
+
+  using Int32x1x1 = RegisterBlock<std::int32_t, 1, 1>;
+  using Int32x4x1 = RegisterBlock<std::int32_t, 4, 1>;
+  using Int32x8x1 = RegisterBlock<std::int32_t, 8, 1>;
+  OutputPipelineExecutor<OutputPipelineType, Int32x1x1>
+      output_pipeline_executor_1x1(output_pipeline);
+  OutputPipelineExecutor<OutputPipelineType, Int32x4x1>
+      output_pipeline_executor_4x1(output_pipeline);
+  OutputPipelineExecutor<OutputPipelineType, Int32x8x1>
+      output_pipeline_executor_8x1(output_pipeline);
+
+  for (int c = 0; c < cols; c++) {
+    int r = 0;
+    for (; r <= rows - 8; r += 8) {
+      const int global_row = start_row + r;
+      output_pipeline_executor_8x1.Execute(Load<Int32x8x1>(src, r, c), dst,
+                                           global_row, c, global_row, c);
+    }
+    for (; r <= rows - 4; r += 4) {
+      const int global_row = start_row + r;
+      output_pipeline_executor_4x1.Execute(Load<Int32x4x1>(src, r, c), dst,
+                                           global_row, c, global_row, c);
+    }
+    for (; r < rows; r++) {
+      const int global_row = start_row + r;
+      output_pipeline_executor_1x1.Execute(Load<Int32x1x1>(src, r, c), dst,
+                                           global_row, c, global_row, c);
+    }
+  }
+}
+
+// Single-threaded GEMV: result = lhs * rhs where rhs and result have at most
+// kMaxGemvCols columns. The BitDepthParams are ignored: GEMV is memory-bound,
+// so it is always computed exactly in 8bit.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType>
+void SingleThreadGemv(SingleThreadGemmContext* context,
+                      const MatrixMap<const InputScalar, LhsOrder>& lhs,
+                      const MatrixMap<const InputScalar, RhsOrder>& rhs,
+                      MatrixMap<OutputScalar, ResultOrder>* result,
+                      const LhsOffset& lhs_offset, const RhsOffset& rhs_offset,
+                      const OutputPipelineType& output_pipeline) {
+  ScopedProfilingLabel label("gemmlowp::SingleThreadGemv");
+
+  assert(lhs.cols() == rhs.rows());
+  assert(rhs.cols() == result->cols());
+  assert(result->cols() >= 1 && result->cols() <= kMaxGemvCols);
+
+  const int rows = result->rows();
+  const int cols = result->cols();
+  const int depth = lhs.cols();
+  const int rhs_stride = GemvRhsStride(depth);
+
+  Allocator* allocator = context->allocator();
+  const auto rhs_handle = allocator->Reserve<std::int16_t>(cols * rhs_stride);
+  const auto rhs_sums_handle = allocator->Reserve<std::int32_t>(cols);
+  const auto accum_handle = allocator->Reserve<std::int32_t>(rows * cols);
+  allocator->Commit();
+
+  std::int16_t* rhs_buf = allocator->GetPointer<std::int16_t>(rhs_handle);
+  std::int32_t* rhs_sums = allocator->GetPointer<std::int32_t>(rhs_sums_handle);
+  std::int32_t* accum = allocator->GetPointer<std::int32_t>(accum_handle);
+
+  PrepareGemvRhs(rhs, rhs_offset, rhs_buf, rhs_sums);
+  RunGemvKernel(lhs, rhs_buf, rhs_stride, cols, 0, rows, accum, rows);
+  UnpackGemvResult(result, 0, rows, accum, rhs_sums, lhs_offset,
+                   output_pipeline);
+
+  allocator->Decommit();
+}
+
+}  // namespace gemmlowp
+
+#if defined(GEMMLOWP_SSE4)
+#include "single_thread_gemv_sse.h"
+#elif defined(GEMMLOWP_AVX2)
+#include "single_thread_gemv_avx.h"
+#endif
+
+#endif  // GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMV_H_
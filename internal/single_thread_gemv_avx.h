@@ -0,0 +1,211 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// single_thread_gemv_avx.h: optimized AVX2 specializations of the GEMV
+// kernels in single_thread_gemv.h.
+
+#ifndef GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMV_AVX_H_
+#define GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMV_AVX_H_
+
+#include <immintrin.h>
+#include "single_thread_gemv.h"
+
+namespace gemmlowp {
+
+// Widens 16 8-bit values to int16.
+template <typename InputScalar>
+struct GemvWidenAVX {};
+
+template <>
+struct GemvWidenAVX<std::uint8_t> {
+  static __m256i Run(__m128i x) { return _mm256_cvtepu8_epi16(x); }
+};
+
+template <>
+struct GemvWidenAVX<std::int8_t> {
+  static __m256i Run(__m128i x) { return _mm256_cvtepi8_epi16(x); }
+};
+
+// Row-major LHS: same strategy as the SSE4 kernel, on 32-entry chunks of
+// depth.
+template <typename InputScalar, int Cols>
+struct GemvKernel<InputScalar, MapOrder::RowMajor, Cols> {
+  typedef GemvWidenAVX<InputScalar> Widen;
+  static const int kRows = Cols >= 4 ? 1 : 4 / Cols;
+
+  static std::int32_t HorizontalSum(__m256i x) {
+    __m128i sum4 = _mm_add_epi32(_mm256_castsi256_si128(x),
+                                 _mm256_extracti128_si256(x, 1));
+    sum4 = _mm_hadd_epi32(sum4, sum4);
+    sum4 = _mm_hadd_epi32(sum4, sum4);
+    return _mm_cvtsi128_si32(sum4);
+  }
+
+  template <int Rows>
+  static void RunRows(
+      const MatrixMap<const InputScalar, MapOrder::RowMajor>& lhs,
+      const std::int16_t* rhs, int rhs_stride, int row, std::int32_t* dst,
+      int dst_stride) {
+    const int depth = lhs.cols();
+    const int stride = lhs.stride();
+    const int depth32 = depth & ~31;
+    const InputScalar* lhs_ptr = lhs.data(row, 0);
+    __m256i acc[Rows][Cols];
+    for (int i = 0; i < Rows; i++) {
+      for (int c = 0; c < Cols; c++) {
+        acc[i][c] = _mm256_setzero_si256();
+      }
+    }
+    for (int d = 0; d < depth32; d += 32) {
+      __m256i lhs_lo[Rows];
+      __m256i lhs_hi[Rows];
+      for (int i = 0; i < Rows; i++) {
+        const __m128i* ptr =
+            reinterpret_cast<const __m128i*>(lhs_ptr + i * stride + d);
+        lhs_lo[i] = Widen::Run(_mm_loadu_si128(ptr));
+        lhs_hi[i] = Widen::Run(_mm_loadu_si128(ptr + 1));
+      }
+      for (int c = 0; c < Cols; c++) {
+        const __m256i* rhs_ptr =
+            reinterpret_cast<const __m256i*>(rhs + c * rhs_stride + d);
+        const __m256i rhs_lo = _mm256_load_si256(rhs_ptr);
+        const __m256i rhs_hi = _mm256_load_si256(rhs_ptr + 1);
+        for (int i = 0; i < Rows; i++) {
+          acc[i][c] = _mm256_add_epi32(
+              acc[i][c],
+              _mm256_add_epi32(_mm256_madd_epi16(lhs_lo[i], rhs_lo),
+                               _mm256_madd_epi16(lhs_hi[i], rhs_hi)));
+        }
+      }
+    }
+    for (int i = 0; i < Rows; i++) {
+      const InputScalar* row_ptr = lhs_ptr + i * stride;
+      for (int c = 0; c < Cols; c++) {
+        const std::int16_t* rhs_col = rhs + c * rhs_stride;
+        std::int32_t sum = HorizontalSum(acc[i][c]);
+        for (int d = depth32; d < depth; d++) {
+          sum += static_cast<std::int32_t>(row_ptr[d]) * rhs_col[d];
+        }
+        dst[c * dst_stride + i] = sum;
+      }
+    }
+  }
+
+  static void Run(const MatrixMap<const InputScalar, MapOrder::RowMajor>& lhs,
+                  const std::int16_t* rhs, int rhs_stride, int start_row,
+                  int rows, std::int32_t* dst, int dst_stride) {
+    ScopedProfilingLabel label("GEMV kernel (AVX2, row-major LHS)");
+    int r = 0;
+    for (; r <= rows - kRows; r += kRows) {
+      RunRows<kRows>(lhs, rhs, rhs_stride, start_row + r, dst + r,
+                     dst_stride);
+    }
+    for (; r < rows; r++) {
+      RunRows<1>(lhs, rhs, rhs_stride, start_row + r, dst + r, dst_stride);
+    }
+  }
+};
+
+// Column-major LHS: same strategy as the SSE4 kernel. Since AVX2 unpack
+// instructions operate within 128-bit lanes, the interleaved products come
+// out as rows [0..3, 8..11] and [4..7, 12..15] and are permuted back into
+// row order before being accumulated.
+template <typename InputScalar, int Cols>
+struct GemvKernel<InputScalar, MapOrder::ColMajor, Cols> {
+  typedef GemvWidenAVX<InputScalar> Widen;
+
+  static void Run(const MatrixMap<const InputScalar, MapOrder::ColMajor>& lhs,
+                  const std::int16_t* rhs, int rhs_stride, int start_row,
+                  int rows, std::int32_t* dst, int dst_stride) {
+    ScopedProfilingLabel label("GEMV kernel (AVX2, column-major LHS)");
+    const int depth = lhs.cols();
+    const int stride = lhs.stride();
+    for (int c = 0; c < Cols; c++) {
+      memset(dst + c * dst_stride, 0, rows * sizeof(std::int32_t));
+    }
+    int d = 0;
+    for (; d <= depth - 4; d += 4) {
+      const InputScalar* col0 = lhs.data(start_row, d);
+      const InputScalar* col1 = col0 + stride;
+      const InputScalar* col2 = col1 + stride;
+      const InputScalar* col3 = col2 + stride;
+      __m256i rhs01[Cols];
+      __m256i rhs23[Cols];
+      for (int c = 0; c < Cols; c++) {
+        const std::int16_t* rhs_ptr = rhs + c * rhs_stride + d;
+        rhs01[c] = _mm256_unpacklo_epi16(_mm256_set1_epi16(rhs_ptr[0]),
+                                         _mm256_set1_epi16(rhs_ptr[1]));
+        rhs23[c] = _mm256_unpacklo_epi16(_mm256_set1_epi16(rhs_ptr[2]),
+                                         _mm256_set1_epi16(rhs_ptr[3]));
+      }
+      int r = 0;
+      for (; r <= rows - 16; r += 16) {
+        const __m256i w0 = Widen::Run(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(col0 + r)));
+        const __m256i w1 = Widen::Run(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(col1 + r)));
+        const __m256i w2 = Widen::Run(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(col2 + r)));
+        const __m256i w3 = Widen::Run(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(col3 + r)));
+        const __m256i x01_lo = _mm256_unpacklo_epi16(w0, w1);
+        const __m256i x01_hi = _mm256_unpackhi_epi16(w0, w1);
+        const __m256i x23_lo = _mm256_unpacklo_epi16(w2, w3);
+        const __m256i x23_hi = _mm256_unpackhi_epi16(w2, w3);
+        for (int c = 0; c < Cols; c++) {
+          const __m256i lo =
+              _mm256_add_epi32(_mm256_madd_epi16(x01_lo, rhs01[c]),
+                               _mm256_madd_epi16(x23_lo, rhs23[c]));
+          const __m256i hi =
+              _mm256_add_epi32(_mm256_madd_epi16(x01_hi, rhs01[c]),
+                               _mm256_madd_epi16(x23_hi, rhs23[c]));
+          __m256i* dst_ptr =
+              reinterpret_cast<__m256i*>(dst + c * dst_stride + r);
+          _mm256_storeu_si256(
+              dst_ptr,
+              _mm256_add_epi32(_mm256_loadu_si256(dst_ptr),
+                               _mm256_permute2x128_si256(lo, hi, 0x20)));
+          _mm256_storeu_si256(
+              dst_ptr + 1,
+              _mm256_add_epi32(_mm256_loadu_si256(dst_ptr + 1),
+                               _mm256_permute2x128_si256(lo, hi, 0x31)));
+        }
+      }
+      for (; r < rows; r++) {
+        for (int c = 0; c < Cols; c++) {
+          const std::int16_t* rhs_ptr = rhs + c * rhs_stride + d;
+          dst[c * dst_stride + r] +=
+              static_cast<std::int32_t>(col0[r]) * rhs_ptr[0] +
+              static_cast<std::int32_t>(col1[r]) * rhs_ptr[1] +
+              static_cast<std::int32_t>(col2[r]) * rhs_ptr[2] +
+              static_cast<std::int32_t>(col3[r]) * rhs_ptr[3];
+        }
+      }
+    }
+    for (; d < depth; d++) {
+      const InputScalar* col = lhs.data(start_row, d);
+      for (int c = 0; c < Cols; c++) {
+        const std::int16_t rhs_val = rhs[c * rhs_stride + d];
+        for (int r = 0; r < rows; r++) {
+          dst[c * dst_stride + r] +=
+              static_cast<std::int32_t>(col[r]) * rhs_val;
+        }
+      }
+    }
+  }
+};
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMV_AVX_H_
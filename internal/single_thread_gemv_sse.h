@@ -0,0 +1,218 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// single_thread_gemv_sse.h: optimized SSE4 specializations of the GEMV
+// kernels in single_thread_gemv.h.
+
+#ifndef GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMV_SSE_H_
+#define GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMV_SSE_H_
+
+#include <smmintrin.h>
+#include "single_thread_gemv.h"
+
+namespace gemmlowp {
+
+// Widens the low 8 lanes of a vector of 8-bit values to int16.
+template <typename InputScalar>
+struct GemvWidenSSE {};
+
+template <>
+struct GemvWidenSSE<std::uint8_t> {
+  static __m128i Run(__m128i x) { return _mm_cvtepu8_epi16(x); }
+};
+
+template <>
+struct GemvWidenSSE<std::int8_t> {
+  static __m128i Run(__m128i x) { return _mm_cvtepi8_epi16(x); }
+};
+
+// Row-major LHS: we handle kRows rows at a time, so that each 16-entry chunk
+// of the RHS is loaded once for kRows rows. Each (row, column) pair gets its
+// own accumulator of 4 partial sums, which are only reduced horizontally at
+// the end of the row. kRows is chosen so that the kRows * Cols accumulators
+// take up at most half of the 16 XMM registers.
+template <typename InputScalar, int Cols>
+struct GemvKernel<InputScalar, MapOrder::RowMajor, Cols> {
+  typedef GemvWidenSSE<InputScalar> Widen;
+  static const int kRows = Cols >= 4 ? 1 : 4 / Cols;
+
+  static std::int32_t HorizontalSum(__m128i x) {
+    x = _mm_hadd_epi32(x, x);
+    x = _mm_hadd_epi32(x, x);
+    return _mm_cvtsi128_si32(x);
+  }
+
+  template <int Rows>
+  static void RunRows(
+      const MatrixMap<const InputScalar, MapOrder::RowMajor>& lhs,
+      const std::int16_t* rhs, int rhs_stride, int row, std::int32_t* dst,
+      int dst_stride) {
+    const int depth = lhs.cols();
+    const int stride = lhs.stride();
+    const int depth16 = depth & ~15;
+    const InputScalar* lhs_ptr = lhs.data(row, 0);
+    __m128i acc[Rows][Cols];
+    for (int i = 0; i < Rows; i++) {
+      for (int c = 0; c < Cols; c++) {
+        acc[i][c] = _mm_setzero_si128();
+      }
+    }
+    for (int d = 0; d < depth16; d += 16) {
+      __m128i lhs_lo[Rows];
+      __m128i lhs_hi[Rows];
+      for (int i = 0; i < Rows; i++) {
+        const __m128i v = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(lhs_ptr + i * stride + d));
+        lhs_lo[i] = Widen::Run(v);
+        lhs_hi[i] = Widen::Run(_mm_srli_si128(v, 8));
+      }
+      for (int c = 0; c < Cols; c++) {
+        const __m128i* rhs_ptr =
+            reinterpret_cast<const __m128i*>(rhs + c * rhs_stride + d);
+        const __m128i rhs_lo = _mm_load_si128(rhs_ptr);
+        const __m128i rhs_hi = _mm_load_si128(rhs_ptr + 1);
+        for (int i = 0; i < Rows; i++) {
+          acc[i][c] = _mm_add_epi32(
+              acc[i][c], _mm_add_epi32(_mm_madd_epi16(lhs_lo[i], rhs_lo),
+                                       _mm_madd_epi16(lhs_hi[i], rhs_hi)));
+        }
+      }
+    }
+    for (int i = 0; i < Rows; i++) {
+      const InputScalar* row_ptr = lhs_ptr + i * stride;
+      for (int c = 0; c < Cols; c++) {
+        const std::int16_t* rhs_col = rhs + c * rhs_stride;
+        std::int32_t sum = HorizontalSum(acc[i][c]);
+        for (int d = depth16; d < depth; d++) {
+          sum += static_cast<std::int32_t>(row_ptr[d]) * rhs_col[d];
+        }
+        dst[c * dst_stride + i] = sum;
+      }
+    }
+  }
+
+  static void Run(const MatrixMap<const InputScalar, MapOrder::RowMajor>& lhs,
+                  const std::int16_t* rhs, int rhs_stride, int start_row,
+                  int rows, std::int32_t* dst, int dst_stride) {
+    ScopedProfilingLabel label("GEMV kernel (SSE4, row-major LHS)");
+    int r = 0;
+    for (; r <= rows - kRows; r += kRows) {
+      RunRows<kRows>(lhs, rhs, rhs_stride, start_row + r, dst + r,
+                     dst_stride);
+    }
+    for (; r < rows; r++) {
+      RunRows<1>(lhs, rhs, rhs_stride, start_row + r, dst + r, dst_stride);
+    }
+  }
+};
+
+// Column-major LHS: we traverse the LHS in storage order, 4 columns at a
+// time, accumulating into the destination, which is small enough to stay in
+// L1 cache. Pairs of LHS columns are interleaved so that _mm_madd_epi16
+// multiplies them by the corresponding pair of RHS entries at once. Each
+// 16x4 block of the LHS is loaded and interleaved once for all Cols columns
+// of the RHS.
+template <typename InputScalar, int Cols>
+struct GemvKernel<InputScalar, MapOrder::ColMajor, Cols> {
+  typedef GemvWidenSSE<InputScalar> Widen;
+
+  static void Run(const MatrixMap<const InputScalar, MapOrder::ColMajor>& lhs,
+                  const std::int16_t* rhs, int rhs_stride, int start_row,
+                  int rows, std::int32_t* dst, int dst_stride) {
+    ScopedProfilingLabel label("GEMV kernel (SSE4, column-major LHS)");
+    const int depth = lhs.cols();
+    const int stride = lhs.stride();
+    for (int c = 0; c < Cols; c++) {
+      memset(dst + c * dst_stride, 0, rows * sizeof(std::int32_t));
+    }
+    int d = 0;
+    for (; d <= depth - 4; d += 4) {
+      const InputScalar* col0 = lhs.data(start_row, d);
+      const InputScalar* col1 = col0 + stride;
+      const InputScalar* col2 = col1 + stride;
+      const InputScalar* col3 = col2 + stride;
+      __m128i rhs01[Cols];
+      __m128i rhs23[Cols];
+      for (int c = 0; c < Cols; c++) {
+        const std::int16_t* rhs_ptr = rhs + c * rhs_stride + d;
+        rhs01[c] = _mm_unpacklo_epi16(_mm_set1_epi16(rhs_ptr[0]),
+                                      _mm_set1_epi16(rhs_ptr[1]));
+        rhs23[c] = _mm_unpacklo_epi16(_mm_set1_epi16(rhs_ptr[2]),
+                                      _mm_set1_epi16(rhs_ptr[3]));
+      }
+      int r = 0;
+      for (; r <= rows - 16; r += 16) {
+        const __m128i v0 =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(col0 + r));
+        const __m128i v1 =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(col1 + r));
+        const __m128i v2 =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(col2 + r));
+        const __m128i v3 =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(col3 + r));
+        const __m128i w0_lo = Widen::Run(v0);
+        const __m128i w0_hi = Widen::Run(_mm_srli_si128(v0, 8));
+        const __m128i w1_lo = Widen::Run(v1);
+        const __m128i w1_hi = Widen::Run(_mm_srli_si128(v1, 8));
+        const __m128i w2_lo = Widen::Run(v2);
+        const __m128i w2_hi = Widen::Run(_mm_srli_si128(v2, 8));
+        const __m128i w3_lo = Widen::Run(v3);
+        const __m128i w3_hi = Widen::Run(_mm_srli_si128(v3, 8));
+        // x01[k] and x23[k] hold interleaved LHS entries for rows
+        // r + 4 * k .. r + 4 * k + 3.
+        const __m128i x01[4] = {
+            _mm_unpacklo_epi16(w0_lo, w1_lo), _mm_unpackhi_epi16(w0_lo, w1_lo),
+            _mm_unpacklo_epi16(w0_hi, w1_hi), _mm_unpackhi_epi16(w0_hi, w1_hi)};
+        const __m128i x23[4] = {
+            _mm_unpacklo_epi16(w2_lo, w3_lo), _mm_unpackhi_epi16(w2_lo, w3_lo),
+            _mm_unpacklo_epi16(w2_hi, w3_hi), _mm_unpackhi_epi16(w2_hi, w3_hi)};
+        for (int c = 0; c < Cols; c++) {
+          __m128i* dst_ptr =
+              reinterpret_cast<__m128i*>(dst + c * dst_stride + r);
+          for (int k = 0; k < 4; k++) {
+            _mm_storeu_si128(
+                dst_ptr + k,
+                _mm_add_epi32(_mm_loadu_si128(dst_ptr + k),
+                              _mm_add_epi32(_mm_madd_epi16(x01[k], rhs01[c]),
+                                            _mm_madd_epi16(x23[k], rhs23[c]))));
+          }
+        }
+      }
+      for (; r < rows; r++) {
+        for (int c = 0; c < Cols; c++) {
+          const std::int16_t* rhs_ptr = rhs + c * rhs_stride + d;
+          dst[c * dst_stride + r] +=
+              static_cast<std::int32_t>(col0[r]) * rhs_ptr[0] +
+              static_cast<std::int32_t>(col1[r]) * rhs_ptr[1] +
+              static_cast<std::int32_t>(col2[r]) * rhs_ptr[2] +
+              static_cast<std::int32_t>(col3[r]) * rhs_ptr[3];
+        }
+      }
+    }
+    for (; d < depth; d++) {
+      const InputScalar* col = lhs.data(start_row, d);
+      for (int c = 0; c < Cols; c++) {
+        const std::int16_t rhs_val = rhs[c * rhs_stride + d];
+        for (int r = 0; r < rows; r++) {
+          dst[c * dst_stride + r] +=
+              static_cast<std::int32_t>(col[r]) * rhs_val;
+        }
+      }
+    }
+  }
+};
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_SINGLE_THREAD_GEMV_SSE_H_
@@ -0,0 +1,35 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// task.h: the unit of work that a WorkersPool (see multi_thread_gemm.h)
+// hands to its threads.
+
+#ifndef GEMMLOWP_INTERNAL_TASK_H_
+#define GEMMLOWP_INTERNAL_TASK_H_
+
+#include "allocator.h"
+
+namespace gemmlowp {
+
+// A workload for a worker.
+struct Task {
+  Task() : local_allocator(nullptr) {}
+  virtual ~Task() {}
+  virtual void Run() = 0;
+  Allocator* local_allocator;
+};
+
+}  // namespace gemmlowp
+
+#endif  // GEMMLOWP_INTERNAL_TASK_H_
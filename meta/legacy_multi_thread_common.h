@@ -72,12 +72,7 @@ struct MetaTask : gemmlowp::Task {
 };
 
 std::int32_t ResolveMaxThreads(std::int32_t max_threads) {
-  if (max_threads == 0) {
-    static const int hardware_threads_count =
-        static_cast<int>(sysconf(_SC_NPROCESSORS_CONF));
-    return hardware_threads_count;
-  }
-  return max_threads;
+  return GetHardwareConcurrency(max_threads);
 }
 
 void PrepareTasks(std::int32_t max_tasks, std::int32_t m, std::int32_t n,
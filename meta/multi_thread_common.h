@@ -20,19 +20,9 @@
 namespace gemmlowp {
 namespace meta {
 
+// Same as GetHardwareConcurrency, see HardwareConcurrencyInfo.
 inline int ResolveMaxThreads(int max_threads) {
-  if (max_threads == 0) {
-#ifdef _WIN32
-    SYSTEM_INFO sysinfo;
-    GetSystemInfo(&sysinfo);
-    return sysinfo.dwNumberOfProcessors;
-#else
-    static const int hardware_threads_count =
-        static_cast<int>(sysconf(_SC_NPROCESSORS_CONF));
-    return hardware_threads_count;
-#endif
-  }
-  return max_threads;
+  return GetHardwareConcurrency(max_threads);
 }
 
 template <typename WorkersPool>
@@ -131,11 +131,12 @@ inline void MultiThreadGemm(MultiThreadingContext* context,
   }
 
   auto workers_pool = context->workers_pool();
-  std::vector<Task*> tasks;
+  std::vector<TaskRunnerType> tasks;
+  tasks.reserve(task_params.size());
   for (auto& task_param : task_params) {
-    tasks.push_back(new TaskRunnerType(task_param));
-  };
-  workers_pool->Execute(tasks);
+    tasks.emplace_back(task_param);
+  }
+  workers_pool->Execute(tasks.size(), tasks.data());
 }
 
 }  // namespace meta
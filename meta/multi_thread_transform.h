@@ -85,11 +85,12 @@ inline void MultiThreadTransform1D(MultiThreadingContext* context,
   }
 
   auto workers_pool = context->workers_pool();
-  std::vector<Task*> tasks;
+  std::vector<TaskRunnerType> tasks;
+  tasks.reserve(task_params.size());
   for (auto& task_param : task_params) {
-    tasks.push_back(new TaskRunnerType(task_param));
+    tasks.emplace_back(task_param);
   }
-  workers_pool->Execute(tasks);
+  workers_pool->Execute(tasks.size(), tasks.data());
 }
 
 }  // namespace meta
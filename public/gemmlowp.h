@@ -16,7 +16,12 @@
 
 #ifndef GEMMLOWP_PUBLIC_GEMMLOWP_H_
 #define GEMMLOWP_PUBLIC_GEMMLOWP_H_
+#include <functional>
+#include <vector>
+
 #include "../internal/dispatch_gemm_shape.h"
+#include "../internal/gemm_coalescer.h"
+#include "../internal/gemm_cost_model.h"
 #include "bit_depth.h"
 #include "map.h"
 #include "output_stages.h"
@@ -25,6 +30,22 @@ namespace gemmlowp {
 
 class GemmContext : public MultiThreadGemmContext {};
 
+// A LHS matrix packed once ahead of time for the default kernel of the given
+// BitDepthParams, to be passed to the Gemm overloads below taking a
+// PackedLhsMatrix instead of a MatrixMap LHS. This is useful when the same
+// LHS (typically a weights matrix) is used in many Gemm calls: the packing
+// cost is then paid only once. Example:
+//
+//   DefaultPackedLhsMatrix<DefaultL8R8BitDepthParams> packed_lhs(
+//       lhs, context.l1_bytes_to_use());
+//   Gemm<std::uint8_t, DefaultL8R8BitDepthParams>(&context, packed_lhs, ...);
+//
+// The packed data does not depend on the LHS offset, which is still passed
+// to each Gemm call. The source matrix is not referenced after packing.
+template <typename BitDepthParams>
+using DefaultPackedLhsMatrix =
+    PackedLhsMatrix<typename DefaultKernel<BitDepthParams>::Format>;
+
 // Computes a general matrix product ("GEMM").
 // This is a version that supports per channel quantization.
 template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
@@ -42,6 +63,22 @@ void GemmWithOutputPipelinePC(GemmContextType* context,
       context, lhs, rhs, result, lhs_offset, rhs_offset, output_pipeline);
 }
 
+// Same as above, but with a LHS that has already been packed ahead of time.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          typename KernelFormat, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename LhsOffset, typename RhsOffset, typename OutputPipelineType,
+          typename GemmContextType>
+void GemmWithOutputPipelinePC(GemmContextType* context,
+                              const PackedLhsMatrix<KernelFormat>& lhs,
+                              const MatrixMap<const InputScalar, RhsOrder>& rhs,
+                              MatrixMap<OutputScalar, ResultOrder>* result,
+                              const LhsOffset& lhs_offset,
+                              const RhsOffset& rhs_offset,
+                              const OutputPipelineType& output_pipeline) {
+  DispatchGemmWithPackedLhs<InputScalar, OutputScalar, BitDepthParams>(
+      context, lhs, rhs, result, lhs_offset, rhs_offset, output_pipeline);
+}
+
 // Computes a general matrix product ("GEMM").
 // This is the legacy version that does not support per channel quantization.
 // The meaning of the offsets, result_mult_int and result_shift
@@ -65,6 +102,25 @@ void GemmWithOutputPipeline(GemmContextType* context,
       output_pipeline);
 }
 
+// Same as above, but with a LHS that has already been packed ahead of time.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          typename KernelFormat, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename OutputPipelineType, typename GemmContextType>
+void GemmWithOutputPipeline(GemmContextType* context,
+                            const PackedLhsMatrix<KernelFormat>& lhs,
+                            const MatrixMap<const InputScalar, RhsOrder>& rhs,
+                            MatrixMap<OutputScalar, ResultOrder>* result,
+                            int lhs_offset, int rhs_offset,
+                            const OutputPipelineType& output_pipeline) {
+  typedef VectorDup<const std::int32_t, VectorShape::Col> OffsetColDup;
+  typedef VectorDup<const std::int32_t, VectorShape::Row> OffsetRowDup;
+  const OffsetColDup lhs_offset_vector(lhs_offset, lhs.rows());
+  const OffsetRowDup rhs_offset_vector(rhs_offset, rhs.cols());
+  DispatchGemmWithPackedLhs<InputScalar, OutputScalar, BitDepthParams>(
+      context, lhs, rhs, result, lhs_offset_vector, rhs_offset_vector,
+      output_pipeline);
+}
+
 // Computes a general matrix product ("GEMM").
 // The meaning of the offsets, result_mult_int and result_shift
 // parameters is the same as in the standard EightBitIntGemm interface
@@ -82,6 +138,156 @@ void Gemm(GemmContextType* context,
       MakeStandardOutputPipeline(result_offset, result_mult_int, result_shift));
 }
 
+// Same as above, but with a LHS that has already been packed ahead of time.
+template <typename Scalar, typename BitDepthParams, typename KernelFormat,
+          MapOrder RhsOrder, MapOrder ResultOrder, typename GemmContextType>
+void Gemm(GemmContextType* context, const PackedLhsMatrix<KernelFormat>& lhs,
+          const MatrixMap<const Scalar, RhsOrder>& rhs,
+          MatrixMap<Scalar, ResultOrder>* result, int lhs_offset,
+          int rhs_offset, int result_offset, int result_mult_int,
+          int result_shift) {
+  GemmWithOutputPipeline<Scalar, Scalar, BitDepthParams>(
+      context, lhs, rhs, result, lhs_offset, rhs_offset,
+      MakeStandardOutputPipeline(result_offset, result_mult_int, result_shift));
+}
+
+// Computes a batch of independent Gemms, which may have different sizes but
+// share the same offsets and output pipeline. This is meant for many small
+// Gemms, such as those of attention heads or of grouped convolutions: each
+// of them would only use one thread, so instead of running them one after
+// the other, whole Gemms are spread across the threads, each running
+// single-threaded. Example:
+//
+//   std::vector<GemmBatchEntry<std::uint8_t, std::uint8_t, MapOrder::RowMajor,
+//                              MapOrder::ColMajor, MapOrder::ColMajor>>
+//       batch;
+//   batch.push_back({lhs0, rhs0, result0});
+//   batch.push_back({lhs1, rhs1, result1});
+//   GemmWithOutputPipelineBatch<std::uint8_t, std::uint8_t,
+//                               DefaultL8R8BitDepthParams>(
+//       &context, batch, lhs_offset, rhs_offset, output_pipeline);
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename OutputPipelineType, typename GemmContextType>
+void GemmWithOutputPipelineBatch(
+    GemmContextType* context,
+    const std::vector<GemmBatchEntry<InputScalar, OutputScalar, LhsOrder,
+                                     RhsOrder, ResultOrder>>& batch,
+    int lhs_offset, int rhs_offset, const OutputPipelineType& output_pipeline) {
+  DispatchGemmBatch<InputScalar, OutputScalar, BitDepthParams>(
+      context, batch.data(), static_cast<int>(batch.size()), lhs_offset,
+      rhs_offset, output_pipeline);
+}
+
+// Same as above, for batch_size Gemms of the same size, whose matrices are
+// stored at regular intervals: lhs, rhs and result are those of the first
+// Gemm, and the matrices of each Gemm start the given batch strides (in
+// entries) after those of the previous one.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename OutputPipelineType, typename GemmContextType>
+void GemmWithOutputPipelineStridedBatch(
+    GemmContextType* context, int batch_size,
+    const MatrixMap<const InputScalar, LhsOrder>& lhs, int lhs_batch_stride,
+    const MatrixMap<const InputScalar, RhsOrder>& rhs, int rhs_batch_stride,
+    MatrixMap<OutputScalar, ResultOrder>* result, int result_batch_stride,
+    int lhs_offset, int rhs_offset, const OutputPipelineType& output_pipeline) {
+  typedef GemmBatchEntry<InputScalar, OutputScalar, LhsOrder, RhsOrder,
+                         ResultOrder>
+      EntryType;
+  std::vector<EntryType> batch;
+  batch.reserve(batch_size);
+  for (int i = 0; i < batch_size; i++) {
+    batch.emplace_back(
+        MatrixMap<const InputScalar, LhsOrder>(
+            lhs.data() + i * lhs_batch_stride, lhs.rows(), lhs.cols(),
+            lhs.stride()),
+        MatrixMap<const InputScalar, RhsOrder>(
+            rhs.data() + i * rhs_batch_stride, rhs.rows(), rhs.cols(),
+            rhs.stride()),
+        MatrixMap<OutputScalar, ResultOrder>(
+            result->data() + i * result_batch_stride, result->rows(),
+            result->cols(), result->stride()));
+  }
+  DispatchGemmBatch<InputScalar, OutputScalar, BitDepthParams>(
+      context, batch.data(), batch_size, lhs_offset, rhs_offset,
+      output_pipeline);
+}
+
+// A handle on a Gemm started by GemmWithOutputPipelineAsync or GemmAsync,
+// to find out when it has completed.
+class GemmAsyncHandle {
+ public:
+  explicit GemmAsyncHandle(WorkersPool* workers_pool)
+      : workers_pool_(workers_pool) {}
+
+  // Returns whether the Gemm has completed, without waiting.
+  bool Poll() { return workers_pool_->PollAsync(); }
+
+  // Waits for the Gemm to complete.
+  void Wait() { workers_pool_->WaitAsync(); }
+
+ private:
+  WorkersPool* workers_pool_;
+};
+
+// Same as GemmWithOutputPipeline, but returns without waiting for the Gemm
+// to complete, so that the calling thread can do other work meanwhile, such
+// as preparing the inputs of the next Gemm. The Gemm runs on the threads of
+// the context's WorkersPool, one of which takes the role that the calling
+// thread has in synchronous Gemms. Example:
+//
+//   GemmAsyncHandle handle =
+//       GemmWithOutputPipelineAsync<std::uint8_t, std::uint8_t,
+//                                   DefaultL8R8BitDepthParams>(
+//           &context, lhs, rhs, &result, lhs_offset, rhs_offset,
+//           output_pipeline);
+//   QuantizeNextInput();
+//   handle.Wait();
+//
+// The matrices must stay valid, and the context must not be used, until
+// the handle reports that the Gemm has completed, through Poll() or Wait().
+// If on_completion is given, it is called on the thread that ran the Gemm,
+// once the result has been written, and before the handle reports it.
+template <typename InputScalar, typename OutputScalar, typename BitDepthParams,
+          MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder,
+          typename OutputPipelineType, typename GemmContextType>
+GemmAsyncHandle GemmWithOutputPipelineAsync(
+    GemmContextType* context, const MatrixMap<const InputScalar, LhsOrder>& lhs,
+    const MatrixMap<const InputScalar, RhsOrder>& rhs,
+    MatrixMap<OutputScalar, ResultOrder>* result, int lhs_offset,
+    int rhs_offset, const OutputPipelineType& output_pipeline,
+    std::function<void()> on_completion = nullptr) {
+  const MatrixMap<OutputScalar, ResultOrder> result_map = *result;
+  context->workers_pool()->StartAsync([=]() {
+    MatrixMap<OutputScalar, ResultOrder> async_result = result_map;
+    GemmWithOutputPipeline<InputScalar, OutputScalar, BitDepthParams>(
+        context, lhs, rhs, &async_result, lhs_offset, rhs_offset,
+        output_pipeline);
+    if (on_completion) {
+      on_completion();
+    }
+  });
+  return GemmAsyncHandle(context->workers_pool());
+}
+
+// Same as Gemm, but returns without waiting for the Gemm to complete, see
+// GemmWithOutputPipelineAsync.
+template <typename Scalar, typename BitDepthParams, MapOrder LhsOrder,
+          MapOrder RhsOrder, MapOrder ResultOrder, typename GemmContextType>
+GemmAsyncHandle GemmAsync(GemmContextType* context,
+                          const MatrixMap<const Scalar, LhsOrder>& lhs,
+                          const MatrixMap<const Scalar, RhsOrder>& rhs,
+                          MatrixMap<Scalar, ResultOrder>* result,
+                          int lhs_offset, int rhs_offset, int result_offset,
+                          int result_mult_int, int result_shift,
+                          std::function<void()> on_completion = nullptr) {
+  return GemmWithOutputPipelineAsync<Scalar, Scalar, BitDepthParams>(
+      context, lhs, rhs, result, lhs_offset, rhs_offset,
+      MakeStandardOutputPipeline(result_offset, result_mult_int, result_shift),
+      on_completion);
+}
+
 }  // namespace gemmlowp
 
 #endif  // GEMMLOWP_PUBLIC_GEMMLOWP_H_
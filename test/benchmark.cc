@@ -16,11 +16,17 @@
 #include <sys/time.h>
 #endif
 
+#include <algorithm>
+#include <atomic>              // NOLINT
+#include <condition_variable>  // NOLINT
 #include <cstdint>
 #include <cstdlib>
 #include <ctime>
+#include <deque>
 #include <iostream>
 #include <map>
+#include <mutex>   // NOLINT
+#include <thread>  // NOLINT
 #include <vector>
 #ifdef __APPLE__
 #include <TargetConditionals.h>
@@ -276,7 +282,7 @@ void benchmark_gemm_sizes(GemmContext* context,
             << "% best: " << best_mean_latency << "s" << std::endl;
 }
 
-void benchmark_googlenet(GemmContext* context) {
+std::vector<gemm_t> googlenet_gemms() {
   // These are the m, n, k sizes for a typical GoogLeNet.
   const int googlenet_gemm_sizes[] = {
       12544, 64,  147, 3136, 64,   64,   3136, 192,  576,  784, 64,   192,
@@ -301,15 +307,18 @@ void benchmark_googlenet(GemmContext* context) {
   const std::size_t num_googlenet_gemms =
       sizeof(googlenet_gemm_sizes) / (3 * sizeof(googlenet_gemm_sizes[0]));
 
-  std::vector<gemm_t> googlenet_gemms(num_googlenet_gemms);
+  std::vector<gemm_t> gemms(num_googlenet_gemms);
   for (std::size_t i = 0; i < num_googlenet_gemms; i++) {
-    googlenet_gemms[i].rows = googlenet_gemm_sizes[3 * i + 1];
-    googlenet_gemms[i].depth = googlenet_gemm_sizes[3 * i + 2];
-    googlenet_gemms[i].cols = googlenet_gemm_sizes[3 * i + 0];
+    gemms[i].rows = googlenet_gemm_sizes[3 * i + 1];
+    gemms[i].depth = googlenet_gemm_sizes[3 * i + 2];
+    gemms[i].cols = googlenet_gemm_sizes[3 * i + 0];
   }
+  return gemms;
+}
 
+void benchmark_googlenet(GemmContext* context) {
   const double mintime = 20.0;
-  benchmark_gemm_sizes(context, googlenet_gemms, mintime);
+  benchmark_gemm_sizes(context, googlenet_gemms(), mintime);
 }
 
 void benchmark_small_model(GemmContext* context) {
@@ -334,7 +343,425 @@ void benchmark_small_model(GemmContext* context) {
   benchmark_gemm_sizes(context, small_model_gemms, mintime);
 }
 
+void benchmark_gemv_threads() {
+  // A large GEMV, whose LHS does not fit in caches. Being memory-bound,
+  // it should scale with threads until memory bandwidth is saturated.
+  const gemm_t gemv(4096, 4096, 1);
+  const int max_threads = GetHardwareConcurrency(0);
+
+  typedef Matrix<std::uint8_t, MapOrder::RowMajor> LhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> RhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> ResultType;
+
+  std::cout.precision(4);
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    gemmlowp::GemmContext context;
+    context.set_max_num_threads(threads);
+    context.set_max_num_gemv_threads(threads);
+    const double time = time_for_gemms<LhsType, RhsType, ResultType>(
+        &context, std::vector<gemm_t>(1, gemv));
+    std::cout << gemv.rows << "x" << gemv.depth << "x" << gemv.cols << ", "
+              << threads << " threads : "
+              << 1e-9 * gemv.rows * gemv.depth / time << " GB/s" << std::endl;
+  }
+
+  for (int calibrate = 0; calibrate < 2; calibrate++) {
+    gemmlowp::GemmContext context;
+    context.set_max_num_threads(0);
+    if (calibrate) {
+      CalibrateGemvThreads(&context);
+    }
+    const double time = time_for_gemms<LhsType, RhsType, ResultType>(
+        &context, std::vector<gemm_t>(1, gemv));
+    std::cout << gemv.rows << "x" << gemv.depth << "x" << gemv.cols
+              << ", automatic thread count, "
+              << (calibrate ? "calibrated" : "default") << " ceiling : "
+              << 1e-9 * gemv.rows * gemv.depth / time << " GB/s" << std::endl;
+  }
+}
+
+void benchmark_skinny_gemm() {
+  // Skinny GEMMs as in micro-batched inference. Up to kMaxGemvCols columns,
+  // these take the packing-free GEMV path, so throughput should scale with
+  // the number of columns; the last size takes the regular GEMM path.
+  typedef Matrix<std::uint8_t, MapOrder::RowMajor> LhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> RhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> ResultType;
+
+  gemmlowp::GemmContext context;
+  context.set_max_num_threads(1);
+  std::cout.precision(4);
+  for (int cols = 1; cols <= kMaxGemvCols + 1; cols++) {
+    const std::vector<gemm_t> gemms(1, gemm_t(1024, 1024, cols));
+    double best_gflops = 0;
+    for (int r = 0; r < 5; r++) {
+      best_gflops = std::max(
+          best_gflops,
+          gflops_for_gemms<LhsType, RhsType, ResultType>(&context, gemms));
+    }
+    std::cout << "1024x1024x" << cols << " : " << best_gflops << " GFlops/s"
+              << std::endl;
+  }
+}
+
+// A task doing nothing, to measure the overhead of dispatching tasks.
+struct EmptyTask : Task {
+  void Run() override {}
+};
+
+void benchmark_dispatch_overhead() {
+  // The cost of handing tasks to worker threads and waiting for them,
+  // which dominates multi-threaded GEMMs of medium sizes. Build with
+  // -DGEMMLOWP_NO_FUTEX to compare with waiting on condition variables.
+  const int max_threads = GetHardwareConcurrency(0);
+  std::cout.precision(4);
+  for (int threads = 2; threads <= max_threads; threads *= 2) {
+    WorkersPool pool;
+    std::vector<EmptyTask> tasks(threads);
+    int iters_at_a_time = 1;
+    double time_per_iter = 0;
+    while (true) {
+      const double starttime = real_time_in_seconds();
+      for (int i = 0; i < iters_at_a_time; i++) {
+        pool.Execute(threads, tasks.data());
+      }
+      const double timing = real_time_in_seconds() - starttime;
+      if (timing >= min_accurate_duration) {
+        time_per_iter = timing / iters_at_a_time;
+        break;
+      }
+      iters_at_a_time *= 2;
+    }
+    std::cout << threads << " threads, empty tasks : " << 1e6 * time_per_iter
+              << " us per dispatch" << std::endl;
+  }
+
+  typedef Matrix<std::uint8_t, MapOrder::RowMajor> LhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> RhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> ResultType;
+  const gemm_t gemm(100, 100, 100);
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    gemmlowp::GemmContext context;
+    context.set_max_num_threads(threads);
+    double best_time = 0;
+    for (int r = 0; r < 5; r++) {
+      const double time = time_for_gemms<LhsType, RhsType, ResultType>(
+          &context, std::vector<gemm_t>(1, gemm));
+      best_time = r ? std::min(best_time, time) : time;
+    }
+    std::cout << gemm.rows << "x" << gemm.depth << "x" << gemm.cols << ", "
+              << threads << " threads : " << 1e6 * best_time << " us per GEMM"
+              << std::endl;
+  }
+}
+
+// A minimal application thread pool, running scheduled closures in FIFO
+// order, standing for an application's own pool in
+// benchmark_task_executor.
+class ApplicationThreadPool {
+ public:
+  explicit ApplicationThreadPool(int threads_count) : exit_(false) {
+    for (int i = 0; i < threads_count; i++) {
+      threads_.emplace_back([this]() { ThreadFunc(); });
+    }
+  }
+
+  ~ApplicationThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      exit_ = true;
+    }
+    cond_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  void Schedule(std::function<void()> f) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(f));
+    }
+    cond_.notify_one();
+  }
+
+ private:
+  void ThreadFunc() {
+    while (true) {
+      std::function<void()> f;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this]() { return exit_ || !queue_.empty(); });
+        if (queue_.empty()) {
+          return;
+        }
+        f = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      f();
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::function<void()>> queue_;
+  bool exit_;
+};
+
+void benchmark_task_executor() {
+  // Gemms on gemmlowp's own workers, and on the threads of an application
+  // pool through a ScheduleTaskExecutor, which don't busy-wait for work.
+  typedef Matrix<std::uint8_t, MapOrder::RowMajor> LhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> RhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> ResultType;
+  const int max_threads = GetHardwareConcurrency(0);
+  std::cout.precision(4);
+  for (const gemm_t& gemm : {gemm_t(100, 100, 100), gemm_t(500, 500, 500)}) {
+    for (int threads = 2; threads <= max_threads; threads *= 2) {
+      ApplicationThreadPool app_pool(threads - 1);
+      ScheduleTaskExecutor executor(
+          [&app_pool](std::function<void()> f) { app_pool.Schedule(f); });
+      for (int use_executor = 0; use_executor < 2; use_executor++) {
+        gemmlowp::GemmContext context;
+        context.set_max_num_threads(threads);
+        if (use_executor) {
+          context.set_task_executor(&executor);
+        }
+        double best_time = 0;
+        for (int r = 0; r < 5; r++) {
+          const double time = time_for_gemms<LhsType, RhsType, ResultType>(
+              &context, std::vector<gemm_t>(1, gemm));
+          best_time = r ? std::min(best_time, time) : time;
+        }
+        std::cout << gemm.rows << "x" << gemm.depth << "x" << gemm.cols
+                  << ", " << threads << " threads, "
+                  << (use_executor ? "application pool" : "built-in pool")
+                  << " : " << 1e6 * best_time << " us per GEMM" << std::endl;
+      }
+    }
+  }
+}
+
+void benchmark_priority_latency() {
+  // Latency of a stream of small Gemms, while another thread keeps running
+  // large Gemms, both on the same SharedWorkersPool, with the small Gemms
+  // at normal and at high priority.
+  typedef Matrix<std::uint8_t, MapOrder::RowMajor> LhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> RhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> ResultType;
+  const int small_size = 128;
+  const int large_size = 1000;
+  const int small_gemms = 500;
+  LhsType small_lhs(small_size, small_size);
+  RhsType small_rhs(small_size, small_size);
+  ResultType small_result(small_size, small_size);
+  MakeConstant(&small_lhs, 0);
+  MakeConstant(&small_rhs, 0);
+  std::cout.precision(4);
+  for (WorkPriority priority : {WorkPriority::Normal, WorkPriority::High}) {
+    SharedWorkersPool shared_pool;
+    std::atomic<bool> stop(false);
+    std::thread background([&shared_pool, &stop, large_size]() {
+      LhsType lhs(large_size, large_size);
+      RhsType rhs(large_size, large_size);
+      ResultType result(large_size, large_size);
+      MakeConstant(&lhs, 0);
+      MakeConstant(&rhs, 0);
+      gemmlowp::GemmContext context;
+      context.set_max_num_threads(0);
+      context.set_shared_workers_pool(&shared_pool);
+      while (!stop.load()) {
+        Gemm<std::uint8_t, GEMMLOWP_TEST_BIT_DEPTH_PARAMS>(
+            &context, lhs.const_map(), rhs.const_map(), &result.map(), -75,
+            -91, 74980, 123, 20);
+      }
+    });
+    gemmlowp::GemmContext context;
+    context.set_max_num_threads(0);
+    context.set_shared_workers_pool(&shared_pool);
+    context.set_priority(priority);
+    std::vector<double> latencies;
+    for (int i = 0; i < small_gemms; i++) {
+      const double start_time = real_time_in_seconds();
+      Gemm<std::uint8_t, GEMMLOWP_TEST_BIT_DEPTH_PARAMS>(
+          &context, small_lhs.const_map(), small_rhs.const_map(),
+          &small_result.map(), -75, -91, 74980, 123, 20);
+      latencies.push_back(real_time_in_seconds() - start_time);
+    }
+    stop.store(true);
+    background.join();
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << small_size << "x" << small_size << "x" << small_size << ", "
+              << (priority == WorkPriority::High ? "high" : "normal")
+              << " priority, under load : p50 "
+              << 1e6 * latencies[latencies.size() / 2] << " us, p99 "
+              << 1e6 * latencies[latencies.size() * 99 / 100] << " us"
+              << std::endl;
+  }
+}
+
+void benchmark_gemm_coalescer() {
+  // Throughput of threads each multiplying the same 1024x1024 LHS by one
+  // column at a time, each with its own context, and through a
+  // GemmCoalescer gathering the columns of all threads.
+  typedef Matrix<std::uint8_t, MapOrder::RowMajor> LhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> RhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> ResultType;
+  const int size = 1024;
+  const int thread_count = 16;
+  const int gemms_per_thread = 200;
+  LhsType lhs(size, size);
+  MakeConstant(&lhs, 0);
+  CoalescedGemmParams params;
+  params.rhs_offset = -91;
+  params.result_fixedpoint_multiplier = 1 << 30;
+  params.result_exponent = -8;
+  params.result_offset_after_shift = 0;
+  std::cout.precision(4);
+  for (int coalesce = 0; coalesce < 2; coalesce++) {
+    gemmlowp::GemmContext coalescer_context;
+    coalescer_context.set_max_num_threads(0);
+    GemmCoalescer<GEMMLOWP_TEST_BIT_DEPTH_PARAMS, MapOrder::RowMajor,
+                  GemmContext>
+        coalescer(&coalescer_context, lhs.const_map(), -75,
+                  std::chrono::microseconds(100), thread_count);
+    const double start_time = real_time_in_seconds();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+      threads.emplace_back([&]() {
+        RhsType rhs(size, 1);
+        ResultType result(size, 1);
+        MakeConstant(&rhs, 0);
+        gemmlowp::GemmContext context;
+        for (int i = 0; i < gemms_per_thread; i++) {
+          if (coalesce) {
+            coalescer.Gemm(rhs.const_map(), &result.map(), params);
+          } else {
+            Gemm<std::uint8_t, GEMMLOWP_TEST_BIT_DEPTH_PARAMS>(
+                &context, lhs.const_map(), rhs.const_map(), &result.map(),
+                -75, -91, 74980, 123, 20);
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    const double time = real_time_in_seconds() - start_time;
+    std::cout << thread_count << " threads, " << size << "x" << size
+              << "x1 each, " << (coalesce ? "coalesced" : "separate") << " : "
+              << thread_count * gemms_per_thread / time << " Gemms/s";
+    if (coalesce) {
+      std::cout << " in " << coalescer.gemm_count() << " Gemms";
+    }
+    std::cout << std::endl;
+  }
+}
+
+void benchmark_smt_placement() {
+  // Throughput with a worker on each hardware thread, including SMT
+  // siblings sharing a physical core, and with one worker per physical
+  // core, pinned or not. Without SMT, these are all the same.
+  typedef Matrix<std::uint8_t, MapOrder::RowMajor> LhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> RhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> ResultType;
+  const HardwareConcurrencyInfo& concurrency = GetHardwareConcurrencyInfo();
+  const std::vector<gemm_t> gemms(1, gemm_t(1000, 1000, 1000));
+  struct Placement {
+    const char* name;
+    int threads;
+    AffinityPolicy affinity;
+  };
+  const Placement placements[] = {
+      {"all hardware threads", concurrency.logical_threads,
+       AffinityPolicy::None},
+      {"one per physical core", concurrency.threads, AffinityPolicy::None},
+      {"one per physical core, pinned", concurrency.threads,
+       AffinityPolicy::PhysicalCores}};
+  std::cout.precision(4);
+  for (const Placement& placement : placements) {
+    gemmlowp::GemmContext context;
+    context.set_max_num_threads(placement.threads);
+    context.set_affinity(placement.affinity);
+    double best_gflops = 0;
+    for (int r = 0; r < 3; r++) {
+      best_gflops = std::max(
+          best_gflops,
+          gflops_for_gemms<LhsType, RhsType, ResultType>(&context, gemms));
+    }
+    std::cout << "1000x1000x1000, " << placement.threads << " threads, "
+              << placement.name << " : " << best_gflops << " GFlops/s"
+              << std::endl;
+  }
+}
+
+void benchmark_hot_workers() {
+  // Latency of GoogLeNet forward passes, each a sequence of Gemms separated
+  // by copies of their RHS standing for im2col, with passes 10ms apart as
+  // for a stream of video frames. Idle workers learn from the intervals
+  // between passes to stop busy-waiting early, so they also fall asleep
+  // between the layers of a pass, unless a ScopedHotWorkers spans it.
+  typedef Matrix<std::uint8_t, MapOrder::RowMajor> LhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> RhsType;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> ResultType;
+  const std::vector<gemm_t> gemms = googlenet_gemms();
+  const int passes = 20;
+  std::vector<LhsType> lhs(gemms.size());
+  std::vector<RhsType> rhs(gemms.size());
+  std::vector<ResultType> result(gemms.size());
+  std::size_t max_rhs_size = 0;
+  for (std::size_t i = 0; i < gemms.size(); i++) {
+    lhs[i].Resize(gemms[i].rows, gemms[i].depth);
+    MakeConstant(&lhs[i], 0);
+    rhs[i].Resize(gemms[i].depth, gemms[i].cols);
+    result[i].Resize(gemms[i].rows, gemms[i].cols);
+    max_rhs_size = std::max<std::size_t>(max_rhs_size, rhs[i].size());
+  }
+  const std::vector<std::uint8_t> activations(max_rhs_size, 0);
+  std::cout.precision(4);
+  for (int hot = 0; hot < 2; hot++) {
+    gemmlowp::GemmContext context;
+    context.set_max_num_threads(0);
+    auto run_pass = [&]() {
+      for (std::size_t i = 0; i < gemms.size(); i++) {
+        std::copy(activations.begin(), activations.begin() + rhs[i].size(),
+                  rhs[i].data());
+        Gemm<std::uint8_t, GEMMLOWP_TEST_BIT_DEPTH_PARAMS>(
+            &context, lhs[i].const_map(), rhs[i].const_map(), &result[i].map(),
+            -75, -91, 74980, 123, 20);
+      }
+    };
+    std::vector<double> latencies;
+    for (int p = 0; p < passes; p++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      const double start_time = real_time_in_seconds();
+      if (hot) {
+        ScopedHotWorkers hot_workers(&context);
+        run_pass();
+      } else {
+        run_pass();
+      }
+      latencies.push_back(real_time_in_seconds() - start_time);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "GoogLeNet pass, " << gemms.size() << " Gemms, "
+              << (hot ? "hot workers" : "default") << " : p50 "
+              << 1e3 * latencies[latencies.size() / 2] << " ms, min "
+              << 1e3 * latencies[0] << " ms" << std::endl;
+  }
+}
+
 void benchmark_all() {
+  const HardwareConcurrencyInfo& concurrency = GetHardwareConcurrencyInfo();
+  std::cout << "Hardware concurrency: " << concurrency.threads
+            << " threads (" << concurrency.logical_threads
+            << " counting SMT siblings; " << concurrency.system_cpus
+            << " CPUs, " << concurrency.affinity_cpus
+            << " in affinity mask, " << concurrency.physical_cores
+            << " physical cores, cgroup quota "
+            << concurrency.cgroup_cpu_quota << " CPUs)" << std::endl;
+
   {
     gemmlowp::GemmContext context;
     std::cout << "Benchmarking small model GEMMs..." << std::endl;
@@ -347,6 +774,34 @@ void benchmark_all() {
     gemmlowp::benchmark_googlenet(&context);
   }
 
+  std::cout << "Benchmarking GEMV thread scaling..." << std::endl;
+  gemmlowp::benchmark_gemv_threads();
+
+  std::cout << "Benchmarking skinny GEMMs..." << std::endl;
+  gemmlowp::benchmark_skinny_gemm();
+
+  std::cout << "Benchmarking multi-threading dispatch overhead..."
+            << std::endl;
+  gemmlowp::benchmark_dispatch_overhead();
+
+  std::cout << "Benchmarking Gemms through a TaskExecutor..." << std::endl;
+  gemmlowp::benchmark_task_executor();
+
+  std::cout << "Benchmarking Gemm latency by priority under load..."
+            << std::endl;
+  gemmlowp::benchmark_priority_latency();
+
+  std::cout << "Benchmarking sequences of Gemms with hot workers..."
+            << std::endl;
+  gemmlowp::benchmark_hot_workers();
+
+  std::cout << "Benchmarking worker placement with SMT..." << std::endl;
+  gemmlowp::benchmark_smt_placement();
+
+  std::cout << "Benchmarking coalesced GEMVs sharing their LHS..."
+            << std::endl;
+  gemmlowp::benchmark_gemm_coalescer();
+
   {
     gemmlowp::GemmContext context;
     context.set_max_num_threads(0);
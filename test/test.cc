@@ -21,6 +21,7 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <thread>  // NOLINT
 #include <vector>
 #ifdef __APPLE__
 #include <TargetConditionals.h>
@@ -154,7 +155,10 @@ struct SingleThreadGemmWrapper {
   }
 };
 
-template <typename Kernel, typename Scalar, typename tBitDepthParams>
+// MaxNumThreads is the maximum number of threads to use, 0 meaning as many
+// as there are hardware threads.
+template <typename Kernel, typename Scalar, typename tBitDepthParams,
+          int MaxNumThreads = 0>
 struct MultiThreadGemmWrapper {
   typedef tBitDepthParams BitDepthParams;
 
@@ -174,7 +178,7 @@ struct MultiThreadGemmWrapper {
                    int rhs_offset, int result_offset, int result_mult_int,
                    int result_shift) {
     ScopedProfilingLabel("MultiThreadGemmWrapper::Gemm");
-    context->set_max_num_threads(0);
+    context->set_max_num_threads(MaxNumThreads);
     const int rows = lhs.rows();
     const int cols = rhs.cols();
     if (rows < cols) {
@@ -195,6 +199,116 @@ struct MultiThreadGemmWrapper {
   }
 };
 
+template <typename Scalar, typename tBitDepthParams>
+struct SingleThreadGemvWrapper {
+  typedef tBitDepthParams BitDepthParams;
+
+  static const char* Name() { return "SingleThreadGemv"; }
+
+  typedef SingleThreadGemmContext Context;
+
+  template <MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder>
+  static bool Gemm(Context* context,
+                   const MatrixMap<const Scalar, LhsOrder>& lhs,
+                   const MatrixMap<const Scalar, RhsOrder>& rhs,
+                   MatrixMap<Scalar, ResultOrder>* result, int lhs_offset,
+                   int rhs_offset, int result_offset, int result_mult_int,
+                   int result_shift) {
+    ScopedProfilingLabel("SingleThreadGemvWrapper::Gemm");
+    const int rows = lhs.rows();
+    const int cols = rhs.cols();
+    if (cols > kMaxGemvCols) {
+      // SingleThreadGemv is only called on vectors and skinny matrices.
+      return false;
+    }
+    const OffsetColDup lhs_offset_vector(lhs_offset, rows);
+    const OffsetRowDup rhs_offset_vector(rhs_offset, cols);
+    SingleThreadGemv<Scalar, Scalar, BitDepthParams, LhsOrder, RhsOrder,
+                     ResultOrder, OffsetColDup, OffsetRowDup>(
+        context, lhs, rhs, result, lhs_offset_vector, rhs_offset_vector,
+        MakeStandardOutputPipeline(result_offset, result_mult_int,
+                                   result_shift));
+    return true;
+  }
+};
+
+template <typename Scalar, typename tBitDepthParams>
+struct MultiThreadGemvWrapper {
+  typedef tBitDepthParams BitDepthParams;
+
+  static const char* Name() { return "MultiThreadGemv"; }
+
+  typedef MultiThreadGemmContext Context;
+
+  template <MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder>
+  static bool Gemm(Context* context,
+                   const MatrixMap<const Scalar, LhsOrder>& lhs,
+                   const MatrixMap<const Scalar, RhsOrder>& rhs,
+                   MatrixMap<Scalar, ResultOrder>* result, int lhs_offset,
+                   int rhs_offset, int result_offset, int result_mult_int,
+                   int result_shift) {
+    ScopedProfilingLabel("MultiThreadGemvWrapper::Gemm");
+    // Force multi-threading even on machines with few cores, and bypass
+    // the bandwidth measurement so that the row splitting gets exercised.
+    context->set_max_num_threads(4);
+    context->set_max_num_gemv_threads(4);
+    const int rows = lhs.rows();
+    const int cols = rhs.cols();
+    if (cols > kMaxGemvCols) {
+      // MultiThreadGemv is only called on vectors and skinny matrices.
+      return false;
+    }
+    const OffsetColDup lhs_offset_vector(lhs_offset, rows);
+    const OffsetRowDup rhs_offset_vector(rhs_offset, cols);
+    MultiThreadGemv<Scalar, Scalar, BitDepthParams, LhsOrder, RhsOrder,
+                    ResultOrder, OffsetColDup, OffsetRowDup>(
+        context, lhs, rhs, result, lhs_offset_vector, rhs_offset_vector,
+        MakeStandardOutputPipeline(result_offset, result_mult_int,
+                                   result_shift));
+    return true;
+  }
+};
+
+template <typename Kernel, typename Scalar, typename tBitDepthParams,
+          int MaxNumThreads = 0>
+struct PackedLhsGemmWrapper {
+  typedef tBitDepthParams BitDepthParams;
+
+  static const char* Name() {
+    static char buf[256];
+    snprintf(buf, sizeof(buf), "MultiThreadGemmWithPackedLhs, Kernel: %s",
+             Kernel().Name());
+    return buf;
+  }
+
+  typedef MultiThreadGemmContext Context;
+
+  template <MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder>
+  static bool Gemm(Context* context,
+                   const MatrixMap<const Scalar, LhsOrder>& lhs,
+                   const MatrixMap<const Scalar, RhsOrder>& rhs,
+                   MatrixMap<Scalar, ResultOrder>* result, int lhs_offset,
+                   int rhs_offset, int result_offset, int result_mult_int,
+                   int result_shift) {
+    ScopedProfilingLabel("PackedLhsGemmWrapper::Gemm");
+    context->set_max_num_threads(MaxNumThreads);
+    const int rows = lhs.rows();
+    const int cols = rhs.cols();
+    const PackedLhsMatrix<typename Kernel::Format> packed_lhs(
+        lhs, context->l1_bytes_to_use());
+    const OffsetColDup lhs_offset_vector(lhs_offset, rows);
+    const OffsetRowDup rhs_offset_vector(rhs_offset, cols);
+    MultiThreadGemmWithPackedLhs<typename Kernel::Format, Scalar, Scalar,
+                                 BitDepthParams, RhsOrder, ResultOrder,
+                                 OffsetColDup, OffsetRowDup>(
+        context, Kernel(), packed_lhs, rhs, result, lhs_offset_vector,
+        rhs_offset_vector,
+        MakeStandardOutputPipeline(result_offset, result_mult_int,
+                                   result_shift));
+    return true;
+  }
+};
+
 template <typename Scalar, typename tBitDepthParams>
 struct PublicGemmWrapper {
   typedef tBitDepthParams BitDepthParams;
@@ -219,6 +333,66 @@ struct PublicGemmWrapper {
   }
 };
 
+template <typename Scalar, typename tBitDepthParams>
+struct PublicGemmAsyncWrapper {
+  typedef tBitDepthParams BitDepthParams;
+
+  static const char* Name() { return "public GemmAsync"; }
+
+  typedef GemmContext Context;
+
+  template <MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder>
+  static bool Gemm(Context* context,
+                   const MatrixMap<const Scalar, LhsOrder>& lhs,
+                   const MatrixMap<const Scalar, RhsOrder>& rhs,
+                   MatrixMap<Scalar, ResultOrder>* result, int lhs_offset,
+                   int rhs_offset, int result_offset, int result_mult_int,
+                   int result_shift) {
+    ScopedProfilingLabel("PublicGemmAsyncWrapper::Gemm");
+    std::atomic<bool> completed(false);
+    GemmAsyncHandle handle = gemmlowp::GemmAsync<Scalar, BitDepthParams>(
+        context, lhs, rhs, result, lhs_offset, rhs_offset, result_offset,
+        result_mult_int, result_shift, [&completed]() { completed = true; });
+    // Alternate between polling and waiting, to exercise both.
+    if (lhs.rows() % 2) {
+      while (!handle.Poll()) {
+      }
+    } else {
+      handle.Wait();
+    }
+    Check(completed);
+    return true;
+  }
+};
+
+template <typename Scalar, typename tBitDepthParams>
+struct PublicPackedLhsGemmWrapper {
+  typedef tBitDepthParams BitDepthParams;
+
+  static const char* Name() { return "public Gemm with packed LHS"; }
+
+  typedef GemmContext Context;
+
+  template <MapOrder LhsOrder, MapOrder RhsOrder, MapOrder ResultOrder>
+  static bool Gemm(Context* context,
+                   const MatrixMap<const Scalar, LhsOrder>& lhs,
+                   const MatrixMap<const Scalar, RhsOrder>& rhs,
+                   MatrixMap<Scalar, ResultOrder>* result, int lhs_offset,
+                   int rhs_offset, int result_offset, int result_mult_int,
+                   int result_shift) {
+    ScopedProfilingLabel("PublicPackedLhsGemmWrapper::Gemm");
+    const DefaultPackedLhsMatrix<BitDepthParams> packed_lhs(
+        lhs, context->l1_bytes_to_use());
+    // Run twice to check that the packed LHS is reusable.
+    for (int i = 0; i < 2; i++) {
+      gemmlowp::Gemm<Scalar, BitDepthParams>(
+          context, packed_lhs, rhs, result, lhs_offset, rhs_offset,
+          result_offset, result_mult_int, result_shift);
+    }
+    return true;
+  }
+};
+
 template <eight_bit_int_gemm::BitDepthSetting BitDepth>
 struct BitDepthParamsForSettings {};
 
@@ -588,6 +762,27 @@ void test_gemm_kernel(MultiThreadGemmContext* context) {
                          WhatOrdersToTest::OnlyRCC);
 }
 
+template <typename Kernel>
+void test_gemm_kernel_with_packed_lhs(MultiThreadGemmContext* context) {
+  typedef PackedLhsGemmWrapper<Kernel, std::uint8_t, DefaultL8R8BitDepthParams>
+      GemmWrapper;
+  test_gemm<GemmWrapper>(context, 1, 1, 1, WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::OnlyRCC);
+  test_gemm<GemmWrapper>(context, 9, 11, 13, WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::OnlyRCC);
+  test_gemm<GemmWrapper>(context, 50, 50, 50, WhatParamsToTest::All,
+                         WhatOrdersToTest::OnlyRCC);
+  test_gemm<GemmWrapper>(context, 200, 200, 200,
+                         WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::All);
+  test_gemm<GemmWrapper>(context, 50, 5000, 50,
+                         WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::OnlyRCC);
+  test_gemm<GemmWrapper>(context, 13, 100, 300,
+                         WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::OnlyRCC);
+}
+
 template <typename GemmWrapper>
 void test_gemm(typename GemmWrapper::Context* context) {
   test_gemm<GemmWrapper>(context, 1, 1, 1, WhatParamsToTest::All,
@@ -707,6 +902,10 @@ void test_gemv(typename GemmWrapper::Context* context) {
   test_gemm<GemmWrapper>(context, 321, 123, 1, WhatParamsToTest::All,
                          WhatOrdersToTest::OnlyRCC);
 
+  test_gemm<GemmWrapper>(context, 1031, 517, 1,
+                         WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::All);
+
   // Test all storage orders
   test_gemm<GemmWrapper>(context, 70, 90, 1, WhatParamsToTest::All,
                          WhatOrdersToTest::All);
@@ -715,6 +914,24 @@ void test_gemv(typename GemmWrapper::Context* context) {
                          WhatOrdersToTest::All);
 }
 
+// Skinny GEMMs, with only a few RHS columns as in micro-batched inference.
+template <typename GemmWrapper>
+void test_skinny_gemm(typename GemmWrapper::Context* context) {
+  for (int cols = 2; cols <= 9; cols++) {
+    test_gemm<GemmWrapper>(context, 17, 19, cols, WhatParamsToTest::All,
+                           WhatOrdersToTest::OnlyRCC);
+    test_gemm<GemmWrapper>(context, 100, 100, cols,
+                           WhatParamsToTest::OnlyGenericCase,
+                           WhatOrdersToTest::All);
+  }
+  test_gemm<GemmWrapper>(context, 1031, 517, 3,
+                         WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::All);
+  test_gemm<GemmWrapper>(context, 1031, 517, 8,
+                         WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::All);
+}
+
 const char* GetBitDepthName(eight_bit_int_gemm::BitDepthSetting b) {
   switch (b) {
     case eight_bit_int_gemm::BitDepthSetting::A8B8:
@@ -1197,6 +1414,52 @@ void TestWithRealData(eight_bit_int_gemm::BitDepthSetting BitDepth,
   Check(good);
 }
 
+// Tests OutputStageScaleInt32ByFixedPointAndExponentPC of the given shape,
+// with a multiplier and an exponent varying from one row, or column, to
+// the next, against the int32 accumulators of the same Gemm.
+template <VectorShape Shape, typename LhsType, typename RhsType,
+          typename RawResultType>
+void TestScaleInt32ByFixedPointAndExponentPC(
+    GemmContext* context, const LhsType& lhs, const RhsType& rhs,
+    int lhs_offset, int rhs_offset, const RawResultType& result_raw_int32,
+    std::int32_t result_fixedpoint_multiplier) {
+  const int rows = result_raw_int32.rows();
+  const int cols = result_raw_int32.cols();
+  const int size = Shape == VectorShape::Col ? rows : cols;
+  std::vector<std::int32_t> multipliers(size);
+  std::vector<std::int32_t> exponents(size);
+  for (int i = 0; i < size; i++) {
+    multipliers[i] = result_fixedpoint_multiplier - 1000 * (i % 7);
+    exponents[i] = i % 5 - 2;
+  }
+  const VectorMap<const std::int32_t, Shape> multipliers_map(
+      multipliers.data(), size);
+  const VectorMap<const std::int32_t, Shape> exponents_map(exponents.data(),
+                                                           size);
+  const OutputStageScaleInt32ByFixedPointAndExponentPC<Shape> scale_stage{
+      multipliers_map, exponents_map, 17};
+  Matrix<std::int32_t, RawResultType::kOrder> result(rows, cols);
+  GemmWithOutputPipeline<std::uint8_t, std::int32_t,
+                         DefaultL8R8BitDepthParams>(
+      context, lhs.const_map(), rhs.const_map(), &result, lhs_offset,
+      rhs_offset, std::make_tuple(scale_stage));
+
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < cols; c++) {
+      const int i = Shape == VectorShape::Col ? r : c;
+      const int left_shift = std::max(0, exponents[i]);
+      const int right_shift = std::max(0, -exponents[i]);
+      const std::int32_t expected =
+          scale_stage.result_offset_after_shift +
+          RoundingDivideByPOT(
+              SaturatingRoundingDoublingHighMul(
+                  (1 << left_shift) * result_raw_int32(r, c), multipliers[i]),
+              right_shift);
+      Check(result(r, c) == expected);
+    }
+  }
+}
+
 template <typename BitDepthParams, MapOrder ResultOrder>
 void TestOutputStages(int rows, int depth, int cols, int result_offset,
                       int result_mult_int, int result_shift) {
@@ -1540,6 +1803,15 @@ void TestOutputStages(int rows, int depth, int cols, int result_offset,
     }
   }
 
+  // Test OutputStageScaleInt32ByFixedPointAndExponentPC, per row and per
+  // column.
+  TestScaleInt32ByFixedPointAndExponentPC<VectorShape::Col>(
+      &context, lhs, rhs, lhs_offset, rhs_offset, result_raw_int32,
+      result_fixedpoint_multiplier);
+  TestScaleInt32ByFixedPointAndExponentPC<VectorShape::Row>(
+      &context, lhs, rhs, lhs_offset, rhs_offset, result_raw_int32,
+      result_fixedpoint_multiplier);
+
   // Test the variant of the familiar default pipeline consisting of
   // quantize-down and
   // clamp-and-cast-to-uint8, where we used fixedpoint multipliers for the
@@ -1592,8 +1864,25 @@ void TestExhaustively() {
       MultiThreadGemmWrapper<DefaultKernel<BitDepthParams>,
                              std::uint8_t, BitDepthParams>>(&context);
 
+  test_gemv<SingleThreadGemvWrapper<std::uint8_t, BitDepthParams>>(&context);
+
+  test_gemv<MultiThreadGemvWrapper<std::uint8_t, BitDepthParams>>(&context);
+
   // Test GEMV cases (public interfaces)
   test_gemv<PublicGemmWrapper<std::uint8_t, BitDepthParams>>(&context);
+
+  // Test skinny GEMM cases
+  test_skinny_gemm<SingleThreadGemvWrapper<std::uint8_t, BitDepthParams>>(
+      &context);
+  test_skinny_gemm<MultiThreadGemvWrapper<std::uint8_t, BitDepthParams>>(
+      &context);
+  test_skinny_gemm<PublicGemmWrapper<std::uint8_t, BitDepthParams>>(&context);
+
+  // Test the public GEMM interfaces taking a pre-packed LHS
+  test_gemm<PublicPackedLhsGemmWrapper<std::uint8_t, BitDepthParams>>(
+      &context);
+  test_gemv<PublicPackedLhsGemmWrapper<std::uint8_t, BitDepthParams>>(
+      &context);
 }
 
 template <eight_bit_int_gemm::BitDepthSetting BitDepthSetting>
@@ -1604,6 +1893,94 @@ void TestExhaustivelyEightBitIntGemm() {
   test_gemm<EightBitIntGemmWrapper<std::uint8_t, BitDepthSetting>>(&context);
 }
 
+// Checks the GEMV kernel selected for this platform against the reference
+// GEMV kernel, on a range of rows of a random LHS, so as to exercise all the
+// unaligned boundaries.
+template <typename InputScalar, MapOrder LhsOrder, int Cols>
+void test_gemv_kernel(int rows, int depth, int start_row) {
+  Matrix<InputScalar, LhsOrder> lhs(start_row + rows, depth);
+  for (int c = 0; c < depth; c++) {
+    for (int r = 0; r < start_row + rows; r++) {
+      lhs(r, c) = static_cast<InputScalar>(Random());
+    }
+  }
+  // The kernels expect the RHS to be aligned as the Allocator aligns it.
+  const int rhs_stride = GemvRhsStride(depth);
+  std::vector<std::int16_t> rhs_storage(Cols * rhs_stride +
+                                        kDefaultCacheLineSize);
+  std::int16_t* rhs = rhs_storage.data();
+  while (reinterpret_cast<std::uintptr_t>(rhs) % kDefaultCacheLineSize) {
+    rhs++;
+  }
+  for (int c = 0; c < Cols; c++) {
+    for (int d = 0; d < rhs_stride; d++) {
+      rhs[c * rhs_stride + d] = d < depth ? Random() % 512 - 256 : 0;
+    }
+  }
+  std::vector<std::int32_t> expected(rows * Cols);
+  std::vector<std::int32_t> actual(rows * Cols);
+  ReferenceGemvKernel<InputScalar, LhsOrder, Cols>::Run(
+      lhs.const_map(), rhs, rhs_stride, start_row, rows, expected.data(),
+      rows);
+  GemvKernel<InputScalar, LhsOrder, Cols>::Run(lhs.const_map(), rhs,
+                                               rhs_stride, start_row, rows,
+                                               actual.data(), rows);
+  Check(expected == actual);
+}
+
+template <int Cols>
+void TestGemvKernelsWithCols() {
+  const int kSizes[] = {1, 2, 3, 4, 5, 15, 16, 17, 31, 32, 33, 63, 100};
+  for (int rows : kSizes) {
+    for (int depth : kSizes) {
+      for (int start_row : {0, 3}) {
+        test_gemv_kernel<std::uint8_t, MapOrder::RowMajor, Cols>(rows, depth,
+                                                                 start_row);
+        test_gemv_kernel<std::uint8_t, MapOrder::ColMajor, Cols>(rows, depth,
+                                                                 start_row);
+        test_gemv_kernel<std::int8_t, MapOrder::RowMajor, Cols>(rows, depth,
+                                                                start_row);
+        test_gemv_kernel<std::int8_t, MapOrder::ColMajor, Cols>(rows, depth,
+                                                                start_row);
+      }
+    }
+  }
+}
+
+void TestGemvKernels() {
+  static_assert(kMaxGemvCols == 8, "update the list below");
+  TestGemvKernelsWithCols<1>();
+  TestGemvKernelsWithCols<2>();
+  TestGemvKernelsWithCols<3>();
+  TestGemvKernelsWithCols<4>();
+  TestGemvKernelsWithCols<5>();
+  TestGemvKernelsWithCols<6>();
+  TestGemvKernelsWithCols<7>();
+  TestGemvKernelsWithCols<8>();
+}
+
+void TestGemvBandwidthMeasurement() {
+  MultiThreadGemmContext context;
+  const int thread_count =
+      MeasureGemvBandwidthThreads(context.workers_pool(), 4);
+  Check(thread_count >= 1 && thread_count <= 4);
+
+  // Without calibration, GEMVs don't measure anything, and use the default
+  // ceiling.
+  context.set_max_num_threads(16);
+  Check(HowManyGemvThreads(&context, 4096, 4096, 1) ==
+        kDefaultMaxGemvThreads);
+  Check(context.max_num_gemv_threads() == 0);
+  CalibrateGemvThreads(&context);
+  Check(context.max_num_gemv_threads() >= 1 &&
+        context.max_num_gemv_threads() <= 16);
+  Check(HowManyGemvThreads(&context, 4096, 4096, 1) ==
+        context.max_num_gemv_threads());
+  // Changing the maximum number of threads drops the calibration.
+  context.set_max_num_threads(2);
+  Check(context.max_num_gemv_threads() == 0);
+}
+
 void TestKernels() {
   GemmContext context;
 
@@ -1647,6 +2024,495 @@ void TestKernels() {
   test_gemm_kernel<ReferenceKernel<KernelFormat<
       KernelSideFormat<CellFormat<1, 4, CellOrder::DepthMajor>, 1>,
       KernelSideFormat<CellFormat<4, 4, CellOrder::Diagonal>, 1>>>>(&context);
+
+  // Test the pre-packed LHS paths with a few formats, exercising blocks of
+  // the packed LHS starting at various rows.
+  test_gemm_kernel_with_packed_lhs<
+      ReferenceKernel<KernelFormat<KernelSideFormat<CellFormat<4, 2>, 4>,
+                                   KernelSideFormat<CellFormat<4, 2>, 5>>>>(
+      &context);
+
+  test_gemm_kernel_with_packed_lhs<ReferenceKernel<KernelFormat<
+      KernelSideFormat<CellFormat<5, 2, CellOrder::DepthMajor>, 3>,
+      KernelSideFormat<CellFormat<4, 2, CellOrder::WidthMajor>, 2>>>>(
+      &context);
+}
+
+// Exercises the task grids of the multi-threaded Gemm paths, even on
+// machines with few cores, by forcing several threads, and with small L2
+// blocks so that Gemms span several blocks of the packed RHS, and tasks
+// several blocks of the packed LHS.
+template <typename GemmWrapper>
+void test_gemm_task_grid(MultiThreadGemmContext* context) {
+  // Too few rows for all threads: columns are split too.
+  test_gemm<GemmWrapper>(context, 40, 200, 40, WhatParamsToTest::All,
+                         WhatOrdersToTest::OnlyRCC);
+  test_gemm<GemmWrapper>(context, 70, 90, 50, WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::All);
+  // More tasks than threads, each spanning several L2 blocks.
+  test_gemm<GemmWrapper>(context, 200, 300, 150,
+                         WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::All);
+  test_gemm<GemmWrapper>(context, 1000, 100, 30,
+                         WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::OnlyRCC);
+  // Large enough RHS for its packing to be split across threads, with
+  // columns that are not a multiple of the kernel width.
+  test_gemm<GemmWrapper>(context, 300, 400, 253,
+                         WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::All);
+}
+
+void TestMultiThreadGemmTaskGrids() {
+  typedef DefaultL8R8BitDepthParams BitDepthParams;
+  MultiThreadGemmContext context;
+  context.set_l2_bytes_to_use(8 * 1024);
+  context.set_l2_rhs_factor(0.75f);
+  test_gemm_task_grid<
+      MultiThreadGemmWrapper<DefaultKernel<BitDepthParams>, std::uint8_t,
+                             BitDepthParams, 4>>(&context);
+  test_gemm_task_grid<
+      PackedLhsGemmWrapper<DefaultKernel<BitDepthParams>, std::uint8_t,
+                           BitDepthParams, 4>>(&context);
+}
+
+// Same as TestMultiThreadGemmTaskGrids, with RHS packing pipelined with
+// compute: the small L2 blocks make most of these span several blocks of
+// RHS columns, alternating between the two packed RHS buffers.
+void TestMultiThreadGemmPipelinedRhsPacking() {
+  typedef DefaultL8R8BitDepthParams BitDepthParams;
+  MultiThreadGemmContext context;
+  context.set_l2_bytes_to_use(8 * 1024);
+  context.set_l2_rhs_factor(0.75f);
+  context.set_pipeline_rhs_packing(true);
+  test_gemm_task_grid<
+      MultiThreadGemmWrapper<DefaultKernel<BitDepthParams>, std::uint8_t,
+                             BitDepthParams, 4>>(&context);
+  test_gemm_task_grid<
+      PackedLhsGemmWrapper<DefaultKernel<BitDepthParams>, std::uint8_t,
+                           BitDepthParams, 4>>(&context);
+}
+
+// Exercises split-depth Gemms: too few rows and columns for the result to be
+// split across all threads, but deep enough for the depth to be split.
+template <typename BitDepthParams>
+void TestMultiThreadGemmSplitDepth() {
+  typedef MultiThreadGemmWrapper<DefaultKernel<BitDepthParams>, std::uint8_t,
+                                 BitDepthParams, 4>
+      GemmWrapper;
+  MultiThreadGemmContext context;
+  test_gemm<GemmWrapper>(&context, 16, 16384, 16, WhatParamsToTest::All,
+                         WhatOrdersToTest::OnlyRCC);
+  test_gemm<GemmWrapper>(&context, 40, 4001, 10,
+                         WhatParamsToTest::OnlyGenericCase,
+                         WhatOrdersToTest::All);
+  test_gemm<GemmWrapper>(&context, 5, 3000, 3, WhatParamsToTest::All,
+                         WhatOrdersToTest::OnlyRCC);
+}
+
+// Runs multi-threaded Gemms through a context whose tasks run on a
+// SharedWorkersPool, with fewer workers than the threads asked for.
+void TestSharedWorkersPoolGemm() {
+  typedef DefaultL8R8BitDepthParams BitDepthParams;
+  SharedWorkersPool shared_pool(2);
+  MultiThreadGemmContext context;
+  context.set_l2_bytes_to_use(8 * 1024);
+  context.set_shared_workers_pool(&shared_pool);
+  test_gemm_task_grid<
+      MultiThreadGemmWrapper<DefaultKernel<BitDepthParams>, std::uint8_t,
+                             BitDepthParams, 4>>(&context);
+}
+
+// Runs multi-threaded Gemms while the context's workers are kept hot, and
+// checks that they are released afterwards.
+void TestHotWorkersGemm() {
+  typedef DefaultL8R8BitDepthParams BitDepthParams;
+  MultiThreadGemmContext context;
+  context.set_l2_bytes_to_use(8 * 1024);
+  {
+    ScopedHotWorkers hot_workers(&context);
+    Check(context.workers_pool()->busy_wait_budget().hot());
+    test_gemm_task_grid<
+        MultiThreadGemmWrapper<DefaultKernel<BitDepthParams>, std::uint8_t,
+                               BitDepthParams, 2>>(&context);
+  }
+  Check(!context.workers_pool()->busy_wait_budget().hot());
+}
+
+// Runs multi-threaded Gemms through a context whose tasks run through a
+// ScheduleTaskExecutor, on threads that it doesn't own.
+void TestTaskExecutorGemm() {
+  typedef DefaultL8R8BitDepthParams BitDepthParams;
+  std::vector<std::thread> threads;
+  ScheduleTaskExecutor executor(
+      [&threads](std::function<void()> f) { threads.emplace_back(f); });
+  {
+    MultiThreadGemmContext context;
+    context.set_l2_bytes_to_use(8 * 1024);
+    context.set_task_executor(&executor);
+    test_gemm_task_grid<
+        MultiThreadGemmWrapper<DefaultKernel<BitDepthParams>, std::uint8_t,
+                               BitDepthParams, 4>>(&context);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// Runs batches of Gemms of various shapes, including some that get
+// transposed or take the GEMV path, and checks that each result matches
+// that of a standalone Gemm.
+void TestGemmBatch() {
+  typedef DefaultL8R8BitDepthParams BitDepthParams;
+  typedef GemmBatchEntry<std::uint8_t, std::uint8_t, MapOrder::RowMajor,
+                         MapOrder::ColMajor, MapOrder::ColMajor>
+      EntryType;
+  const int lhs_offset = -75;
+  const int rhs_offset = -91;
+  const auto output_pipeline = MakeStandardOutputPipeline(74980, 123, 20);
+  const int sizes[][3] = {{64, 64, 64}, {1, 1, 1},    {17, 40, 3},
+                          {5, 30, 50},  {100, 70, 31}, {64, 64, 64},
+                          {33, 8, 90},  {64, 200, 64}, {7, 7, 7}};
+  const int count = sizeof(sizes) / sizeof(sizes[0]);
+  std::vector<Matrix<std::uint8_t, MapOrder::RowMajor>> lhs(count);
+  std::vector<Matrix<std::uint8_t, MapOrder::ColMajor>> rhs(count);
+  std::vector<Matrix<std::uint8_t, MapOrder::ColMajor>> result(count);
+  std::vector<Matrix<std::uint8_t, MapOrder::ColMajor>> expected(count);
+  std::vector<EntryType> batch;
+  batch.reserve(count);
+  GemmContext context;
+  for (int i = 0; i < count; i++) {
+    lhs[i].Resize(sizes[i][0], sizes[i][1]);
+    rhs[i].Resize(sizes[i][1], sizes[i][2]);
+    result[i].Resize(sizes[i][0], sizes[i][2]);
+    expected[i].Resize(sizes[i][0], sizes[i][2]);
+    MakeRandom<BitDepthParams::LhsRange>(&lhs[i]);
+    MakeRandom<BitDepthParams::RhsRange>(&rhs[i]);
+    GemmWithOutputPipeline<std::uint8_t, std::uint8_t, BitDepthParams>(
+        &context, lhs[i].const_map(), rhs[i].const_map(), &expected[i],
+        lhs_offset, rhs_offset, output_pipeline);
+    batch.emplace_back(lhs[i].const_map(), rhs[i].const_map(), result[i]);
+  }
+  for (int max_num_threads : {1, 4}) {
+    context.set_max_num_threads(max_num_threads);
+    for (int i = 0; i < count; i++) {
+      MakeZero(&result[i]);
+    }
+    GemmWithOutputPipelineBatch<std::uint8_t, std::uint8_t, BitDepthParams>(
+        &context, batch, lhs_offset, rhs_offset, output_pipeline);
+    for (int i = 0; i < count; i++) {
+      Check(result[i] == expected[i]);
+    }
+  }
+
+  // A strided batch, taking the first 64x64x64 Gemm 4 times, from matrices
+  // at regular intervals in larger buffers.
+  const int batch_size = 4;
+  const int size = 64;
+  const int gap = 16;
+  const int lhs_batch_stride = size * size + gap;
+  std::vector<std::uint8_t> lhs_buffer(batch_size * lhs_batch_stride);
+  std::vector<std::uint8_t> rhs_buffer(batch_size * size * size);
+  std::vector<std::uint8_t> result_buffer(batch_size * size * size);
+  for (int b = 0; b < batch_size; b++) {
+    std::memcpy(&lhs_buffer[b * lhs_batch_stride], lhs[0].data(), size * size);
+    std::memcpy(&rhs_buffer[b * size * size], rhs[0].data(), size * size);
+  }
+  MatrixMap<const std::uint8_t, MapOrder::RowMajor> strided_lhs(
+      lhs_buffer.data(), size, size);
+  MatrixMap<const std::uint8_t, MapOrder::ColMajor> strided_rhs(
+      rhs_buffer.data(), size, size);
+  MatrixMap<std::uint8_t, MapOrder::ColMajor> strided_result(
+      result_buffer.data(), size, size);
+  GemmWithOutputPipelineStridedBatch<std::uint8_t, std::uint8_t,
+                                     BitDepthParams>(
+      &context, batch_size, strided_lhs, lhs_batch_stride, strided_rhs,
+      size * size, &strided_result, size * size, lhs_offset, rhs_offset,
+      output_pipeline);
+  for (int b = 0; b < batch_size; b++) {
+    Check(!std::memcmp(&result_buffer[b * size * size], expected[0].data(),
+                       size * size));
+  }
+}
+
+// Calibrates a cost model, checks the thread counts that it chooses, and
+// that it survives serialization.
+void TestGemmCostModel() {
+  MultiThreadGemmContext context;
+  context.set_max_num_threads(4);
+  CalibrateGemmCostModel(&context);
+  const GemmCostModel& cost_model = context.gemm_cost_model();
+  Check(cost_model.calibrated());
+
+  // Thread counts never decrease with the amount of work.
+  int previous_thread_count = 1;
+  for (int size = 1; size <= 4096; size *= 2) {
+    const int thread_count =
+        HowManyThreads<12, 4>(4, cost_model, size, size, size);
+    Check(thread_count >= previous_thread_count && thread_count <= 4);
+    previous_thread_count = thread_count;
+  }
+  Check((HowManyThreads<12, 4>(4, cost_model, 1, 1, 1) == 1));
+
+  GemmCostModel reloaded;
+  Check(ParseGemmCostModel(SerializeGemmCostModel(cost_model), &reloaded));
+  Check(std::abs(reloaded.thread_overhead_seconds -
+                 cost_model.thread_overhead_seconds) <=
+        1e-6 * cost_model.thread_overhead_seconds);
+  Check(std::abs(reloaded.multiply_adds_per_second -
+                 cost_model.multiply_adds_per_second) <=
+        1e-6 * cost_model.multiply_adds_per_second);
+  Check(!ParseGemmCostModel("gemmlowp_cost_model_v1 0 1e9", &reloaded));
+  Check(!ParseGemmCostModel("gemmlowp_cost_model_v0 1e-6 1e9", &reloaded));
+  Check(!ParseGemmCostModel("gemmlowp_cost_model_v1 1e-6 1e9 x", &reloaded));
+
+  typedef DefaultL8R8BitDepthParams BitDepthParams;
+  test_gemm_task_grid<
+      MultiThreadGemmWrapper<DefaultKernel<BitDepthParams>, std::uint8_t,
+                             BitDepthParams, 4>>(&context);
+}
+
+// Runs Gemms asynchronously, on a context's own workers and on a
+// SharedWorkersPool, single-threaded and multi-threaded.
+void TestGemmAsync() {
+  typedef PublicGemmAsyncWrapper<std::uint8_t, DefaultL8R8BitDepthParams>
+      GemmWrapper;
+  SharedWorkersPool shared_pool(2);
+  for (int shared = 0; shared < 2; shared++) {
+    for (int max_num_threads : {1, 4}) {
+      GemmContext context;
+      context.set_max_num_threads(max_num_threads);
+      if (shared) {
+        context.set_shared_workers_pool(&shared_pool);
+      }
+      test_gemm<GemmWrapper>(&context, 1, 1, 1, WhatParamsToTest::All,
+                             WhatOrdersToTest::OnlyRCC);
+      test_gemm<GemmWrapper>(&context, 31, 100, 7,
+                             WhatParamsToTest::OnlyGenericCase,
+                             WhatOrdersToTest::All);
+      test_gemm<GemmWrapper>(&context, 300, 200, 150,
+                             WhatParamsToTest::OnlyGenericCase,
+                             WhatOrdersToTest::OnlyRCC);
+    }
+  }
+}
+
+// A TaskExecutor running loops serially, which cancels a Gemm once it has
+// run its first loop, i.e. once the RHS has been packed.
+struct CancellingExecutor : TaskExecutor {
+  explicit CancellingExecutor(GemmCancellation* _cancellation)
+      : cancellation(_cancellation), loops(0) {}
+
+  void ParallelFor(int count, ParallelForBody* body) override {
+    for (int i = 0; i < count; i++) {
+      body->Run(i);
+    }
+    if (++loops == 1) {
+      cancellation->Cancel();
+    }
+  }
+
+  GemmCancellation* cancellation;
+  int loops;
+};
+
+// Checks that cancelled Gemms leave their result untouched when cancelled
+// before computing anything, and that the context remains usable.
+void TestGemmCancellation() {
+  typedef DefaultL8R8BitDepthParams BitDepthParams;
+  typedef DefaultKernel<BitDepthParams> Kernel;
+  const int lhs_offset = -75;
+  const int rhs_offset = -91;
+  const auto output_pipeline = MakeStandardOutputPipeline(74980, 123, 20);
+  const std::uint8_t untouched = 7;
+  const int sizes[][3] = {{300, 200, 150}, {16, 16384, 16}, {100, 50, 2}};
+  for (const auto& size : sizes) {
+    Matrix<std::uint8_t, MapOrder::RowMajor> lhs(size[0], size[1]);
+    Matrix<std::uint8_t, MapOrder::ColMajor> rhs(size[1], size[2]);
+    Matrix<std::uint8_t, MapOrder::ColMajor> result(size[0], size[2]);
+    Matrix<std::uint8_t, MapOrder::ColMajor> expected(size[0], size[2]);
+    Matrix<std::uint8_t, MapOrder::ColMajor> marker(size[0], size[2]);
+    MakeRandom<BitDepthParams::LhsRange>(&lhs);
+    MakeRandom<BitDepthParams::RhsRange>(&rhs);
+    MakeConstant(&marker, untouched);
+    for (int max_num_threads : {1, 4}) {
+      GemmContext context;
+      context.set_max_num_threads(max_num_threads);
+      context.set_l2_bytes_to_use(8 * 1024);
+      GemmWithOutputPipeline<std::uint8_t, std::uint8_t, BitDepthParams>(
+          &context, lhs.const_map(), rhs.const_map(), &expected, lhs_offset,
+          rhs_offset, output_pipeline);
+
+      GemmCancellation cancellation;
+      context.set_cancellation(&cancellation);
+      cancellation.Cancel();
+      MakeConstant(&result, untouched);
+      GemmWithOutputPipeline<std::uint8_t, std::uint8_t, BitDepthParams>(
+          &context, lhs.const_map(), rhs.const_map(), &result, lhs_offset,
+          rhs_offset, output_pipeline);
+      Check(result == marker);
+
+      cancellation.Reset();
+      cancellation.set_deadline(GemmCancellation::Clock::now() -
+                                std::chrono::milliseconds(1));
+      GemmWithOutputPipeline<std::uint8_t, std::uint8_t, BitDepthParams>(
+          &context, lhs.const_map(), rhs.const_map(), &result, lhs_offset,
+          rhs_offset, output_pipeline);
+      Check(result == marker);
+
+      cancellation.Reset();
+      cancellation.set_deadline(GemmCancellation::Clock::now() +
+                                std::chrono::hours(1));
+      GemmWithOutputPipeline<std::uint8_t, std::uint8_t, BitDepthParams>(
+          &context, lhs.const_map(), rhs.const_map(), &result, lhs_offset,
+          rhs_offset, output_pipeline);
+      Check(result == expected);
+    }
+  }
+
+  // Cancelled inside SingleThreadGemm itself, bypassing the check made
+  // before dispatching.
+  {
+    typedef VectorDup<const std::int32_t, VectorShape::Col> OffsetColDup;
+    typedef VectorDup<const std::int32_t, VectorShape::Row> OffsetRowDup;
+    const int rows = 100;
+    const int depth = 80;
+    const int cols = 60;
+    Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+    Matrix<std::uint8_t, MapOrder::ColMajor> rhs(depth, cols);
+    Matrix<std::int32_t, MapOrder::ColMajor> result(rows, cols);
+    Matrix<std::int32_t, MapOrder::ColMajor> marker(rows, cols);
+    MakeRandom<BitDepthParams::LhsRange>(&lhs);
+    MakeRandom<BitDepthParams::RhsRange>(&rhs);
+    MakeConstant(&result, untouched);
+    MakeConstant(&marker, untouched);
+    SingleThreadGemmContext context;
+    GemmCancellation cancellation;
+    cancellation.Cancel();
+    context.set_cancellation(&cancellation);
+    SingleThreadGemm<Kernel::Format, std::uint8_t, std::int32_t,
+                     BitDepthParams>(
+        &context, Kernel(), lhs.const_map(), rhs.const_map(), &result,
+        OffsetColDup(lhs_offset, rows), OffsetRowDup(rhs_offset, cols),
+        std::make_tuple());
+    Check(result == marker);
+  }
+
+  // Cancelled while running, after packing the RHS: the tasks computing
+  // the result must all give up, and the next Gemm must still work. The
+  // RHS fits in one L2 block, large enough for its packing to be split
+  // across threads.
+  {
+    Matrix<std::uint8_t, MapOrder::RowMajor> lhs(300, 400);
+    Matrix<std::uint8_t, MapOrder::ColMajor> rhs(400, 200);
+    Matrix<std::uint8_t, MapOrder::ColMajor> result(300, 200);
+    Matrix<std::uint8_t, MapOrder::ColMajor> expected(300, 200);
+    Matrix<std::uint8_t, MapOrder::ColMajor> marker(300, 200);
+    MakeRandom<BitDepthParams::LhsRange>(&lhs);
+    MakeRandom<BitDepthParams::RhsRange>(&rhs);
+    MakeConstant(&result, untouched);
+    MakeConstant(&marker, untouched);
+    GemmCancellation cancellation;
+    CancellingExecutor executor(&cancellation);
+    GemmContext context;
+    context.set_max_num_threads(4);
+    context.set_task_executor(&executor);
+    context.set_cancellation(&cancellation);
+    GemmWithOutputPipeline<std::uint8_t, std::uint8_t, BitDepthParams>(
+        &context, lhs.const_map(), rhs.const_map(), &result, lhs_offset,
+        rhs_offset, output_pipeline);
+    Check(executor.loops == 2);
+    Check(result == marker);
+
+    cancellation.Reset();
+    GemmWithOutputPipeline<std::uint8_t, std::uint8_t, BitDepthParams>(
+        &context, lhs.const_map(), rhs.const_map(), &result, lhs_offset,
+        rhs_offset, output_pipeline);
+    context.set_cancellation(nullptr);
+    GemmWithOutputPipeline<std::uint8_t, std::uint8_t, BitDepthParams>(
+        &context, lhs.const_map(), rhs.const_map(), &expected, lhs_offset,
+        rhs_offset, output_pipeline);
+    Check(result == expected);
+  }
+}
+
+// Submits Gemms with the same LHS from several threads to a GemmCoalescer,
+// and checks each result against that of a standalone Gemm. Batches are
+// only run once full, so that all of them are coalesced into one Gemm.
+void TestGemmCoalescer() {
+  typedef DefaultL8R8BitDepthParams BitDepthParams;
+  typedef Matrix<std::uint8_t, MapOrder::ColMajor> ColMajorMatrix;
+  const int lhs_offset = -75;
+  const int sizes[][2] = {{200, 300}, {10, 64}};
+  const int request_cols[] = {1, 2, 1, 3, 1, 4};
+  const int request_count = sizeof(request_cols) / sizeof(request_cols[0]);
+  const int total_cols = 12;
+  for (const auto& size : sizes) {
+    const int rows = size[0];
+    const int depth = size[1];
+    Matrix<std::uint8_t, MapOrder::RowMajor> lhs(rows, depth);
+    MakeRandom<BitDepthParams::LhsRange>(&lhs);
+    std::vector<ColMajorMatrix> rhs(request_count);
+    std::vector<ColMajorMatrix> result(request_count);
+    std::vector<ColMajorMatrix> expected(request_count);
+    std::vector<CoalescedGemmParams> params(request_count);
+    GemmContext reference_context;
+    for (int i = 0; i < request_count; i++) {
+      rhs[i].Resize(depth, request_cols[i]);
+      result[i].Resize(rows, request_cols[i]);
+      expected[i].Resize(rows, request_cols[i]);
+      MakeRandom<BitDepthParams::RhsRange>(&rhs[i]);
+      params[i].rhs_offset = -91 + i;
+      params[i].result_fixedpoint_multiplier = 1500000000 - i * 10000000;
+      params[i].result_exponent = -12 - i % 3;
+      params[i].result_offset_after_shift = 10 * i;
+      OutputStageScaleInt32ByFixedPointAndExponent scale_stage;
+      scale_stage.result_fixedpoint_multiplier =
+          params[i].result_fixedpoint_multiplier;
+      scale_stage.result_exponent = params[i].result_exponent;
+      scale_stage.result_offset_after_shift =
+          params[i].result_offset_after_shift;
+      GemmWithOutputPipeline<std::uint8_t, std::uint8_t, BitDepthParams>(
+          &reference_context, lhs.const_map(), rhs[i].const_map(),
+          &expected[i], lhs_offset, params[i].rhs_offset,
+          std::make_tuple(scale_stage, OutputStageSaturatingCastToUint8()));
+    }
+
+    for (int max_num_threads : {1, 4}) {
+      GemmContext context;
+      context.set_max_num_threads(max_num_threads);
+      GemmCoalescer<BitDepthParams, MapOrder::RowMajor, GemmContext>
+          coalescer(&context, lhs.const_map(), lhs_offset,
+                    std::chrono::hours(1), total_cols);
+      std::vector<std::thread> threads;
+      for (int i = 0; i < request_count; i++) {
+        MakeZero(&result[i]);
+        threads.emplace_back([&, i]() {
+          coalescer.Gemm(rhs[i].const_map(), &result[i].map(), params[i]);
+        });
+      }
+      for (auto& thread : threads) {
+        thread.join();
+      }
+      Check(coalescer.gemm_count() == 1);
+      Check(coalescer.request_count() == request_count);
+      for (int i = 0; i < request_count; i++) {
+        Check(result[i] == expected[i]);
+      }
+    }
+
+    // A lone Gemm runs once its window has passed.
+    GemmContext context;
+    GemmCoalescer<BitDepthParams, MapOrder::RowMajor, GemmContext> coalescer(
+        &context, lhs.const_map(), lhs_offset, std::chrono::milliseconds(1),
+        total_cols);
+    for (int i = 0; i < request_count; i++) {
+      MakeZero(&result[i]);
+      coalescer.Gemm(rhs[i].const_map(), &result[i].map(), params[i]);
+      Check(result[i] == expected[i]);
+    }
+    Check(coalescer.gemm_count() == request_count);
+  }
 }
 
 #endif  // not GEMMLOWP_SKIP_EXHAUSTIVE_TESTS
@@ -1661,6 +2527,8 @@ void TestOutputStages() {
                                                        14);
   TestOutputStages<BitDepthParams, MapOrder::ColMajor>(630, 10, 1270, 5, 17,
                                                        14);
+  // A single column takes the GEMV path, see single_thread_gemv.h.
+  TestOutputStages<BitDepthParams, MapOrder::ColMajor>(63, 10, 1, 5, 17, 14);
 }
 
 void test() {
@@ -1679,6 +2547,20 @@ void test() {
   TestExhaustivelyEightBitIntGemm<eight_bit_int_gemm::BitDepthSetting::A8B8>();
   TestExhaustivelyEightBitIntGemm<eight_bit_int_gemm::BitDepthSetting::A5B7>();
   TestKernels();
+  TestMultiThreadGemmTaskGrids();
+  TestMultiThreadGemmPipelinedRhsPacking();
+  TestMultiThreadGemmSplitDepth<DefaultL8R8BitDepthParams>();
+  TestMultiThreadGemmSplitDepth<L8R8WithLhsNonzeroBitDepthParams>();
+  TestSharedWorkersPoolGemm();
+  TestHotWorkersGemm();
+  TestTaskExecutorGemm();
+  TestGemmAsync();
+  TestGemmCancellation();
+  TestGemmBatch();
+  TestGemmCoalescer();
+  TestGemmCostModel();
+  TestGemvKernels();
+  TestGemvBandwidthMeasurement();
 #endif
 
   // Run against actual data from a network evaluation.
@@ -0,0 +1,457 @@
+// Copyright 2015 The Gemmlowp Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <atomic>  // NOLINT
+#include <chrono>  // NOLINT
+#include <mutex>   // NOLINT
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "../internal/multi_thread_gemm.h"
+#include "test.h"
+
+namespace gemmlowp {
+
+// A task recording how many times it ran, and with which allocator.
+// Tasks with a nonzero sleep_us simulate a slow or preempted thread.
+struct CountingTask : Task {
+  CountingTask() : run_count(0), allocator(nullptr), sleep_us(0) {}
+
+  void Run() override {
+    if (sleep_us) {
+      std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+    }
+    // Check that the allocator is usable from this thread.
+    const auto handle = local_allocator->Reserve<std::int32_t>(16);
+    local_allocator->Commit();
+    local_allocator->GetPointer<std::int32_t>(handle)[0] = 1;
+    local_allocator->Decommit();
+    allocator = local_allocator;
+    run_count.fetch_add(1);
+  }
+
+  std::atomic<int> run_count;
+  Allocator* allocator;
+  int sleep_us;
+};
+
+void test_work_stealing(WorkersPool* pool, int threads_count,
+                        int tasks_count) {
+  std::vector<CountingTask> tasks(tasks_count);
+  // Make the first thread's initial range of tasks much slower than the
+  // others, so that other threads have to steal from it.
+  for (int i = 0; i < tasks_count / threads_count; i++) {
+    tasks[i].sleep_us = 1000;
+  }
+  pool->ExecuteWithWorkStealing(threads_count, tasks_count, tasks.data());
+
+  std::vector<Allocator*> allocators;
+  for (const auto& task : tasks) {
+    Check(task.run_count.load() == 1);
+    if (std::find(allocators.begin(), allocators.end(), task.allocator) ==
+        allocators.end()) {
+      allocators.push_back(task.allocator);
+    }
+  }
+  // Each task ran on one of the threads_count threads, using its allocator.
+  Check(allocators.size() <= static_cast<std::size_t>(threads_count));
+}
+
+void test_workers_pool() {
+  WorkersPool pool;
+  // Repeating the entire test sequence ensures that we test reusing
+  // the pool with varying numbers of threads and tasks.
+  for (int repeat = 1; repeat <= 2; repeat++) {
+    for (int threads_count = 1; threads_count <= 5; threads_count++) {
+      for (int tasks_count : {1, 2, 3, 7, 16, 100}) {
+        test_work_stealing(&pool, threads_count, tasks_count);
+      }
+    }
+  }
+
+  // Without any busy-waiting, all waiting is passive.
+  pool.set_max_busy_wait_duration(std::chrono::nanoseconds::zero());
+  for (int threads_count = 1; threads_count <= 5; threads_count++) {
+    test_work_stealing(&pool, threads_count, 16);
+  }
+}
+
+// A task that is slower on a given thread, simulating a slower core.
+struct SlowOnThreadTask : Task {
+  void Run() override {
+    std::this_thread::sleep_for(std::chrono::microseconds(
+        std::this_thread::get_id() == slow_thread ? 2000 : 500));
+  }
+
+  std::thread::id slow_thread;
+};
+
+void test_thread_speeds() {
+  WorkersPool pool;
+  const int threads_count = 3;
+  // Not measured yet.
+  Check(pool.ThreadSpeeds(threads_count) ==
+        std::vector<float>(threads_count, 1.f));
+  // The current thread runs the last range of tasks, and is slower.
+  std::vector<SlowOnThreadTask> tasks(24);
+  for (auto& task : tasks) {
+    task.slow_thread = std::this_thread::get_id();
+  }
+  for (int repeat = 0; repeat < 10; repeat++) {
+    pool.ExecuteWithWorkStealing(threads_count, tasks.size(), tasks.data());
+  }
+  const std::vector<float> speeds = pool.ThreadSpeeds(threads_count);
+  Check(speeds[2] < speeds[0]);
+  Check(speeds[2] < speeds[1]);
+  Check(speeds[2] >= kMinThreadSpeed);
+  // Changing the placement of workers discards their speeds.
+  pool.set_affinity(AffinityPolicy::None);
+  Check(pool.ThreadSpeeds(threads_count) ==
+        std::vector<float>(threads_count, 1.f));
+}
+
+void test_busy_wait_budget() {
+  using std::chrono::microseconds;
+  using std::chrono::milliseconds;
+  BusyWaitBudget budget;
+  budget.set_max_duration(milliseconds(2));
+  // Without any observed interval, busy-wait for the maximum duration.
+  Check(budget.duration() == milliseconds(2));
+  // Back-to-back work: busy-wait long enough to cover the intervals.
+  for (int i = 0; i < 100; i++) {
+    budget.RecordIdleInterval(microseconds(400));
+  }
+  Check(budget.duration() >= microseconds(400));
+  Check(budget.duration() <= milliseconds(2));
+  // Short intervals within each batch of work don't hide the intervals
+  // between batches.
+  for (int i = 0; i < 100; i++) {
+    budget.RecordIdleInterval(microseconds(800));
+    budget.RecordIdleInterval(microseconds(5));
+    budget.RecordIdleInterval(microseconds(5));
+  }
+  Check(budget.duration() >= microseconds(800));
+  // Sparse work: busy-waiting would be wasted, so release the CPU quickly.
+  for (int i = 0; i < 100; i++) {
+    budget.RecordIdleInterval(milliseconds(50));
+  }
+  Check(budget.duration() == kMinBusyWaitDuration);
+  // Zero disables busy-waiting.
+  budget.set_max_duration(std::chrono::nanoseconds::zero());
+  Check(budget.duration() == std::chrono::nanoseconds::zero());
+}
+
+void test_worker_cpu_sets() {
+  // Two sockets of two physical cores of two hardware threads each.
+  std::vector<CpuInfo> topology;
+  for (int cpu = 0; cpu < 8; cpu++) {
+    CpuInfo info;
+    info.cpu = cpu;
+    info.core_id = cpu % 2;
+    info.package_id = (cpu / 2) % 2;
+    topology.push_back(info);
+  }
+  typedef std::vector<std::vector<int>> CpuSets;
+
+  Check(WorkerCpuSets(AffinityPolicy::None, {}, topology, 0).empty());
+  Check(WorkerCpuSets(AffinityPolicy::CpuSet, {1, 3}, topology, 0) ==
+        CpuSets({{1, 3}}));
+  // One CPU per physical core, the calling thread's core being last.
+  Check(WorkerCpuSets(AffinityPolicy::PhysicalCores, {}, topology, 5) ==
+        CpuSets({{0}, {2}, {3}, {5}}));
+  Check(WorkerCpuSets(AffinityPolicy::PhysicalCores, {}, topology, -1) ==
+        CpuSets({{0}, {1}, {2}, {3}}));
+  // Only the cores of the calling thread's socket.
+  Check(WorkerCpuSets(AffinityPolicy::SocketLocal, {}, topology, 6) ==
+        CpuSets({{3}, {6}}));
+  Check(WorkerCpuSets(AffinityPolicy::SocketLocal, {}, topology, 4) ==
+        CpuSets({{1}, {4}}));
+
+  // Pinning the workers of a pool to the actual CPUs.
+  WorkersPool pool;
+  for (AffinityPolicy policy :
+       {AffinityPolicy::PhysicalCores, AffinityPolicy::SocketLocal,
+        AffinityPolicy::None}) {
+    pool.set_affinity(policy);
+    for (int threads_count = 1; threads_count <= 5; threads_count++) {
+      test_work_stealing(&pool, threads_count, 16);
+    }
+  }
+}
+
+void test_hardware_concurrency() {
+  HardwareConcurrencyInfo info;
+  info.system_cpus = 64;
+  Check(ThreadsForHardwareConcurrency(info, true) == 64);
+  info.affinity_cpus = 8;
+  Check(ThreadsForHardwareConcurrency(info, true) == 8);
+  // Two hardware threads per physical core.
+  info.physical_cores = 4;
+  Check(ThreadsForHardwareConcurrency(info, true) == 4);
+  Check(ThreadsForHardwareConcurrency(info, false) == 8);
+  // Quotas are rounded down, but never below one thread.
+  info.cgroup_cpu_quota = 2.5;
+  Check(ThreadsForHardwareConcurrency(info, true) == 2);
+  Check(ThreadsForHardwareConcurrency(info, false) == 2);
+  info.cgroup_cpu_quota = 0.5;
+  Check(ThreadsForHardwareConcurrency(info, true) == 1);
+
+#ifdef __linux__
+  Check(ParseCgroupV2CpuMax("max 100000\n") == 0);
+  Check(ParseCgroupV2CpuMax("200000 100000\n") == 2);
+  Check(ParseCgroupV2CpuMax("150000 100000") == 1.5);
+  Check(ParseCgroupV2CpuMax("") == 0);
+  Check(ParseCgroupV1CpuQuota("-1\n", "100000\n") == 0);
+  Check(ParseCgroupV1CpuQuota("400000\n", "100000\n") == 4);
+  Check(ParseCgroupV1CpuQuota("50000", "100000") == 0.5);
+#endif
+
+  // Two sockets of two physical cores of two hardware threads each.
+  std::vector<CpuInfo> topology;
+  for (int cpu = 0; cpu < 8; cpu++) {
+    CpuInfo cpu_info;
+    cpu_info.cpu = cpu;
+    cpu_info.core_id = cpu % 2;
+    cpu_info.package_id = (cpu / 2) % 2;
+    topology.push_back(cpu_info);
+  }
+  Check(CountPhysicalCores(topology) == 4);
+  Check(CountPhysicalCores(GetCpuTopology()) >= 1);
+
+  const HardwareConcurrencyInfo& detected = GetHardwareConcurrencyInfo();
+  Check(detected.threads >= 1);
+  Check(detected.threads <= detected.logical_threads);
+  Check(detected.logical_threads <= std::max(detected.system_cpus, 1));
+  Check(GetHardwareConcurrency(0) == detected.threads);
+  Check(GetHardwareConcurrency(3) == 3);
+}
+
+void test_shared_workers_pool() {
+  SharedWorkersPool shared_pool(3);
+  Check(shared_pool.threads_count() == 3);
+  // Several threads execute tasks concurrently on the same shared workers,
+  // each through its own WorkersPool.
+  std::vector<std::thread> callers;
+  for (int c = 0; c < 4; c++) {
+    callers.emplace_back([&shared_pool]() {
+      WorkersPool pool;
+      pool.set_shared_pool(&shared_pool);
+      for (int repeat = 0; repeat < 20; repeat++) {
+        for (int tasks_count : {1, 2, 7, 16}) {
+          std::vector<CountingTask> tasks(tasks_count);
+          pool.ExecuteWithWorkStealing(4, tasks_count, tasks.data());
+          for (const auto& task : tasks) {
+            Check(task.run_count.load() == 1);
+          }
+        }
+      }
+    });
+  }
+  for (auto& caller : callers) {
+    caller.join();
+  }
+}
+
+void test_worker_idle_timeout() {
+  WorkersPool pool;
+  pool.set_max_busy_wait_duration(std::chrono::microseconds(100));
+  pool.set_worker_idle_timeout(std::chrono::milliseconds(1));
+  for (int repeat = 0; repeat < 3; repeat++) {
+    // Back-to-back work, before workers time out.
+    for (int tasks_count : {4, 16}) {
+      test_work_stealing(&pool, 4, tasks_count);
+    }
+    // Long enough for all workers to exit.
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  const WorkerRespawnStats& stats = pool.respawn_stats();
+  Check(stats.count >= 3);
+  Check(stats.max_latency > std::chrono::nanoseconds::zero());
+  Check(stats.total_latency >= stats.max_latency);
+
+  // A worker releases its thread as soon as it exits on its idle timeout,
+  // rather than when it gets recreated or destroyed: by then, its thread
+  // is done with it and, being detached, has nothing left to be joined.
+  BusyWaitBudget budget;
+  budget.set_max_duration(std::chrono::microseconds(100));
+  BlockingCounter counter;
+  counter.Reset(1);
+  Worker worker(&counter, &budget, std::vector<int>(),
+                std::chrono::milliseconds(1));
+  counter.Wait();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  Check(worker.thread_exited());
+  CountingTask task;
+  Check(!worker.TryStartWork(&task));
+  Check(task.run_count.load() == 0);
+
+  // By default, workers never exit.
+  WorkersPool default_pool;
+  test_work_stealing(&default_pool, 4, 16);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  test_work_stealing(&default_pool, 4, 16);
+  Check(default_pool.respawn_stats().count == 0);
+}
+
+void test_hot_window() {
+  BusyWaitBudget budget;
+  Check(!budget.hot());
+  budget.BeginHotWindow();
+  budget.BeginHotWindow();
+  budget.EndHotWindow();
+  Check(budget.hot());
+  budget.EndHotWindow();
+  Check(!budget.hot());
+
+  // Workers that would otherwise exit on their idle timeout keep running
+  // while hot, since they never wait passively.
+  WorkersPool pool;
+  pool.set_max_busy_wait_duration(std::chrono::microseconds(100));
+  pool.set_worker_idle_timeout(std::chrono::milliseconds(1));
+  pool.BeginHotWindow();
+  test_work_stealing(&pool, 4, 16);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  test_work_stealing(&pool, 4, 16);
+  Check(pool.respawn_stats().count == 0);
+  pool.EndHotWindow();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  test_work_stealing(&pool, 4, 16);
+  Check(pool.respawn_stats().count > 0);
+
+  // With a shared pool, its workers are kept hot.
+  SharedWorkersPool shared_pool(3);
+  WorkersPool shared_user;
+  shared_user.set_shared_pool(&shared_pool);
+  shared_user.BeginHotWindow();
+  Check(shared_pool.busy_wait_budget().hot());
+  test_work_stealing(&shared_user, 4, 16);
+  shared_user.EndHotWindow();
+  Check(!shared_pool.busy_wait_budget().hot());
+}
+
+void test_work_priorities() {
+  // A single worker, busy with a long batch of normal-priority tasks.
+  SharedWorkersPool shared_pool(1);
+  std::vector<CountingTask> normal_tasks(20);
+  std::vector<Task*> normal_task_pointers;
+  for (auto& task : normal_tasks) {
+    task.sleep_us = 1000;
+    normal_task_pointers.push_back(&task);
+  }
+  BlockingCounter normal_counter;
+  SharedWorkersPool::Batch normal_batch;
+  shared_pool.Start(normal_task_pointers.data(), normal_task_pointers.size(),
+                    &normal_counter, &normal_batch);
+  // A high-priority batch submitted meanwhile only waits for the task that
+  // the worker is running, not for the rest of the normal batch.
+  std::vector<CountingTask> high_tasks(2);
+  std::vector<Task*> high_task_pointers;
+  for (auto& task : high_tasks) {
+    high_task_pointers.push_back(&task);
+  }
+  BlockingCounter high_counter;
+  SharedWorkersPool::Batch high_batch;
+  shared_pool.Start(high_task_pointers.data(), high_task_pointers.size(),
+                    &high_counter, &high_batch, WorkPriority::High);
+  shared_pool.Wait(&high_counter);
+  Check(!normal_counter.Poll());
+  shared_pool.Wait(&normal_counter);
+  for (const auto& task : normal_tasks) {
+    Check(task.run_count.load() == 1);
+  }
+  for (const auto& task : high_tasks) {
+    Check(task.run_count.load() == 1);
+  }
+
+  // Through WorkersPools: with work stealing, tasks are handed to the
+  // shared pool one by one.
+  WorkersPool pool;
+  pool.set_shared_pool(&shared_pool);
+  pool.set_priority(WorkPriority::High);
+  Check(pool.priority() == WorkPriority::High);
+  for (int tasks_count : {1, 7, 16}) {
+    test_work_stealing(&pool, 4, tasks_count);
+  }
+}
+
+// A TaskExecutor running everything serially on the calling thread, in
+// reverse order, and counting the loops it ran.
+struct SerialReverseExecutor : TaskExecutor {
+  SerialReverseExecutor() : loops(0) {}
+
+  void ParallelFor(int count, ParallelForBody* body) override {
+    loops++;
+    for (int i = count - 1; i >= 0; i--) {
+      body->Run(i);
+    }
+  }
+
+  int loops;
+};
+
+void test_task_executor() {
+  SerialReverseExecutor serial_executor;
+  {
+    WorkersPool pool;
+    pool.set_executor(&serial_executor);
+    for (int threads_count = 1; threads_count <= 5; threads_count++) {
+      for (int tasks_count : {1, 2, 7, 16}) {
+        test_work_stealing(&pool, threads_count, tasks_count);
+      }
+    }
+    Check(serial_executor.loops == 5 * 4);
+  }
+
+  // Through the reference adapter, over threads spawned for each call.
+  std::mutex threads_mutex;
+  std::vector<std::thread> threads;
+  ScheduleTaskExecutor schedule_executor(
+      [&threads, &threads_mutex](std::function<void()> f) {
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        threads.emplace_back(f);
+      });
+  WorkersPool pool;
+  pool.set_executor(&schedule_executor);
+  for (int threads_count = 1; threads_count <= 5; threads_count++) {
+    test_work_stealing(&pool, threads_count, 16);
+  }
+  // An empty loop returns without calling the body nor scheduling anything.
+  struct CountingBody : ParallelForBody {
+    void Run(int) override { runs++; }
+    int runs = 0;
+  } body;
+  const std::size_t scheduled = threads.size();
+  schedule_executor.ParallelFor(0, &body);
+  Check(body.runs == 0);
+  Check(threads.size() == scheduled);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+}  // end namespace gemmlowp
+
+int main() {
+  gemmlowp::test_workers_pool();
+  gemmlowp::test_thread_speeds();
+  gemmlowp::test_busy_wait_budget();
+  gemmlowp::test_worker_cpu_sets();
+  gemmlowp::test_hardware_concurrency();
+  gemmlowp::test_shared_workers_pool();
+  gemmlowp::test_work_priorities();
+  gemmlowp::test_worker_idle_timeout();
+  gemmlowp::test_hot_window();
+  gemmlowp::test_task_executor();
+}